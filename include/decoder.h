@@ -5,11 +5,18 @@
 #include "utils/utils.h"
 #include "utils/audio.h"
 #include "utils/metadata.h"
+#include "utils/gain.h"
 
 struct decoder_stream {
     struct audio_format fmt;
+    u64 length; // in frames, 0 if unknown
+    struct gain_replaygain replaygain; // set by the core after open
 
     void (*close)(struct decoder_stream *);
+    // Positions are in frames at fmt.sample_rate. seek moves relative to the frame
+    // the next read would return. Both store the frame the next read will return in
+    // *pos. It can be before the requested frame but must not be after it unless the
+    // stream ends there.
     int (*seek)(struct decoder_stream *, i64 diff, u64 *pos, bool *eof);
     int (*seek_abs)(struct decoder_stream *, u64 pos, u64 *opos);
     int (*read)(struct decoder_stream *, u8 *buf, size_t *len, u64 *pos);
@@ -17,6 +24,9 @@ struct decoder_stream {
 
 struct decoder {
     const char *name;
+    // NULL-terminated list of the file extensions the decoder handles. They are
+    // matched case-insensitively.
+    const char *const *extensions;
 
     int (*free)(struct decoder *);
     struct decoder_stream *(*open)(struct decoder *, const char *path,
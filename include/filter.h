@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "utils/utils.h"
+#include "utils/audio.h"
+
+// A filter instance processes the samples of one sink stream, or of one file in render
+// mode. An instance is only used by one thread but open may be called by several
+// render threads at once.
+struct filter_instance {
+    void (*close)(struct filter_instance *);
+    // Processes frames in place. The samples have the format the instance was opened
+    // with.
+    void (*process)(struct filter_instance *, u8 *buf, size_t frames);
+    // Forgets all buffered samples, e.g., after a seek.
+    void (*reset)(struct filter_instance *);
+    // Number of frames by which the output lags behind the input.
+    u32 (*latency)(struct filter_instance *);
+};
+
+struct filter {
+    const char *name;
+    // Sample formats the filter can process. The player prefers sink formats that all
+    // filters support.
+    audio_sample_fmt_type sample_fmts;
+    // If set, the filter is skipped. May be changed from any thread.
+    _Atomic bool bypass;
+
+    int (*free)(struct filter *);
+    // Returns NULL if the format is not supported, in which case the filter is skipped
+    // for this sink stream.
+    struct filter_instance *(*open)(struct filter *, const struct audio_format *);
+};
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -1,6 +1,14 @@
 #pragma once
 
+#include <stdbool.h>
+
+#include "utils/loop.h"
+
 extern struct worker *worker;
 extern struct diag *main_diag;
+// Set by $OKA_LOOP_STATS. The loops record the latency of their callbacks.
+extern bool main_loop_stats;
+// Set by $OKA_LOOP_BACKEND.
+extern enum loop_backend main_loop_backend;
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
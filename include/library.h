@@ -0,0 +1,13 @@
+#pragma once
+
+// The type of the worker jobs that scan a directory.
+#define LIBRARY_JOB_SCAN (1 << 1)
+
+// Scans the directories in $OKA_LIBRARY, separated by colons, with low priority worker
+// jobs. The metadata of new and changed audio files is added to the metadata cache.
+// $OKA_SCAN_THREADS limits the number of low priority jobs that run at the same time.
+// It should be 1 for spinning disks.
+void library_init(void);
+void library_exit(void);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
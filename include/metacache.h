@@ -0,0 +1,19 @@
+#pragma once
+
+#include "utils/cache.h"
+#include "utils/metadata.h"
+
+// Metadata of audio files that persists between runs. The cache file is mapped at
+// startup and indexed in memory. New entries are written and the file is compacted by
+// a background thread.
+
+void metacache_init(void);
+void metacache_exit(void);
+
+// Returns a reference to the metadata of path or NULL if there is no entry with a
+// matching key.
+struct metadata *metacache_get(const char *path, const struct cache_key *key);
+// Replaces the entry of path. The cache takes its own reference.
+void metacache_put(const char *path, const struct cache_key *key, struct metadata *md);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -2,20 +2,35 @@
 
 #include <time.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "utils/loop.h"
 
 #include "sink.h"
 #include "decoder.h"
+#include "filter.h"
 #include "main.h"
 
 void player_init(void);
 void player_exit(void);
 void player_set_sink(struct sink *sink);
+// Appends the filter to the chain applied to all samples before they reach the sink.
+void player_add_filter(struct filter *filter);
 void player_set_input(struct decoder_stream *, struct main_track_cookie *);
+void player_set_next_track(u64 id, struct decoder_stream *, struct main_track_cookie *);
+void player_get_buffer_fill(u32 *fill_ms, u32 *size_ms);
+// Prints the time each filter has spent processing samples.
+void player_print_filter_stats(void);
+void player_get_delegate_stats(struct delegator_stats *s);
+void player_dump_loop_stats(FILE *file);
+u64 player_get_position_ms(void);
 void player_get_sink_ops(const struct sink_ops **ops, struct loop **loop);
 void player_toggle_pause(void);
 void player_toggle_mute(void);
+// Changes the software volume by diff percentage points. It is applied to newly
+// buffered samples.
+void player_change_volume(i32 diff);
+// Seeks by diff milliseconds relative to the frame that is being played.
 void player_seek(i64 diff);
 void player_goto_next(void);
 void player_stop(void);
@@ -9,12 +9,14 @@
 
 #include "sink.h"
 #include "decoder.h"
+#include "filter.h"
 
-#define PLUGIN_API_VERSION 1
+#define PLUGIN_API_VERSION 4
 
 struct plugin_ops {
     int (*add_sink)(struct sink *, const struct sink_ops **, struct loop **);
     int (*add_decoder)(struct decoder *);
+    int (*add_filter)(struct filter *);
 };
 
 struct plugin_api {
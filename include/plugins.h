@@ -7,7 +7,15 @@ struct plugin_ip_opened;
 
 void plugins_init(void);
 void plugins_exit(void);
+// Hands the filters and the selected sink to the player.
+void plugins_start_player(void);
 
+// Safe to call from any thread once the plugins have been loaded.
 struct decoder_stream *plugins_open(const char *path);
+// Returns the decoder that handles the extension of path or NULL.
+struct decoder *plugins_find_decoder(const char *path);
+// Extracts the metadata of path without consulting the metadata cache.
+struct metadata *plugins_read_metadata(struct decoder *decoder, const char *path);
+void plugins_get_filters(struct filter ***filters, size_t *num);
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
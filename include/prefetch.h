@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "utils/utils.h"
+
+#include "decoder.h"
+
+struct prefetch;
+
+struct prefetch *prefetch_new(struct decoder_stream *s, u32 buffer_ms);
+void prefetch_free(struct prefetch *p);
+int prefetch_fd(const struct prefetch *p);
+void prefetch_clear_fd(const struct prefetch *p);
+size_t prefetch_read(struct prefetch *p, u8 *buf, size_t len);
+bool prefetch_eof(const struct prefetch *p);
+bool prefetch_decoded(const struct prefetch *p);
+u64 prefetch_pos(const struct prefetch *p);
+u32 prefetch_fill_ms(const struct prefetch *p);
+u32 prefetch_size_ms(const struct prefetch *p);
+// Seeks are in frames relative to prefetch_pos. Frames the decoder lands before the
+// requested one are discarded so that the next read starts exactly there. If the decoder
+// cannot seek, the position and the buffered frames stay as they were.
+int prefetch_seek(struct prefetch *p, i64 diff, bool *eof);
+int prefetch_seek_abs(struct prefetch *p, u64 pos);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
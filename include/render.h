@@ -0,0 +1,13 @@
+#pragma once
+
+#include "utils/utils.h"
+
+// Offline mode that decodes inputs, runs them through the filters, and writes them to
+// WAV files as fast as possible. paths holds num pairs of input and output paths. The
+// jobs are distributed over several threads. main_render_done is called once all of
+// them are finished.
+void render_init(char **paths, size_t num);
+// Returns the number of jobs that failed.
+size_t render_exit(void);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
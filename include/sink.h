@@ -22,6 +22,10 @@ struct sink {
     int (*commit_buf)(struct sink *, u8 *, size_t);
 
     u32 (*latency)(struct sink *);
+    // Number of frames played since the sink last started a new stream, i.e. since the
+    // last flush or the last set_format call that changed the format. After
+    // set_format(NULL) it keeps counting until the stream has been drained.
+    u64 (*played)(struct sink *);
 };
 
 struct sink_info {
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "utils/utils.h"
+
+// Files under $XDG_CACHE_HOME/oka holding data derived from other files. An entry
+// records the size and modification time of the file it was derived from and is ignored
+// once they change.
+
+struct cache_key {
+    u64 size;
+    i64 mtime_sec;
+    i64 mtime_nsec;
+};
+
+// A loaded entry. The data is mapped read-only and 8-byte aligned.
+struct cache_entry {
+    void *map;
+    size_t map_len;
+    const void *data;
+    size_t len;
+};
+
+// Returns the path of the cache directory dir. The directory is created if create is
+// set.
+char *cache_dir(const char *dir, bool create);
+
+int cache_key_get(const char *path, struct cache_key *key);
+
+// Loads the entry of path from the cache directory dir. Fails if there is no entry
+// whose magic and key match.
+int cache_load(const char *dir, const char magic[static 8], const char *path,
+        const struct cache_key *key, struct cache_entry *entry);
+void cache_entry_free(struct cache_entry *entry);
+
+// Atomically replaces the entry of path.
+int cache_store(const char *dir, const char magic[static 8], const char *path,
+        const struct cache_key *key, const void *data, size_t len);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
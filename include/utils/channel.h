@@ -2,20 +2,38 @@
 
 #include <stdbool.h>
 
+#include "utils/utils.h"
+
+// Messages embed a node, so pushing does not allocate. Any thread can push without
+// waiting, but only one thread at a time may pop or remove.
+struct channel_node {
+    struct channel_node *_Atomic next;
+};
+
 struct channel;
 
-typedef bool (*channel_remove_cb)(void *, void *opaque);
+typedef bool (*channel_remove_cb)(struct channel_node *node, void *opaque);
 
-struct channel *channel_new(bool need_pipe);
+struct channel *channel_new(bool need_fd);
 void channel_free(struct channel *c);
-void channel_push(struct channel *c, void *data);
-void *channel_pop__(struct channel *c);
-void *channel_pop_wait__(struct channel *c);
+void channel_push(struct channel *c, struct channel_node *node);
+struct channel_node *channel_pop(struct channel *c);
+struct channel_node *channel_pop_wait(struct channel *c);
 void channel_remove(struct channel *c, channel_remove_cb cb, void *opaque);
+// The fd is readable once a node has been pushed. It is only written again after the
+// consumer has called channel_clear_fd, which it has to do before popping.
 int channel_fd(struct channel *c);
 void channel_clear_fd(struct channel *c);
+// Has to be called instead of channel_clear_fd by a consumer that has read the fd itself.
+void channel_fd_cleared(struct channel *c);
+void channel_signal_fd(struct channel *c);
+// Returns how often the fd has been written.
+u64 channel_fd_signals(struct channel *c);
 
-#define channel_pop(c, type) (type *)channel_pop__(c)
-#define channel_pop_wait(c, type) (type *)channel_pop_wait__(c)
+// Like container_of but NULL stays NULL.
+#define channel_entry(node, type, member) __extension__ ({ \
+    struct channel_node *node__ = (node); \
+    node__ ? container_of(node__, type, member) : NULL; \
+})
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
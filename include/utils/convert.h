@@ -0,0 +1,12 @@
+#pragma once
+
+#include "utils/utils.h"
+#include "utils/audio.h"
+
+// Converts samples between any two sample formats. in and out may point to the same
+// buffer, in which case the conversion happens in place. Other kinds of overlap are not
+// supported.
+void convert_samples(audio_sample_fmt_type from, audio_sample_fmt_type to,
+        const void *in, void *out, size_t samples);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
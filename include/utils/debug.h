@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdnoreturn.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 __attribute__((format(printf, 2, 3)))
@@ -15,11 +17,7 @@ void debug_warn__(const char *function, const char *fmt, ...);
 #define WARN(...) debug_warn__(__FUNCTION__, __VA_ARGS__)
 #define WARN_ON(cond) __extension__ ({if (cond) debug_warn__(__FUNCTION__, "%s", #cond);})
 
-#if 0
-#   define TRACE(fmt, ...) __extension__ ({fprintf(stderr, "%s:%d: "fmt"\n", \
-            __FUNCTION__, __LINE__, ##__VA_ARGS__);})
-#else
-#   define TRACE(fmt, ...) { }
-#endif
+// Names code by its object file and the offset in it, which addr2line understands.
+void debug_addr_name(uintptr_t addr, char *buf, size_t len);
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
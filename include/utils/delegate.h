@@ -1,16 +1,40 @@
 #pragma once
 
+#include <stdatomic.h>
+
+#include "utils/channel.h"
+
+// A delegate that is still queued is not queued again, so a static delegate can be
+// delegated any number of times. Delegating it again before it has run coalesces both
+// calls into one run. Actions that have to happen once per call need a new delegate
+// for every call.
 struct delegate {
     void (*run)(struct delegate *);
+    struct channel_node node;
+    atomic_bool queued;
 };
 
 struct delegator;
 
+// Called after each delegate has run, with the time it was started at.
+typedef void (*delegator_observer)(void (*run)(struct delegate *), u64 start_ns,
+        void *opaque);
+
+struct delegator_stats {
+    u64 delegates; // delegates that have run
+    u64 wakeups; // calls of delegator_run
+    u64 signals; // writes to the fd
+};
+
 struct delegator *delegator_new(void);
 int delegator_fd(struct delegator *);
 void delegator_run(struct delegator *);
+// Like delegator_run for a caller that has already read the fd, e.g. asynchronously.
+void delegator_run_cleared(struct delegator *);
 void delegator_free(struct delegator *);
 void delegator_delegate(struct delegator *, struct delegate *);
 void delegator_delegate_sync(struct delegator *, struct delegate *);
+void delegator_get_stats(struct delegator *, struct delegator_stats *);
+void delegator_set_observer(struct delegator *, delegator_observer cb, void *opaque);
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "utils/utils.h"
+#include "utils/audio.h"
+#include "utils/metadata.h"
+
+// ReplayGain values of a track. Gains are in dB, peaks are linear. Unknown values are
+// NAN.
+struct gain_replaygain {
+    float track_gain;
+    float track_peak;
+    float album_gain;
+    float album_peak;
+};
+
+void gain_replaygain_parse(struct gain_replaygain *rg, const struct metadata *md);
+float gain_from_db(float db);
+
+// Multiplies the samples by gain in place. Integer formats saturate.
+void gain_apply(audio_sample_fmt_type fmt, void *buf, size_t samples, float gain);
+
+// Mixes two interleaved float buffers with an equal-power crossfade. in fades in and
+// receives the result, out fades out. Frame i is at position (pos + i) / len of the
+// fade.
+void gain_crossfade(float *in, const float *out, size_t frames, u32 channels, u64 pos,
+        u64 len);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -1,8 +1,18 @@
 #pragma once
 
+#include <stddef.h>
+
 #include "utils/metadata.h"
 
-void id3_metadata(const char tag[static 4], const char *txt,
+// The text does not have to be NUL-terminated. Keys that are already set are not
+// overwritten.
+void id3_metadata(const char tag[static 4], const char *txt, size_t len,
+        char *metadata[static METADATA_NUM_TAGS]);
+void id3_txxx_metadata(const char *desc, size_t desc_len, const char *txt, size_t len,
         char *metadata[static METADATA_NUM_TAGS]);
 
+// Reads the ID3v2, APEv2 and ID3v1 tags of a file. Only the start and the end of the
+// file are mapped, the audio data is never read.
+int id3_read(const char *path, char *metadata[static METADATA_NUM_TAGS]);
+
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
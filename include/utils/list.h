@@ -12,6 +12,7 @@ void list_append(struct list *head, struct list *node);
 void list_insert_before(struct list *before, struct list *node);
 void list_remove(struct list *node);
 struct list *list_pop_first(struct list *head);
+void list_splice(struct list *head, struct list *from);
 bool list_empty(struct list *head);
 size_t list_len(struct list *head);
 
@@ -2,6 +2,8 @@
 
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "utils/utils.h"
 #include "utils/delegate.h"
@@ -11,15 +13,61 @@ struct loop_watch;
 struct loop_defer;
 struct loop_timer;
 
+// With io_uring, watches are polls, timers are timeouts and delegates are announced by
+// reads, all submitted together with the wait. Watches, timers and delegates then cost no
+// system calls of their own.
+enum loop_backend {
+    LOOP_BACKEND_EPOLL,
+    LOOP_BACKEND_URING,
+};
+
+enum loop_kind {
+    LOOP_KIND_WATCH,
+    LOOP_KIND_TIMER,
+    LOOP_KIND_DEFER,
+    LOOP_KIND_DELEGATE,
+    LOOP_NUM_KINDS,
+};
+
+// Latencies of one callback function. The percentiles are exact to 12.5%.
+struct loop_cb_stats {
+    enum loop_kind kind;
+    uintptr_t cb;
+    u64 calls;
+    u64 total_ns;
+    u64 max_ns;
+    u64 p50_ns;
+    u64 p99_ns;
+    u64 p999_ns;
+};
+
+// A wakeup counts for every kind of callback that was ready.
+struct loop_wakeup_stats {
+    u64 elapsed_ns;
+    u64 wakeups;
+    u64 by_kind[LOOP_NUM_KINDS];
+};
+
 typedef void (*loop_watch_cb)(struct loop_watch *, void *, int, u32);
 typedef void (*loop_defer_cb)(struct loop_defer *, void *);
 typedef void (*loop_timer_cb)(struct loop_timer *, void *);
 
 struct loop *loop_new(void);
+// Falls back to epoll if io_uring is not available.
+struct loop *loop_new_backend(enum loop_backend backend);
+enum loop_backend loop_get_backend(struct loop *loop);
 void loop_free(struct loop *loop);
 
 void loop_delegate(struct loop *loop, struct delegate *d);
 void loop_delegate_sync(struct loop *loop, struct delegate *d);
+void loop_get_delegate_stats(struct loop *loop, struct delegator_stats *s);
+// Records the latency of every callback the loop runs. While disabled, this costs a
+// branch per callback. Has to be called before the loop runs.
+void loop_enable_stats(struct loop *loop);
+// The stats can be read while the loop runs. elapsed_ns is 0 if they are disabled.
+void loop_get_wakeup_stats(struct loop *loop, struct loop_wakeup_stats *s);
+size_t loop_get_cb_stats(struct loop *loop, struct loop_cb_stats *s, size_t num);
+void loop_dump_stats(struct loop *loop, const char *name, FILE *file);
 
 // NOTE: None of the following functions are thread-safe.
 
@@ -28,6 +76,8 @@ void loop_stop(struct loop *loop, int ret);
 void loop_force_iteration(struct loop *loop);
 
 struct loop_watch *loop_watch_new(struct loop *loop, loop_watch_cb cb, void *opaque);
+// events are epoll events. Watches are level-triggered unless EPOLLET is set, which is
+// cheaper with io_uring but requires the callback to consume everything that is ready.
 void loop_watch_set(struct loop_watch *w, int fd, u32 events);
 void loop_watch_disable(struct loop_watch *w);
 void loop_watch_free(struct loop_watch *w);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "utils/utils.h"
+
 enum metadata_key {
     METADATA_ARTIST,
     METADATA_ALBUM,
@@ -13,6 +15,10 @@ enum metadata_key {
     METADATA_COMPILATION,
     METADATA_REMIXER,
     METADATA_BPM,
+    METADATA_REPLAYGAIN_TRACK_GAIN,
+    METADATA_REPLAYGAIN_TRACK_PEAK,
+    METADATA_REPLAYGAIN_ALBUM_GAIN,
+    METADATA_REPLAYGAIN_ALBUM_PEAK,
 
     METADATA_INVALID,
 };
@@ -26,9 +32,11 @@ struct metadata_pair {
 
 typedef char metadata_date_format[sizeof("20120425")];
 
+// Immutable and reference counted. The pairs are terminated by a pair whose key is
+// METADATA_INVALID. year is 0 if the date is unknown.
 struct metadata {
     _Atomic size_t refcount;
-    
+
     char *artist;
     char *albumartist;
     char *title;
@@ -39,4 +47,10 @@ struct metadata {
     struct metadata_pair pairs[];
 };
 
+// Copies the tags that are set into a new object with one reference.
+struct metadata *metadata_new(char *const tags[static METADATA_NUM_TAGS]);
+struct metadata *metadata_ref(struct metadata *md);
+void metadata_unref(struct metadata *md);
+const char *metadata_get(const struct metadata *md, enum metadata_key key);
+
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "utils/utils.h"
+
+// Polyphase sample rate converter for interleaved float samples.
+
+enum resample_quality {
+    RESAMPLE_FAST, // linear interpolation
+    RESAMPLE_MEDIUM,
+    RESAMPLE_HIGH,
+};
+
+struct resampler;
+
+struct resampler *resampler_new(u32 in_rate, u32 out_rate, u32 channels,
+        enum resample_quality q);
+void resampler_free(struct resampler *r);
+void resampler_reset(struct resampler *r);
+u32 resampler_in_rate(const struct resampler *r);
+u32 resampler_channels(const struct resampler *r);
+
+// Number of input frames that have to be pushed before `frames` output frames can be
+// pulled.
+size_t resampler_needed(const struct resampler *r, size_t frames);
+void resampler_push(struct resampler *r, const float *in, size_t frames);
+size_t resampler_pull(struct resampler *r, float *out, size_t frames);
+// Pulls the frames that the filter holds back as lookahead at the end of the input. No
+// input can be pushed after the drain has started until the resampler is reset.
+size_t resampler_drain(struct resampler *r, float *out, size_t frames);
+bool resampler_draining(const struct resampler *r);
+// True once every frame of the input has been pulled.
+bool resampler_drained(const struct resampler *r);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
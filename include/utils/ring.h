@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "utils/utils.h"
+
+// Single-producer single-consumer byte ring. The producer and the consumer may run on
+// different threads without further synchronization.
+
+struct ring;
+
+struct ring *ring_new(size_t size);
+void ring_free(struct ring *r);
+void ring_reset(struct ring *r);
+size_t ring_size(const struct ring *r);
+size_t ring_fill(const struct ring *r);
+
+u8 *ring_write_buf(struct ring *r, size_t *len);
+void ring_write_commit(struct ring *r, size_t len);
+
+u8 *ring_read_buf(struct ring *r, size_t *len);
+void ring_read_commit(struct ring *r, size_t len);
+size_t ring_read(struct ring *r, u8 *buf, size_t len);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
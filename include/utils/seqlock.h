@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "utils/utils.h"
+
+// Sequence lock with a single writer and any number of readers. The writer never
+// blocks. Readers retry if the writer modified the data while they were reading it.
+// The protected data must only be accessed with relaxed atomic operations.
+
+struct seqlock {
+    _Atomic u32 seq;
+};
+
+void seqlock_write_begin(struct seqlock *l);
+void seqlock_write_end(struct seqlock *l);
+u32 seqlock_read_begin(struct seqlock *l);
+bool seqlock_read_retry(struct seqlock *l, u32 seq);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -28,6 +28,7 @@ void thread_mutex_unlock(pthread_mutex_t *mutex);
 void thread_mutex_unlockp(pthread_mutex_t **mutex);
 
 void thread_cond_signal(pthread_cond_t *cond);
+void thread_cond_broadcast(pthread_cond_t *cond);
 void thread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 
 void thread_once(pthread_once_t *once_control, void (*init_routine)(void));
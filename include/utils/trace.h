@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "utils/utils.h"
+
+// Every thread records its events in its own ring. Old events are overwritten. The
+// rings can be exported in the Chrome trace format at any time, which Perfetto and
+// chrome://tracing show as one timeline. While tracing is disabled, an event costs a
+// branch.
+
+enum trace_id {
+    TRACE_DECODE,
+    TRACE_PROVIDE_BUF,
+    TRACE_COMMIT_BUF,
+    TRACE_SINK_REQUEST,
+    TRACE_WATCH,
+    TRACE_TIMER,
+    TRACE_DEFER,
+    TRACE_DELEGATE,
+    TRACE_JOB,
+    TRACE_NUM_IDS,
+};
+
+enum trace_phase {
+    TRACE_PHASE_BEGIN,
+    TRACE_PHASE_END,
+    TRACE_PHASE_INSTANT,
+};
+
+extern atomic_bool trace_enabled__;
+
+void trace_emit__(enum trace_id id, enum trace_phase phase, u64 a0, u64 a1);
+
+// Has to be called before the threads that should be traced are started.
+void trace_enable(void);
+// Names the calling thread in the trace.
+__attribute__((format(printf, 1, 2)))
+void trace_thread_name(const char *fmt, ...);
+void trace_export(FILE *file);
+
+static inline bool trace_enabled(void)
+{
+    return __builtin_expect(atomic_load_explicit(&trace_enabled__,
+            memory_order_relaxed), 0);
+}
+
+// The arguments of the callbacks of the loop and the worker are the callback functions.
+static inline void trace_begin(enum trace_id id, u64 a0, u64 a1)
+{
+    if (trace_enabled())
+        trace_emit__(id, TRACE_PHASE_BEGIN, a0, a1);
+}
+
+static inline void trace_end(enum trace_id id, u64 a0, u64 a1)
+{
+    if (trace_enabled())
+        trace_emit__(id, TRACE_PHASE_END, a0, a1);
+}
+
+static inline void trace_instant(enum trace_id id, u64 a0, u64 a1)
+{
+    if (trace_enabled())
+        trace_emit__(id, TRACE_PHASE_INSTANT, a0, a1);
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+#include "utils/utils.h"
+
+// A minimal io_uring built on the system calls. A ring must only be used by one thread
+// at a time.
+
+struct uring;
+
+// Returns NULL if the kernel does not support everything the loop needs or io_uring has
+// been disabled.
+struct uring *uring_new(u32 entries);
+void uring_free(struct uring *r);
+// Returns a zeroed SQE. It is submitted by the next uring_enter. If the submission queue
+// is full, the queued SQEs are submitted first.
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+// Submits the queued SQEs. If wait is set and no completion is available, waits for one.
+// Does not make a system call if there is nothing to submit and nothing to wait for.
+void uring_enter(struct uring *r, bool wait);
+// Copies up to num of the available completions to cqes and returns how many.
+size_t uring_pop_cqes(struct uring *r, struct io_uring_cqe *cqes, size_t num);
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
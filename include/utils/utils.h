@@ -117,6 +117,7 @@ struct slice {
 char *utils_strerr(int no);
 void utils_freep(void *data);
 u64 utils_get_mono_time_ms(void);
+u64 utils_get_mono_time_ns(void);
 
 int utils_eventfd(void);
 void utils_signal_eventfd(int fd);
@@ -17,6 +17,7 @@
 void *xmalloc__(size_t size);
 void *xrealloc__(void *ptr, size_t size);
 char *xstrdup(const char *s);
+char *xstrndup(const char *s, size_t len);
 char *xstrjoin__(struct slice slice);
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -1,22 +1,62 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "utils/utils.h"
+#include "utils/channel.h"
 
 struct worker;
 
-typedef bool (*worker_cancel_job_cb)(u32 type, void *data, void *opaque);
+// Jobs of a higher priority are started before all queued jobs of a lower priority.
+// Running jobs are not interrupted.
+enum worker_priority {
+    WORKER_PRIORITY_HIGH, // the user waits for the result, e.g. opening the next track
+    WORKER_PRIORITY_NORMAL,
+    WORKER_PRIORITY_LOW, // bulk work such as scanning the library
+    WORKER_NUM_PRIORITIES,
+};
+
+typedef bool (*worker_match_job_cb)(u32 type, void *data, void *opaque);
 typedef void (*worker_job_cb)(struct worker *w, void *data);
 typedef void (*worker_free_cb)(struct worker *w, void *data);
 
-struct worker *worker_new(void);
+struct worker_stats {
+    size_t threads;
+    size_t queued[WORKER_NUM_PRIORITIES];
+    size_t running[WORKER_NUM_PRIORITIES];
+    u64 steals;
+};
+
+// Jobs are accounted to the lowest bit of their type. Wait is the time from
+// worker_add_job until the job starts, max the longest time until a job finished.
+struct worker_type_stats {
+    u64 jobs;
+    u64 wait_ns;
+    u64 run_ns;
+    u64 max_ns;
+};
+
+// Runs jobs on the given number of threads or one per CPU if threads is 0.
+struct worker *worker_new(size_t threads);
 void worker_free(struct worker *w);
-void worker_cancel_job(struct worker *w, worker_cancel_job_cb cb, void *opaque);
-void worker_add_job(struct worker *w, u32 type, worker_job_cb job_cb,
-        worker_free_cb free_cb, void *data);
+void worker_cancel_job(struct worker *w, worker_match_job_cb cb, void *opaque);
+void worker_add_job(struct worker *w, u32 type, enum worker_priority prio,
+        worker_job_cb job_cb, worker_free_cb free_cb, void *data);
+// Moves the queued jobs of a lower priority that the callback selects to the front of
+// the given priority. Returns how many jobs were moved.
+size_t worker_bump_job(struct worker *w, enum worker_priority prio,
+        worker_match_job_cb cb, void *opaque);
+// Limits the number of jobs of the priority that run at the same time. By default low
+// priority jobs leave one thread free.
+void worker_set_limit(struct worker *w, enum worker_priority prio, size_t limit);
 void worker_cancel_job_by_type(struct worker *w, u32 type);
+// Returns whether the job running on the calling thread has been cancelled.
 bool worker_cancel_current(const struct worker *w);
 int worker_fd(const struct worker *w);
-void worker_push_result(struct worker *w, void *data);
-void *worker_pop_result(struct worker *w);
+void worker_push_result(struct worker *w, struct channel_node *node);
+struct channel_node *worker_pop_result(struct worker *w);
+void worker_get_stats(const struct worker *w, struct worker_stats *s);
+void worker_get_type_stats(const struct worker *w, u32 type, struct worker_type_stats *s);
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
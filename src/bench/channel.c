@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "utils/utils.h"
+#include "utils/channel.h"
+#include "utils/list.h"
+#include "utils/thread.h"
+#include "utils/xmalloc.h"
+
+// Measures the throughput of the channel and the latency of its messages while several
+// producers push at the same time and one consumer pops. The previous channel, a list
+// protected by a mutex whose entries are allocated on every push, runs as the baseline.
+
+#define BENCH_PRODUCERS 4
+#define BENCH_MESSAGES 200000
+
+struct bench_msg {
+    struct channel_node node;
+    u64 pushed_ns;
+};
+
+// The channel before it became an intrusive queue.
+struct mutex_channel {
+    struct list head;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct mutex_channel_entry {
+    struct list node;
+    void *data;
+};
+
+struct bench_ops {
+    const char *name;
+    void *(*new)(void);
+    void (*free)(void *c);
+    void (*push)(void *c, struct bench_msg *m);
+    struct bench_msg *(*pop_wait)(void *c);
+};
+
+struct bench_producer {
+    pthread_t thread;
+    const struct bench_ops *ops;
+    void *channel;
+    struct bench_msg *msgs;
+    size_t num;
+};
+
+static void *mutex_channel_new(void)
+{
+    auto c = xnew_uninit(struct mutex_channel);
+    list_init(&c->head);
+    c->mutex = THREAD_MUTEX_INIT;
+    c->cond = THREAD_COND_INIT;
+    return c;
+}
+
+static void mutex_channel_free(void *opaque)
+{
+    struct mutex_channel *c = opaque;
+    while (!list_empty(&c->head))
+        free(container_of(list_pop_first(&c->head), struct mutex_channel_entry, node));
+    free(c);
+}
+
+static void mutex_channel_push(void *opaque, struct bench_msg *m)
+{
+    struct mutex_channel *c = opaque;
+    auto entry = xnew_uninit(struct mutex_channel_entry);
+    entry->data = m;
+    auto_unlock lock = thread_mutex_lock(&c->mutex);
+    list_append(&c->head, &entry->node);
+    thread_cond_signal(&c->cond);
+}
+
+static struct bench_msg *mutex_channel_pop_wait(void *opaque)
+{
+    struct mutex_channel *c = opaque;
+    auto_unlock lock = thread_mutex_lock(&c->mutex);
+    while (list_empty(&c->head))
+        thread_cond_wait(&c->cond, &c->mutex);
+    auto_free auto entry = container_of(list_pop_first(&c->head),
+            struct mutex_channel_entry, node);
+    return entry->data;
+}
+
+static void *queue_channel_new(void)
+{
+    return channel_new(false);
+}
+
+static void queue_channel_free(void *c)
+{
+    channel_free(c);
+}
+
+static void queue_channel_push(void *c, struct bench_msg *m)
+{
+    channel_push(c, &m->node);
+}
+
+static struct bench_msg *queue_channel_pop_wait(void *c)
+{
+    return channel_entry(channel_pop_wait(c), struct bench_msg, node);
+}
+
+static const struct bench_ops bench_channels[] = {
+    {
+        "mutex",
+        mutex_channel_new,
+        mutex_channel_free,
+        mutex_channel_push,
+        mutex_channel_pop_wait,
+    },
+    {
+        "queue",
+        queue_channel_new,
+        queue_channel_free,
+        queue_channel_push,
+        queue_channel_pop_wait,
+    },
+};
+
+static void *bench_produce(void *opaque)
+{
+    struct bench_producer *p = opaque;
+    for (size_t i = 0; i < p->num; i++) {
+        p->msgs[i].pushed_ns = utils_get_mono_time_ns();
+        p->ops->push(p->channel, &p->msgs[i]);
+    }
+    return NULL;
+}
+
+static void bench_run(const struct bench_ops *ops, size_t producers, size_t messages)
+{
+    auto channel = ops->new();
+    auto msgs = xnew_array(struct bench_msg, producers * messages);
+    struct bench_producer p[BENCH_PRODUCERS];
+
+    auto start = utils_get_mono_time_ns();
+    for (size_t i = 0; i < producers; i++) {
+        p[i] = (struct bench_producer) {
+            .ops = ops,
+            .channel = channel,
+            .msgs = msgs + i * messages,
+            .num = messages,
+        };
+        thread_create(&p[i].thread, NULL, bench_produce, &p[i]);
+    }
+
+    u64 total_ns = 0, max_ns = 0;
+    for (size_t i = 0; i < producers * messages; i++) {
+        auto m = ops->pop_wait(channel);
+        auto latency = utils_get_mono_time_ns() - m->pushed_ns;
+        total_ns += latency;
+        max_ns = max(max_ns, latency);
+    }
+    auto elapsed = utils_get_mono_time_ns() - start;
+
+    for (size_t i = 0; i < producers; i++)
+        thread_join(p[i].thread, NULL);
+    free(msgs);
+    ops->free(channel);
+
+    auto num = (double)(producers * messages);
+    printf("%s, producers %zu: %.1f Mmsg/s, latency avg %.1f us, max %.1f us\n",
+            ops->name, producers, num * 1000 / (double)elapsed,
+            (double)total_ns / num / 1000, (double)max_ns / 1000);
+}
+
+// Usage: bench-channel [messages per producer]
+int main(int argc, char **argv)
+{
+    size_t messages = BENCH_MESSAGES;
+    if (argc > 1)
+        messages = strtoul(argv[1], NULL, 10);
+
+    for (size_t i = 0; i < N_ELEMENTS(bench_channels); i++)
+        for (size_t producers = 1; producers <= BENCH_PRODUCERS; producers *= 2)
+            bench_run(&bench_channels[i], producers, messages);
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
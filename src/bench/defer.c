@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils/utils.h"
+#include "utils/loop.h"
+#include "utils/xmalloc.h"
+
+// Measures the cost of a loop iteration while many deferrals exist but are disabled,
+// as they are in the player most of the time. One deferral toggles another on every
+// iteration so that the set of enabled deferrals keeps changing.
+
+#define BENCH_IDLE 500
+#define BENCH_ITERATIONS 1000000
+
+struct bench {
+    struct loop *loop;
+    struct loop_defer *toggled;
+    u64 iterations;
+    u64 max_iterations;
+};
+
+static void bench_nop(struct loop_defer *d, void *opaque)
+{
+    (void)d;
+    (void)opaque;
+}
+
+static void bench_spin(struct loop_defer *d, void *opaque)
+{
+    (void)d;
+    struct bench *b = opaque;
+    loop_force_iteration(b->loop);
+    loop_defer_set(b->toggled, b->iterations & 1);
+    if (++b->iterations == b->max_iterations)
+        loop_stop(b->loop, 0);
+}
+
+static void bench_run(enum loop_backend backend, size_t idle, u64 iterations)
+{
+    struct bench b = {
+        .loop = loop_new_backend(backend),
+        .max_iterations = iterations,
+    };
+    auto idles = xnew_array(struct loop_defer *, idle);
+    for (size_t i = 0; i < idle; i++) {
+        idles[i] = loop_defer_new(b.loop, bench_nop, NULL);
+        loop_defer_set(idles[i], false);
+    }
+    b.toggled = loop_defer_new(b.loop, bench_nop, NULL);
+    auto spin = loop_defer_new(b.loop, bench_spin, &b);
+
+    auto start = utils_get_mono_time_ns();
+    loop_run(b.loop);
+    auto elapsed = utils_get_mono_time_ns() - start;
+
+    printf("%s, %zu idle deferrals: %.0f ns per iteration\n",
+            loop_get_backend(b.loop) == LOOP_BACKEND_URING ? "io_uring" : "epoll", idle,
+            (double)elapsed / (double)b.iterations);
+
+    loop_defer_free(spin);
+    loop_defer_free(b.toggled);
+    for (size_t i = 0; i < idle; i++)
+        loop_defer_free(idles[i]);
+    free(idles);
+    loop_free(b.loop);
+}
+
+// Usage: bench-defer [idle deferrals] [iterations]
+int main(int argc, char **argv)
+{
+    size_t idle = BENCH_IDLE;
+    u64 iterations = BENCH_ITERATIONS;
+    if (argc > 1)
+        idle = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        iterations = strtoull(argv[2], NULL, 10);
+
+    enum loop_backend backends[] = { LOOP_BACKEND_EPOLL, LOOP_BACKEND_URING };
+    for (size_t i = 0; i < N_ELEMENTS(backends); i++) {
+        bench_run(backends[i], 0, iterations);
+        bench_run(backends[i], idle, iterations);
+    }
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include "utils/utils.h"
+#include "utils/loop.h"
+#include "utils/thread.h"
+
+// Counts the system calls per audio buffer on each loop backend. A child process plays
+// buffers the way the player does with the realtime null sink: A timer wakes the sink,
+// which enables a deferral that takes a buffer from a decoder thread. The decoder refills
+// it in the background and announces it on an eventfd that the loop watches with
+// EPOLLET, like the prefetch thread. The parent traces the child and counts the system
+// calls of each thread between two markers that the child sends around loop_run.
+
+#define BENCH_BUFFERS 400
+#define BENCH_PERIOD_MS 5
+#define BENCH_MARKER SIGUSR2
+#define BENCH_MAX_THREADS 16
+
+struct bench {
+    struct loop *loop;
+    struct loop_timer *wakeup;
+    struct loop_defer *provide;
+    struct loop_watch *ready_watch;
+    int ready_fd;
+    u64 buffers;
+    u64 max_buffers;
+    // Set if the sink wanted a buffer before the decoder had one.
+    bool pending;
+
+    pthread_t decoder;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool requested;
+    bool ready;
+    bool stop;
+};
+
+struct bench_thread {
+    int tid;
+    bool in_syscall;
+    u64 syscalls;
+    u64 start;
+    u64 end;
+};
+
+static void *bench_decode(void *opaque)
+{
+    struct bench *b = opaque;
+    while (true) {
+        {
+            auto_unlock lock = thread_mutex_lock(&b->mutex);
+            while (!b->requested && !b->stop)
+                thread_cond_wait(&b->cond, &b->mutex);
+            if (b->stop)
+                return NULL;
+            b->requested = false;
+            b->ready = true;
+        }
+        utils_signal_eventfd(b->ready_fd);
+    }
+}
+
+static void bench_arm_wakeup(struct bench *b)
+{
+    struct itimerspec timer = {
+        .it_value = { .tv_nsec = BENCH_PERIOD_MS * 1000 * 1000 },
+    };
+    loop_timer_set(b->wakeup, &timer, false);
+}
+
+static void bench_wakeup(struct loop_timer *t, void *opaque)
+{
+    struct bench *b = opaque;
+    loop_timer_disable(t);
+    loop_defer_set(b->provide, true);
+}
+
+static void bench_provide(struct loop_defer *d, void *opaque)
+{
+    struct bench *b = opaque;
+    loop_defer_set(d, false);
+    {
+        auto_unlock lock = thread_mutex_lock(&b->mutex);
+        b->pending = !b->ready;
+        if (b->pending)
+            return;
+        b->ready = false;
+        b->requested = true;
+        thread_cond_signal(&b->cond);
+    }
+    if (++b->buffers == b->max_buffers)
+        loop_stop(b->loop, 0);
+    else
+        bench_arm_wakeup(b);
+}
+
+static void bench_ready(struct loop_watch *w, void *opaque, int fd, u32 events)
+{
+    (void)w;
+    (void)events;
+    struct bench *b = opaque;
+    utils_clear_eventfd(fd);
+    if (b->pending)
+        loop_defer_set(b->provide, true);
+}
+
+static int bench_play(enum loop_backend backend, u64 buffers)
+{
+    struct bench b = {
+        .loop = loop_new_backend(backend),
+        .ready_fd = utils_eventfd(),
+        .max_buffers = buffers,
+        .mutex = THREAD_MUTEX_INIT,
+        .cond = THREAD_COND_INIT,
+        .requested = true,
+    };
+    if (loop_get_backend(b.loop) != backend) {
+        loop_free(b.loop);
+        return 2;
+    }
+    b.wakeup = loop_timer_new(b.loop, bench_wakeup, CLOCK_MONOTONIC, &b);
+    b.provide = loop_defer_new(b.loop, bench_provide, &b);
+    loop_defer_set(b.provide, false);
+    b.ready_watch = loop_watch_new(b.loop, bench_ready, &b);
+    loop_watch_set(b.ready_watch, b.ready_fd, EPOLLIN | EPOLLET);
+    thread_create(&b.decoder, NULL, bench_decode, &b);
+    bench_arm_wakeup(&b);
+
+    raise(BENCH_MARKER);
+    loop_run(b.loop);
+    raise(BENCH_MARKER);
+
+    {
+        auto_unlock lock = thread_mutex_lock(&b.mutex);
+        b.stop = true;
+        thread_cond_signal(&b.cond);
+    }
+    thread_join(b.decoder, NULL);
+    loop_watch_free(b.ready_watch);
+    loop_defer_free(b.provide);
+    loop_timer_free(b.wakeup);
+    loop_free(b.loop);
+    close(b.ready_fd);
+    return 0;
+}
+
+static struct bench_thread *bench_thread_get(struct bench_thread *threads, size_t *num,
+        int tid)
+{
+    for (size_t i = 0; i < *num; i++)
+        if (threads[i].tid == tid)
+            return &threads[i];
+    if (*num == BENCH_MAX_THREADS)
+        return NULL;
+    threads[*num] = (struct bench_thread) { .tid = tid };
+    return &threads[(*num)++];
+}
+
+// Returns the exit status of the child or -1 if it could not be traced.
+static int bench_trace(pid_t pid, struct bench_thread *threads, size_t *num)
+{
+    int markers = 0;
+    int status;
+    // The child stops itself before it does anything that should be counted.
+    if (waitpid(pid, &status, WSTOPPED) != pid)
+        return -1;
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SEIZE, pid, 0, options) < 0)
+        return -1;
+    kill(pid, SIGCONT);
+
+    pid_t tid;
+    while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid)
+                return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            continue;
+        }
+        int sig = 0;
+        auto t = bench_thread_get(threads, num, tid);
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            // Entry and exit stops alternate. Every entry is one system call.
+            if (t && !t->in_syscall)
+                t->syscalls++;
+            if (t)
+                t->in_syscall = !t->in_syscall;
+        } else if (WSTOPSIG(status) == BENCH_MARKER && status >> 16 == 0) {
+            markers++;
+            for (size_t i = 0; i < *num; i++) {
+                if (markers == 1)
+                    threads[i].start = threads[i].syscalls;
+                threads[i].end = threads[i].syscalls;
+            }
+        } else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP) {
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, 0, sig);
+    }
+    return -1;
+}
+
+static void bench_run(enum loop_backend backend, const char *name, u64 buffers)
+{
+    auto pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (pid == 0) {
+        raise(SIGSTOP);
+        _exit(bench_play(backend, buffers));
+    }
+
+    struct bench_thread threads[BENCH_MAX_THREADS];
+    size_t num = 0;
+    auto ret = bench_trace(pid, threads, &num);
+    if (ret == 2) {
+        printf("%s: not available\n", name);
+        return;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "%s: could not trace the child\n", name);
+        exit(1);
+    }
+
+    u64 loop = 0, other = 0;
+    for (size_t i = 0; i < num; i++) {
+        auto s = threads[i].end - threads[i].start;
+        if (threads[i].tid == pid)
+            loop = s;
+        else
+            other += s;
+    }
+    printf("%s: %.2f syscalls per buffer on the loop thread (%"PRIu64"), %.2f on the"
+            " decoder (%"PRIu64"), %"PRIu64" buffers\n", name,
+            (double)loop / (double)buffers, loop, (double)other / (double)buffers, other,
+            buffers);
+}
+
+// Usage: bench-syscalls [buffers]
+int main(int argc, char **argv)
+{
+    u64 buffers = BENCH_BUFFERS;
+    if (argc > 1)
+        buffers = strtoull(argv[1], NULL, 10);
+
+    bench_run(LOOP_BACKEND_EPOLL, "epoll", buffers);
+    bench_run(LOOP_BACKEND_URING, "io_uring", buffers);
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
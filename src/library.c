@@ -0,0 +1,263 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <linux/stat.h>
+
+#include "utils/utils.h"
+#include "utils/xmalloc.h"
+#include "utils/thread.h"
+#include "utils/diag.h"
+#include "utils/cache.h"
+#include "utils/metadata.h"
+
+#include "library.h"
+#include "globals.h"
+#include "plugins.h"
+#include "metacache.h"
+#include "worker.h"
+
+#define LIBRARY_ENV "OKA_LIBRARY"
+#define LIBRARY_THREADS_ENV "OKA_SCAN_THREADS"
+// Size of the buffer getdents64 fills. Large directories are read in few system calls.
+#define LIBRARY_DIRENT_BUF (64 * 1024)
+#define LIBRARY_REPORT_MS 1000
+
+// The layout the getdents64 system call uses.
+struct library_dirent {
+    u64 ino;
+    i64 off;
+    u16 reclen;
+    u8 type;
+    char name[];
+};
+
+struct library_stats {
+    _Atomic u64 dirs;
+    _Atomic u64 files;
+    // The total size of the files whose tags were read. Only their tags are read, so
+    // this is not the amount of I/O.
+    _Atomic u64 library_bytes;
+    _Atomic u64 unchanged;
+    _Atomic u64 untagged;
+};
+
+// Directories are scanned by low priority worker jobs, one per directory. pending counts
+// the jobs that have not been freed yet and library_init while it adds the roots. The
+// scan is done once it drops to 0.
+static pthread_mutex_t library_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t library_cond = PTHREAD_COND_INITIALIZER;
+static size_t library_pending;
+static _Atomic bool library_cancel;
+
+static u64 library_start_ms;
+static _Atomic u64 library_next_report;
+static struct library_stats library_stats;
+
+static void library_job_run(struct worker *w, void *data);
+static void library_job_free(struct worker *w, void *data);
+
+static void library_get(void)
+{
+    auto_unlock lock = thread_mutex_lock(&library_mutex);
+    library_pending++;
+}
+
+static void library_push(char *dir)
+{
+    library_get();
+    worker_add_job(worker, LIBRARY_JOB_SCAN, WORKER_PRIORITY_LOW, library_job_run,
+            library_job_free, dir);
+}
+
+static void library_report(bool done)
+{
+    auto s = &library_stats;
+    auto ms = max(utils_get_mono_time_ms() - library_start_ms, (u64)1);
+    diag_info(main_diag, "library: %s%"PRIu64" dirs, %"PRIu64" files (%"PRIu64
+            " unchanged, %"PRIu64" untagged) in %"PRIu64" ms, %.0f files/s,"
+            " %.1f library MB/s",
+            done ? "scanned " : "", s->dirs, s->files, s->unchanged, s->untagged, ms,
+            (double)s->files * 1000 / ms, (double)s->library_bytes / 1000 / ms);
+}
+
+// Whichever thread notices that the interval has passed prints the progress.
+static void library_maybe_report(void)
+{
+    auto now = utils_get_mono_time_ms();
+    auto next = library_next_report;
+    if (now >= next && atomic_compare_exchange_strong(&library_next_report, &next,
+                now + LIBRARY_REPORT_MS))
+        library_report(false);
+}
+
+static int library_statx(int dirfd, const char *name, int flags, u32 mask,
+        struct statx *stx)
+{
+    return (int)syscall(SYS_statx, dirfd, name, flags, mask, stx);
+}
+
+static void library_scan_file(int dirfd, const char *name, const char *path)
+{
+    auto decoder = plugins_find_decoder(name);
+    if (!decoder)
+        return;
+
+    struct statx stx;
+    if (library_statx(dirfd, name, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) ||
+            !S_ISREG(stx.stx_mode))
+        return;
+    struct cache_key key = {
+        .size = stx.stx_size,
+        .mtime_sec = stx.stx_mtime.tv_sec,
+        .mtime_nsec = stx.stx_mtime.tv_nsec,
+    };
+    library_stats.files++;
+
+    auto md = metacache_get(path, &key);
+    if (md) {
+        library_stats.unchanged++;
+    } else {
+        md = plugins_read_metadata(decoder, path);
+        if (md->pairs[0].key == METADATA_INVALID)
+            library_stats.untagged++;
+        metacache_put(path, &key, md);
+        library_stats.library_bytes += stx.stx_size;
+    }
+    metadata_unref(md);
+}
+
+// Hidden files and directories are skipped. Symbolic links to directories are not
+// followed so that the scan cannot loop.
+static void library_scan_entry(int dirfd, const char *dir, const struct library_dirent *d)
+{
+    if (d->name[0] == '.')
+        return;
+
+    auto type = d->type;
+    if (type == DT_UNKNOWN) {
+        struct statx stx;
+        if (library_statx(dirfd, d->name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx))
+            return;
+        type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG :
+            S_ISLNK(stx.stx_mode) ? DT_LNK : DT_UNKNOWN;
+    }
+    if (type != DT_DIR && type != DT_REG && type != DT_LNK)
+        return;
+
+    // Links are scanned as files, library_scan_file skips the ones that do not point to
+    // a regular file.
+    auto is_dir = type == DT_DIR;
+
+    auto path = xstrjoin(dir, "/", d->name);
+    if (is_dir) {
+        library_push(path);
+        return;
+    }
+    library_scan_file(dirfd, d->name, path);
+    free(path);
+}
+
+static void library_scan_dir(struct worker *w, const char *dir, u8 *buf)
+{
+    auto fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        diag_err(main_diag, "library: could not open %s: %s", dir, utils_strerr(errno));
+        return;
+    }
+    library_stats.dirs++;
+
+    long len;
+    while (!worker_cancel_current(w) &&
+            (len = syscall(SYS_getdents64, fd, buf, LIBRARY_DIRENT_BUF)) > 0) {
+        for (long off = 0; off < len && !worker_cancel_current(w); ) {
+            const struct library_dirent *d = (const void *)(buf + off);
+            off += d->reclen;
+            library_scan_entry(fd, dir, d);
+            library_maybe_report();
+        }
+    }
+    close(fd);
+}
+
+static void library_job_run(struct worker *w, void *data)
+{
+    if (library_cancel)
+        return;
+    auto_free auto buf = xnew_array(u8, LIBRARY_DIRENT_BUF);
+    library_scan_dir(w, data, buf);
+}
+
+static void library_put(void)
+{
+    auto_unlock lock = thread_mutex_lock(&library_mutex);
+    if (--library_pending > 0)
+        return;
+    if (!library_cancel)
+        library_report(true);
+    thread_cond_broadcast(&library_cond);
+}
+
+// Also called for cancelled jobs.
+static void library_job_free(struct worker *w, void *data)
+{
+    (void)w;
+    free(data);
+    library_put();
+}
+
+static size_t library_thread_count(void)
+{
+    char *end, *threads = getenv(LIBRARY_THREADS_ENV);
+    if (threads && *threads) {
+        unsigned long tmp = strtoul(threads, &end, 10);
+        if (*end == 0 && tmp > 0)
+            return tmp;
+    }
+    return 0;
+}
+
+void library_init(void)
+{
+    auto roots = getenv(LIBRARY_ENV);
+    if (!roots || !*roots)
+        return;
+
+    library_start_ms = utils_get_mono_time_ms();
+    library_next_report = library_start_ms + LIBRARY_REPORT_MS;
+    auto threads = library_thread_count();
+    if (threads)
+        worker_set_limit(worker, WORKER_PRIORITY_LOW, threads);
+
+    library_get();
+    auto_free auto copy = xstrdup(roots);
+    for (char *save, *root = strtok_r(copy, ":", &save); root;
+            root = strtok_r(NULL, ":", &save)) {
+        // The paths of the files are built from the root.
+        auto len = strlen(root);
+        while (len > 1 && root[len - 1] == '/')
+            root[--len] = 0;
+        library_push(xstrdup(root));
+    }
+    library_put();
+}
+
+// Running jobs may still use the decoders, so wait for them.
+void library_exit(void)
+{
+    library_cancel = true;
+    worker_cancel_job_by_type(worker, LIBRARY_JOB_SCAN);
+
+    auto_unlock lock = thread_mutex_lock(&library_mutex);
+    while (library_pending > 0)
+        thread_cond_wait(&library_cond, &library_mutex);
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
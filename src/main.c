@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -13,6 +15,7 @@
 #include "utils/xmalloc.h"
 #include "utils/diag.h"
 #include "utils/loop.h"
+#include "utils/trace.h"
 
 #include "main.h"
 #include "worker.h"
@@ -21,25 +24,37 @@
 #include "plugins.h"
 #include "player.h"
 #include "decoder.h"
+#include "render.h"
+#include "metacache.h"
+#include "library.h"
+
+#define MAIN_JOB_OPEN (1 << 0)
+
+#define MAIN_POSITION_POLL_MS 100
+#define MAIN_LOOP_STATS_ENV "OKA_LOOP_STATS"
+#define MAIN_LOOP_BACKEND_ENV "OKA_LOOP_BACKEND"
+#define MAIN_TRACE_ENV "OKA_TRACE"
 
 struct worker *worker;
 struct diag *main_diag;
+bool main_loop_stats;
+enum loop_backend main_loop_backend;
 
+static const char *main_trace_path;
 static int main_winch_fd;
+static int main_stats_fd;
 static struct loop *main_loop;
 static struct loop_watch *main_stdin_watch;
 static struct loop_watch *main_winch_watch;
+static struct loop_watch *main_stats_watch;
+static struct loop_timer *main_position_timer;
+static u64 main_pos = (u64)-1;
 
 static void main_delegate(struct delegate *d)
 {
     loop_delegate(main_loop, d);
 }
 
-static void main_delegate_sync(struct delegate *d)
-{
-    loop_delegate_sync(main_loop, d);
-}
-
 struct main_diag_delegate {
     struct delegate d;
     char *msg;
@@ -54,7 +69,7 @@ static void main_diag_err_delegate(struct delegate *d)
 
 static void main_diag_err(char *msg)
 {
-    auto m = xnew_uninit(struct main_diag_delegate);
+    auto m = xnew0(struct main_diag_delegate);
     m->d.run = main_diag_err_delegate;
     m->msg = msg;
     main_delegate(&m->d);
@@ -70,7 +85,7 @@ noreturn static void main_diag_fatal_delegate(struct delegate *d)
 
 static void main_diag_fatal(char *msg)
 {
-    auto m = xnew_uninit(struct main_diag_delegate);
+    auto m = xnew0(struct main_diag_delegate);
     m->d.run = main_diag_fatal_delegate;
     m->msg = msg;
     main_delegate(&m->d);
@@ -85,7 +100,7 @@ static void main_diag_info_delegate(struct delegate *d)
 
 static void main_diag_info(char *msg)
 {
-    auto m = xnew_uninit(struct main_diag_delegate);
+    auto m = xnew0(struct main_diag_delegate);
     m->d.run = main_diag_info_delegate;
     m->msg = msg;
     main_delegate(&m->d);
@@ -109,7 +124,7 @@ static void main_diag_exit(void)
 
 static void main_worker_init(void)
 {
-    worker = worker_new();
+    worker = worker_new(0);
 }
 
 static void main_worker_exit(void)
@@ -117,6 +132,52 @@ static void main_worker_exit(void)
     worker_free(worker);
 }
 
+static void main_print_worker_stats(void)
+{
+    static const struct {
+        u32 type;
+        const char *name;
+    } types[] = {
+        { MAIN_JOB_OPEN, "open" },
+        { LIBRARY_JOB_SCAN, "scan" },
+    };
+    static const char *const prios[WORKER_NUM_PRIORITIES] = { "high", "normal", "low" };
+
+    struct worker_stats s;
+    worker_get_stats(worker, &s);
+    term_printf("worker: %zu threads, %"PRIu64" steals\n", s.threads, s.steals);
+    for (size_t i = 0; i < WORKER_NUM_PRIORITIES; i++)
+        term_printf("worker: %s: %zu queued, %zu running\n", prios[i], s.queued[i],
+                s.running[i]);
+    for (size_t i = 0; i < N_ELEMENTS(types); i++) {
+        struct worker_type_stats t;
+        worker_get_type_stats(worker, types[i].type, &t);
+        if (t.jobs == 0)
+            continue;
+        term_printf("worker: %s: %"PRIu64" jobs, avg wait %"PRIu64" us, avg run %"PRIu64
+                " us, max %"PRIu64" us\n", types[i].name, t.jobs,
+                t.wait_ns / t.jobs / 1000, t.run_ns / t.jobs / 1000, t.max_ns / 1000);
+    }
+}
+
+static void main_print_delegate_stats(void)
+{
+    struct {
+        const char *name;
+        struct delegator_stats s;
+    } loops[] = {
+        { "main" },
+        { "player" },
+    };
+    loop_get_delegate_stats(main_loop, &loops[0].s);
+    player_get_delegate_stats(&loops[1].s);
+    for (size_t i = 0; i < N_ELEMENTS(loops); i++) {
+        auto s = &loops[i].s;
+        term_printf("%s loop: %"PRIu64" delegates, %"PRIu64" wakeups, %"PRIu64
+                " signals\n", loops[i].name, s->delegates, s->wakeups, s->signals);
+    }
+}
+
 static void main_handle_winch(struct loop_watch *w_, void *opaque, int fd, u32 events)
 {
     (void)w_;
@@ -154,6 +215,80 @@ static void main_winch_exit(void)
     close(main_winch_fd);
 }
 
+static void main_handle_stats(struct loop_watch *w, void *opaque, int fd, u32 events)
+{
+    (void)w;
+    (void)fd;
+    (void)opaque;
+    (void)events;
+
+    struct signalfd_siginfo si;
+    BUG_ON(read(main_stats_fd, &si, sizeof(si)) == -1);
+
+    loop_dump_stats(main_loop, "main", stderr);
+    player_dump_loop_stats(stderr);
+}
+
+// SIGUSR1 dumps the stats of the loops to stderr.
+static void main_stats_init(void)
+{
+    auto env = getenv(MAIN_LOOP_STATS_ENV);
+    main_loop_stats = env && *env && strcmp(env, "0") != 0;
+    if (main_loop_stats)
+        loop_enable_stats(main_loop);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    thread_sigmask(SIG_BLOCK, &set, NULL);
+
+    main_stats_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    BUG_ON(main_stats_fd == -1);
+
+    main_stats_watch = loop_watch_new(main_loop, main_handle_stats, NULL);
+    loop_watch_set(main_stats_watch, main_stats_fd, EPOLLIN);
+}
+
+static void main_stats_exit(void)
+{
+    loop_watch_free(main_stats_watch);
+    close(main_stats_fd);
+}
+
+// $OKA_TRACE=<path> records a trace of all threads. 't' writes it to the path, the
+// render mode writes it when it is done.
+static void main_trace_init(void)
+{
+    auto env = getenv(MAIN_TRACE_ENV);
+    if (!env || !*env)
+        return;
+    main_trace_path = env;
+    trace_enable();
+    trace_thread_name("main");
+}
+
+static int main_trace_export(void)
+{
+    auto file = fopen(main_trace_path, "w");
+    if (!file)
+        return -errno;
+    trace_export(file);
+    if (fclose(file))
+        return -errno;
+    return 0;
+}
+
+static void main_write_trace(void)
+{
+    int rc;
+    if (!main_trace_path)
+        term_printf("trace: $%s is not set\n", MAIN_TRACE_ENV);
+    else if ((rc = main_trace_export()))
+        term_printf("trace: %s: %s\n", main_trace_path, utils_strerr(-rc));
+    else
+        term_printf("trace: written to %s\n", main_trace_path);
+}
+
 static void main_signals_init(void)
 {
     sigset_t set;
@@ -162,9 +297,22 @@ static void main_signals_init(void)
     thread_sigmask(SIG_BLOCK, &set, NULL);
 }
 
+// $OKA_LOOP_BACKEND=uring makes the loops use io_uring.
 static void main_loop_init(void)
 {
-    main_loop = loop_new();
+    auto env = getenv(MAIN_LOOP_BACKEND_ENV);
+    auto uring = env && strcmp(env, "uring") == 0;
+    if (uring)
+        main_loop_backend = LOOP_BACKEND_URING;
+
+    // Diagnostics are delivered by the loop.
+    main_loop = loop_new_backend(main_loop_backend);
+    if (env && *env && !uring && strcmp(env, "epoll") != 0)
+        diag_err(main_diag, "unknown loop backend %s", env);
+    if (loop_get_backend(main_loop) != main_loop_backend) {
+        diag_err(main_diag, "io_uring is not available, using epoll");
+        main_loop_backend = LOOP_BACKEND_EPOLL;
+    }
 }
 
 static void main_loop_exit(void)
@@ -172,6 +320,40 @@ static void main_loop_exit(void)
     loop_free(main_loop);
 }
 
+static void main_position_tick(struct loop_timer *t, void *opaque)
+{
+    (void)t;
+    (void)opaque;
+
+    auto pos = player_get_position_ms() / 1000;
+    if (pos != main_pos) {
+        main_pos = pos;
+        printf("position changed: %"PRIu64"\n", pos);
+    }
+}
+
+static void main_position_init(void)
+{
+    main_position_timer = loop_timer_new(main_loop, main_position_tick, CLOCK_MONOTONIC,
+            NULL);
+    struct itimerspec timer = {
+        .it_interval = {
+            .tv_sec = 0,
+            .tv_nsec = 1000 * 1000 * MAIN_POSITION_POLL_MS,
+        },
+        .it_value = {
+            .tv_sec = 0,
+            .tv_nsec = 1000 * 1000 * MAIN_POSITION_POLL_MS,
+        },
+    };
+    loop_timer_set(main_position_timer, &timer, false);
+}
+
+static void main_position_exit(void)
+{
+    loop_timer_free(main_position_timer);
+}
+
 static void main_handle_stdin(struct loop_watch *w, void *opaque, int fd, u32 events)
 {
     (void)w;
@@ -204,12 +386,29 @@ static void main_handle_stdin(struct loop_watch *w, void *opaque, int fd, u32 ev
                 player_toggle_pause();
             if (i == 'm')
                 player_toggle_mute();
+            if (i == '+')
+                player_change_volume(+5);
+            if (i == '-')
+                player_change_volume(-5);
             if (i == 'h')
                 player_seek(-5000);
             if (i == 'l')
                 player_seek(+5000);
             if (i == 'n')
                 player_goto_next();
+            if (i == 'f')
+                player_print_filter_stats();
+            if (i == 'w')
+                main_print_worker_stats();
+            if (i == 'd')
+                main_print_delegate_stats();
+            if (i == 't')
+                main_write_trace();
+            if (i == 'b') {
+                u32 fill, size;
+                player_get_buffer_fill(&fill, &size);
+                term_printf("buffer: %"PRIu32"/%"PRIu32" ms\n", fill, size);
+            }
             term_printf("char: %x\n", i);
         }
     }
@@ -229,33 +428,76 @@ static void main_stdin_exit(void)
 
 static void main_init(void)
 {
+    main_trace_init();
     main_diag_init();
     main_signals_init();
     main_loop_init();
     main_stdin_init();
     main_winch_init();
+    main_stats_init();
     main_worker_init();
+    main_position_init();
+    metacache_init();
 
     term_init();
     player_init();
     plugins_init();
+    plugins_start_player();
+    library_init();
 }
 
 static void main_exit(void)
 {
+    library_exit();
     player_exit();
     plugins_exit();
     term_exit();
 
+    metacache_exit();
+    main_position_exit();
     main_worker_exit();
+    main_stats_exit();
     main_winch_exit();
     main_stdin_exit();
     main_loop_exit();
     main_diag_exit();
 }
 
-int main(void)
+static int main_render(int argc, char **argv)
 {
+    if (argc == 0 || argc % 2) {
+        fprintf(stderr, "usage: oka --render <input> <output.wav>"
+                " [<input> <output.wav>]...\n");
+        return 1;
+    }
+
+    main_trace_init();
+    main_diag_init();
+    main_signals_init();
+    main_loop_init();
+    metacache_init();
+    plugins_init();
+
+    render_init(argv, (size_t)argc / 2);
+    loop_run(main_loop);
+    auto failed = render_exit();
+    int rc;
+    if (main_trace_path && (rc = main_trace_export()))
+        fprintf(stderr, "trace: %s: %s\n", main_trace_path, utils_strerr(-rc));
+
+    plugins_exit();
+    metacache_exit();
+    main_loop_exit();
+    main_diag_exit();
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--render") == 0)
+        return main_render(argc - 2, argv + 2);
+
     main_init();
 
     auto yo = plugins_open("/home/julian/ylia/01.mp3");
@@ -281,50 +523,56 @@ static void main_volume_changed_delegate(struct delegate *d)
 
 void main_sink_info_changed(struct sink_info *i)
 {
-    auto v = xnew_uninit(struct main_sink_info_changed);
+    auto v = xnew0(struct main_sink_info_changed);
     v->d.run = main_volume_changed_delegate;
     v->i = *i;
     main_delegate(&v->d);
 }
 
-static _Atomic u32 main_pos;
+static struct main_track_cookie * _Atomic main_track;
 
-static void main_position_changed_delegate(struct delegate *d)
+static void main_track_changed_delegate(struct delegate *d)
 {
     (void)d;
-    printf("position changed: %"PRIu32"\n", main_pos);
+    printf("track changed: %s\n", (char *)main_track);
 }
 
-void main_position_changed(u32 pos)
+void main_track_changed(struct main_track_cookie *c)
 {
-    static struct delegate d = { main_position_changed_delegate };
-    main_pos = pos;
+    static struct delegate d = { main_track_changed_delegate };
+    main_track = c;
     main_delegate(&d);
 }
 
-static struct main_track_cookie * _Atomic main_track;
+struct main_open_job {
+    u64 id;
+    const char *path;
+};
 
-static void main_track_changed_delegate(struct delegate *d)
+static void main_open_job_run(struct worker *w, void *data)
 {
-    (void)d;
-    printf("track changed: %s\n", (char *)main_track);
+    (void)w;
+
+    struct main_open_job *job = data;
+    auto s = plugins_open(job->path);
+    player_set_next_track(job->id, s, (struct main_track_cookie *)job->path);
 }
 
-void main_track_changed(struct main_track_cookie *c)
+static void main_open_job_free(struct worker *w, void *data)
 {
-    static struct delegate d = { main_track_changed_delegate };
-    main_track = c;
-    main_delegate(&d);
+    (void)w;
+    free(data);
 }
 
-struct main_get_next_track {
+struct main_request_next_track {
     struct delegate d;
-    struct decoder_stream *s;
-    struct main_track_cookie *c;
+    u64 id;
 };
 
-static void main_get_next_track_delegate(struct delegate *d)
+static void main_request_next_track_delegate(struct delegate *d)
 {
+    auto_free auto v = container_of(d, struct main_request_next_track, d);
+
     static bool bla;
     static char *t2 = "/home/julian/dragons/02.mp3";
     static char *t3 = "/home/julian/dragons/03.mp3";
@@ -335,17 +583,32 @@ static void main_get_next_track_delegate(struct delegate *d)
     } else {
         track = t3;
     }
-    auto v = container_of(d, struct main_get_next_track, d);
-    v->s = plugins_open(track);
-    v->c = (struct main_track_cookie *)track;
+
+    auto job = xnew_uninit(struct main_open_job);
+    job->id = v->id;
+    job->path = track;
+    worker_add_job(worker, MAIN_JOB_OPEN, WORKER_PRIORITY_HIGH, main_open_job_run,
+            main_open_job_free, job);
 }
 
-void main_get_next_track_SYNC(struct decoder_stream **s, struct main_track_cookie **c)
+void main_request_next_track(u64 id)
 {
-    struct main_get_next_track v = { .d.run = main_get_next_track_delegate };
-    main_delegate_sync(&v.d);
-    *s = v.s;
-    *c = v.c;
+    auto v = xnew0(struct main_request_next_track);
+    v->d.run = main_request_next_track_delegate;
+    v->id = id;
+    main_delegate(&v->d);
+}
+
+static void main_render_done_delegate(struct delegate *d)
+{
+    (void)d;
+    loop_stop(main_loop, 0);
+}
+
+void main_render_done(void)
+{
+    static struct delegate d = { main_render_done_delegate };
+    main_delegate(&d);
 }
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
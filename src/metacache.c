@@ -0,0 +1,612 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils/utils.h"
+#include "utils/xmalloc.h"
+#include "utils/thread.h"
+#include "utils/signals.h"
+#include "utils/diag.h"
+#include "utils/hash.h"
+#include "utils/vec.h"
+#include "utils/trace.h"
+
+#include "metacache.h"
+#include "globals.h"
+
+#define METACACHE_DIR "metadata"
+#define METACACHE_MAGIC "OKAMETA"
+#define METACACHE_VERSION 1
+// Compaction copies this many entries while holding the lock so that lookups are never
+// blocked for long.
+#define METACACHE_COMPACT_BATCH 1024
+// The file is compacted once more than half of it is dead and the dead records take up
+// at least this many bytes.
+#define METACACHE_COMPACT_MIN (1024 * 1024)
+
+struct metacache_header {
+    char magic[8];
+    u32 version;
+    u32 reserved;
+};
+
+// Records are only ever appended. The last record of a path replaces earlier ones. The
+// record is followed by the NUL-terminated path and the tags, each a key byte followed
+// by a NUL-terminated value, and padded to 8 bytes.
+struct metacache_record {
+    u32 len;
+    u32 path_len;
+    struct cache_key key;
+    u32 tags;
+    u32 reserved;
+};
+
+// key and md are the newest state and are set by metacache_put. record and file_len
+// describe the file and are only changed by the background thread. md is NULL until
+// the entry is first looked up if it was loaded from the file.
+struct metacache_entry {
+    const char *path;
+    bool owned;
+    struct cache_key key;
+    struct metadata *md;
+    const struct metacache_record *record;
+    u32 file_len;
+};
+
+struct metacache_pending {
+    char *path;
+    struct metadata *md;
+    struct cache_key key;
+};
+
+struct metacache_buf {
+    u8 *ptr;
+    size_t len;
+    size_t cap;
+};
+
+UTILS_VECTOR(metacache_entry, struct metacache_entry *)
+UTILS_VECTOR(metacache_pending, struct metacache_pending)
+
+static pthread_mutex_t metacache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metacache_cond = PTHREAD_COND_INITIALIZER;
+static struct hash_map *metacache_index;
+static struct metacache_entry_vector metacache_entries;
+static struct metacache_pending_vector metacache_pending;
+static char *metacache_path;
+static int metacache_fd = -1;
+static void *metacache_map;
+static size_t metacache_map_len;
+static u64 metacache_live;
+static u64 metacache_dead;
+static bool metacache_stop;
+static pthread_t metacache_thread;
+
+static u32 metacache_hash(void *key)
+{
+    return hash_str(key);
+}
+
+static void *metacache_key(void *val)
+{
+    struct metacache_entry *e = val;
+    return discard_const(e->path, char);
+}
+
+static bool metacache_equal(void *a, void *b)
+{
+    return strcmp(a, b) == 0;
+}
+
+static struct hash_map_ops metacache_ops = {
+    .hash = metacache_hash,
+    .key = metacache_key,
+    .equal = metacache_equal,
+};
+
+static size_t metacache_align(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static const char *metacache_record_path(const struct metacache_record *r)
+{
+    return (const char *)(r + 1);
+}
+
+static bool metacache_record_valid(const struct metacache_record *r, size_t avail)
+{
+    return avail >= sizeof(*r) && r->len >= sizeof(*r) && r->len <= avail &&
+        r->len % 8 == 0 && r->path_len < r->len - sizeof(*r) &&
+        metacache_record_path(r)[r->path_len] == 0;
+}
+
+static struct metadata *metacache_decode(const struct metacache_record *r)
+{
+    char *tags[METADATA_NUM_TAGS] = { 0 };
+    auto p = metacache_record_path(r) + r->path_len + 1;
+    auto end = (const char *)r + r->len;
+    for (u32 i = 0; i < r->tags; i++) {
+        if (p >= end)
+            return NULL;
+        auto key = (u8)*p++;
+        const char *nul = memchr(p, 0, (size_t)(end - p));
+        if (!nul || key >= METADATA_NUM_TAGS)
+            return NULL;
+        tags[key] = discard_const(p, char);
+        p = nul + 1;
+    }
+    return metadata_new(tags);
+}
+
+static u8 *metacache_buf_reserve(struct metacache_buf *b, size_t len)
+{
+    if (b->cap - b->len < len) {
+        b->cap = max(b->len + len, 2 * b->cap);
+        b->ptr = xrenew(b->ptr, u8, b->cap);
+    }
+    return b->ptr + b->len;
+}
+
+// Appends the record of an entry. Entries that have not been changed since they were
+// loaded are copied from the mapping.
+static u32 metacache_serialize(struct metacache_buf *b, const char *path,
+        const struct cache_key *key, struct metadata *md,
+        const struct metacache_record *record)
+{
+    if (!md) {
+        memcpy(metacache_buf_reserve(b, record->len), record, record->len);
+        b->len += record->len;
+        return record->len;
+    }
+
+    auto path_len = strlen(path);
+    size_t len = sizeof(struct metacache_record) + path_len + 1;
+    u32 tags = 0;
+    for (auto p = md->pairs; p->key != METADATA_INVALID; p++, tags++)
+        len += strlen(p->val) + 2;
+    len = metacache_align(len);
+    if (len > UINT32_MAX)
+        return 0;
+
+    auto out = metacache_buf_reserve(b, len);
+    memset(out, 0, len);
+    struct metacache_record r = {
+        .len = (u32)len,
+        .path_len = (u32)path_len,
+        .key = *key,
+        .tags = tags,
+    };
+    memcpy(out, &r, sizeof(r));
+    auto pos = sizeof(r);
+    memcpy(out + pos, path, path_len + 1);
+    pos += path_len + 1;
+    for (auto p = md->pairs; p->key != METADATA_INVALID; p++) {
+        out[pos++] = (u8)p->key;
+        auto val_len = strlen(p->val) + 1;
+        memcpy(out + pos, p->val, val_len);
+        pos += val_len;
+    }
+    b->len += len;
+    return (u32)len;
+}
+
+static int metacache_write(int fd, const void *buf, size_t len)
+{
+    const u8 *p = buf;
+    while (len > 0) {
+        auto res = write(fd, p, len);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        p += res;
+        len -= (size_t)res;
+    }
+    return 0;
+}
+
+// Every process that uses the file appends to it and replaces it while holding an
+// exclusive lock. Returns the locked fd of the file that is at the path now, which is a
+// new one if another process replaced the file in the meantime, or -1.
+static int metacache_lock(int fd)
+{
+    while (true) {
+        if (flock(fd, LOCK_EX)) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        struct stat fd_st, path_st;
+        if (!fstat(fd, &fd_st) && !stat(metacache_path, &path_st) &&
+                fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+            return fd;
+        close(fd);
+        fd = open(metacache_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1)
+            return -1;
+    }
+}
+
+// Creates a file that only contains the header. It replaces the cache by being renamed,
+// so that the file is never shrunk while other processes have it mapped. The name is
+// unique to the process.
+static int metacache_create(char **tmp)
+{
+    char pid[16];
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    *tmp = xstrjoin(metacache_path, ".", pid, ".tmp");
+
+    auto fd = open(*tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    struct metacache_header h = { .version = METACACHE_VERSION };
+    memcpy(h.magic, METACACHE_MAGIC, 8);
+    if (metacache_write(fd, &h, sizeof(h))) {
+        close(fd);
+        unlink(*tmp);
+        return -1;
+    }
+    return fd;
+}
+
+// Called with the mutex held. Drops the mapping and points the entries at the records
+// of the new one. Paths of entries that were loaded from the file live in the mapping.
+static void metacache_remap(void *map, size_t len)
+{
+    auto off = sizeof(struct metacache_header);
+    while (off < len) {
+        const struct metacache_record *r = (const void *)((const u8 *)map + off);
+        struct metacache_entry *e = hash_map_get(metacache_index,
+                discard_const(metacache_record_path(r), char));
+        if (e) {
+            e->record = r;
+            if (!e->owned)
+                e->path = metacache_record_path(r);
+        }
+        off += r->len;
+    }
+
+    if (metacache_map)
+        munmap(metacache_map, metacache_map_len);
+    metacache_map = map;
+    metacache_map_len = len;
+}
+
+static size_t metacache_load_records(void)
+{
+    // Avoid rehashing while loading. Records are rarely shorter than this.
+    hash_map_reserve(metacache_index, metacache_map_len / 128);
+
+    auto off = sizeof(struct metacache_header);
+    while (off < metacache_map_len) {
+        const struct metacache_record *r =
+            (const void *)((const u8 *)metacache_map + off);
+        if (!metacache_record_valid(r, metacache_map_len - off))
+            break;
+        off += r->len;
+
+        auto path = metacache_record_path(r);
+        struct metacache_entry *e =
+            hash_map_get(metacache_index, discard_const(path, char));
+        if (!e) {
+            e = xnew0(struct metacache_entry);
+            e->path = path;
+            hash_map_set(metacache_index, e);
+            metacache_entry_vector_push(&metacache_entries, e);
+        }
+        metacache_dead += e->file_len;
+        metacache_live += r->len - e->file_len;
+        e->key = r->key;
+        e->record = r;
+        e->file_len = r->len;
+    }
+    return off;
+}
+
+// Replaces the locked file with an empty one.
+static int metacache_reset(void)
+{
+    auto_free char *tmp = NULL;
+    auto fd = metacache_create(&tmp);
+    if (fd == -1)
+        return -1;
+    if (rename(tmp, metacache_path)) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(metacache_fd);
+    metacache_fd = fd;
+    return 0;
+}
+
+// Maps the file and indexes its records. A file with a different version is replaced
+// and a torn record at the end is truncated away. Since appends hold the lock, a torn
+// record was left by a process that died and lies past the mappings of the others. If
+// the file cannot be read, it is left alone and the cache is disabled until the next
+// start.
+static void metacache_load(void)
+{
+    metacache_fd = open(metacache_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (metacache_fd != -1)
+        metacache_fd = metacache_lock(metacache_fd);
+    if (metacache_fd == -1) {
+        diag_err(main_diag, "metadata cache: could not open %s: %s", metacache_path,
+                utils_strerr(errno));
+        return;
+    }
+
+    struct stat st;
+    if (fstat(metacache_fd, &st))
+        goto read_err;
+    auto size = (size_t)st.st_size;
+
+    struct metacache_header h;
+    if (size < sizeof(h))
+        goto reset;
+    if (pread(metacache_fd, &h, sizeof(h), 0) != sizeof(h))
+        goto read_err;
+    if (memcmp(h.magic, METACACHE_MAGIC, 8) != 0 || h.version != METACACHE_VERSION)
+        goto reset;
+
+    auto map = mmap(NULL, size, PROT_READ, MAP_SHARED, metacache_fd, 0);
+    if (map == MAP_FAILED)
+        goto read_err;
+    metacache_map = map;
+    metacache_map_len = size;
+    auto valid = metacache_load_records();
+    if (valid < size && ftruncate(metacache_fd, (off_t)valid))
+        goto write_err;
+    flock(metacache_fd, LOCK_UN);
+    return;
+
+reset:
+    if (metacache_reset())
+        goto write_err;
+    return;
+
+read_err:
+    diag_err(main_diag, "metadata cache: could not read %s: %s", metacache_path,
+            utils_strerr(errno));
+    goto err;
+write_err:
+    diag_err(main_diag, "metadata cache: could not write %s: %s", metacache_path,
+            utils_strerr(errno));
+err:
+    close(metacache_fd);
+    metacache_fd = -1;
+}
+
+// Called with the mutex held.
+static void metacache_flush(void)
+{
+    auto pending = metacache_pending;
+    metacache_pending = (struct metacache_pending_vector) { 0 };
+    auto fd = metacache_fd;
+
+    struct metacache_buf buf = { 0 };
+    auto lens = xnew_array(u32, pending.len);
+    for (size_t i = 0; i < pending.len; i++) {
+        auto p = &pending.ptr[i];
+        lens[i] = metacache_serialize(&buf, p->path, &p->key, p->md, NULL);
+    }
+
+    // The fd is only replaced on this thread, so it can be used without the mutex.
+    thread_mutex_unlock(&metacache_mutex);
+    auto res = 0;
+    if (fd != -1) {
+        fd = metacache_lock(fd);
+        res = fd == -1 ? -1 : metacache_write(fd, buf.ptr, buf.len);
+        if (fd != -1)
+            flock(fd, LOCK_UN);
+    }
+    thread_mutex_lock(&metacache_mutex);
+
+    if (res) {
+        diag_err(main_diag, "metadata cache: could not write %s: %s", metacache_path,
+                utils_strerr(errno));
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+    }
+    metacache_fd = fd;
+
+    for (size_t i = 0; i < pending.len; i++) {
+        auto p = &pending.ptr[i];
+        struct metacache_entry *e = hash_map_get(metacache_index, p->path);
+        if (e && fd != -1) {
+            metacache_dead += e->file_len;
+            metacache_live += lens[i] - e->file_len;
+            e->file_len = lens[i];
+        }
+        free(p->path);
+        metadata_unref(p->md);
+    }
+    free(lens);
+    free(buf.ptr);
+    free(pending.ptr);
+}
+
+static bool metacache_should_compact(void)
+{
+    return metacache_fd != -1 && metacache_dead >= METACACHE_COMPACT_MIN &&
+        metacache_dead > metacache_live;
+}
+
+// Called with the mutex held. The new file is written in batches and the mutex is only
+// held while a batch is serialized. Entries that change in the meantime are in the
+// pending list and are appended to the new file afterwards.
+static void metacache_compact(void)
+{
+    auto_free char *tmp = NULL;
+    auto num = metacache_entries.len;
+    auto lens = xnew_array(u32, max(num, (size_t)1));
+    struct metacache_buf buf = { 0 };
+    u64 live = 0;
+
+    thread_mutex_unlock(&metacache_mutex);
+
+    auto fd = metacache_create(&tmp);
+    auto res = fd == -1 ? -1 : 0;
+    auto size = sizeof(struct metacache_header);
+
+    for (size_t i = 0; i < num && res == 0; i += METACACHE_COMPACT_BATCH) {
+        buf.len = 0;
+        thread_mutex_lock(&metacache_mutex);
+        for (size_t j = i; j < min(i + METACACHE_COMPACT_BATCH, num); j++) {
+            auto e = metacache_entries.ptr[j];
+            lens[j] = metacache_serialize(&buf, e->path, &e->key, e->md, e->record);
+            live += lens[j];
+        }
+        thread_mutex_unlock(&metacache_mutex);
+        res = metacache_write(fd, buf.ptr, buf.len);
+        size += buf.len;
+    }
+    free(buf.ptr);
+
+    void *map = MAP_FAILED;
+    if (res == 0)
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED && rename(tmp, metacache_path))
+        res = -1;
+
+    thread_mutex_lock(&metacache_mutex);
+
+    if (res || map == MAP_FAILED) {
+        diag_err(main_diag, "metadata cache: could not compact %s: %s", metacache_path,
+                utils_strerr(errno));
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        // Try again once the file has grown by as much as it has now.
+        metacache_live = metacache_live + metacache_dead;
+        metacache_dead = 0;
+        free(lens);
+        return;
+    }
+
+    close(metacache_fd);
+    metacache_fd = fd;
+    metacache_remap(map, size);
+    for (size_t i = 0; i < num; i++)
+        metacache_entries.ptr[i]->file_len = lens[i];
+    metacache_live = live;
+    metacache_dead = 0;
+    free(lens);
+}
+
+static void *metacache_run(void *opaque)
+{
+    (void)opaque;
+
+    trace_thread_name("metacache");
+    auto_unlock lock = thread_mutex_lock(&metacache_mutex);
+    while (true) {
+        if (metacache_pending.len > 0)
+            metacache_flush();
+        else if (metacache_stop)
+            break;
+        else if (metacache_should_compact())
+            metacache_compact();
+        else
+            thread_cond_wait(&metacache_cond, &metacache_mutex);
+    }
+
+    return NULL;
+}
+
+void metacache_init(void)
+{
+    auto start = utils_get_mono_time_ms();
+
+    metacache_index = hash_map_new(&metacache_ops);
+    auto_free auto dir = cache_dir(METACACHE_DIR, true);
+    if (dir) {
+        metacache_path = xstrjoin(dir, "/cache");
+        metacache_load();
+    }
+
+    diag_info(main_diag, "metadata cache: %zu entries loaded in %"PRIu64" ms",
+            metacache_entries.len, utils_get_mono_time_ms() - start);
+
+    auto_restore sigs = signals_block_all();
+    thread_create(&metacache_thread, NULL, metacache_run, NULL);
+}
+
+void metacache_exit(void)
+{
+    auto_unlock lock = thread_mutex_lock(&metacache_mutex);
+    metacache_stop = true;
+    thread_cond_signal(&metacache_cond);
+    thread_mutex_unlock(move(lock));
+
+    thread_join(metacache_thread, NULL);
+
+    for (size_t i = 0; i < metacache_entries.len; i++) {
+        auto e = metacache_entries.ptr[i];
+        if (e->md)
+            metadata_unref(e->md);
+        if (e->owned)
+            free(discard_const(e->path, char));
+        free(e);
+    }
+    free(metacache_entries.ptr);
+    hash_map_free(metacache_index);
+    if (metacache_map)
+        munmap(metacache_map, metacache_map_len);
+    if (metacache_fd != -1)
+        close(metacache_fd);
+    free(metacache_path);
+}
+
+struct metadata *metacache_get(const char *path, const struct cache_key *key)
+{
+    auto_unlock lock = thread_mutex_lock(&metacache_mutex);
+
+    struct metacache_entry *e = hash_map_get(metacache_index, discard_const(path, char));
+    if (!e || memcmp(&e->key, key, sizeof(*key)))
+        return NULL;
+    if (!e->md)
+        e->md = metacache_decode(e->record);
+    return e->md ? metadata_ref(e->md) : NULL;
+}
+
+void metacache_put(const char *path, const struct cache_key *key, struct metadata *md)
+{
+    auto_unlock lock = thread_mutex_lock(&metacache_mutex);
+
+    struct metacache_entry *e = hash_map_get(metacache_index, discard_const(path, char));
+    if (!e) {
+        e = xnew0(struct metacache_entry);
+        e->path = xstrdup(path);
+        e->owned = true;
+        hash_map_set(metacache_index, e);
+        metacache_entry_vector_push(&metacache_entries, e);
+    } else if (e->md) {
+        metadata_unref(e->md);
+    }
+    e->key = *key;
+    e->md = metadata_ref(md);
+
+    metacache_pending_vector_push(&metacache_pending, (struct metacache_pending) {
+        .path = xstrdup(path),
+        .md = metadata_ref(md),
+        .key = *key,
+    });
+    thread_cond_signal(&metacache_cond);
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
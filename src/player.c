@@ -1,6 +1,11 @@
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
 
 #include "utils/utils.h"
 #include "utils/list.h"
@@ -10,20 +15,48 @@
 #include "utils/signals.h"
 #include "utils/thread.h"
 #include "utils/diag.h"
+#include "utils/seqlock.h"
+#include "utils/convert.h"
+#include "utils/resample.h"
+#include "utils/gain.h"
+#include "utils/vec.h"
+#include "utils/trace.h"
 
 #include "player.h"
 #include "globals.h"
 #include "sink.h"
 #include "decoder.h"
 #include "main.h"
+#include "prefetch.h"
+#include "filter.h"
+
+#define PLAYER_BUFFER_ENV "OKA_BUFFER_MS"
+#define PLAYER_DEFAULT_BUFFER_MS 2000
+#define PLAYER_RATE_ENV "OKA_SAMPLE_RATE"
+#define PLAYER_QUALITY_ENV "OKA_RESAMPLE_QUALITY"
+#define PLAYER_REPLAYGAIN_ENV "OKA_REPLAYGAIN"
+#define PLAYER_PREAMP_ENV "OKA_REPLAYGAIN_PREAMP"
+#define PLAYER_LIMIT_ENV "OKA_REPLAYGAIN_LIMIT"
+#define PLAYER_CROSSFADE_ENV "OKA_CROSSFADE_MS"
+
+// Maximum number of frames resampled or crossfaded at once.
+#define PLAYER_RESAMPLE_FRAMES 4096
+#define PLAYER_FADE_FRAMES 4096
+
+// How long before the end of the last input the next track is requested from main.
+#define PLAYER_NEXT_TRACK_LEAD_MS 10000
 
 struct player_input {
     struct list node;
     struct decoder_stream *stream;
+    struct prefetch *prefetch;
+    struct loop_watch *watch;
     bool eof;
-    i64 remaining_ms; // until this track has been fully played
+    u32 segment; // sink stream the last frame of this input was committed to
+    u64 end; // value of player_committed after the last frame of this input
     struct main_track_cookie *cookie;
     u64 pos_samples;
+    float replaygain; // linear, applied on top of player_volume
 };
 
 static pthread_t player_thread;
@@ -33,14 +66,93 @@ static struct loop *player_loop;
 static struct loop_defer *player_provide_input_defer;
 static bool player_paused;
 static bool player_mute;
+static bool player_input_requested;
+static bool player_starving;
+static u32 player_buffer_ms = PLAYER_DEFAULT_BUFFER_MS;
+static _Atomic u32 player_buffer_fill_ms;
+static _Atomic u32 player_buffer_size_ms;
+
+// The next track is requested asynchronously. Once it arrives it is kept in
+// player_next (already decoding ahead) until the last input has been read completely.
+static struct player_input *player_next;
+static u64 player_next_id;
+static bool player_next_ready;
+static bool player_next_requested;
+static bool player_next_wanted;
+static bool player_next_flush;
+
+// Playback position of the first input, published to other threads. Readers
+// extrapolate from the snapshot with the monotonic clock but never past the frames that
+// have been committed to the sink.
+static struct {
+    struct seqlock lock;
+    _Atomic u64 time_ms;
+    _Atomic u64 pos;
+    _Atomic u64 limit;
+    _Atomic u32 rate;
+    _Atomic bool running;
+} player_clock;
+
+// Frames committed since the sink last started a new stream. Compared against
+// sink->played to find the exact frame at which one track ends and the next begins.
+static struct audio_format player_sink_fmt;
+static bool player_have_sink_fmt;
+static u32 player_segment;
+static u64 player_committed;
+static u64 player_played; // last value returned by sink->played
+
+// All tracks are resampled to a single sink rate. It is either configured or taken from
+// the first track and then kept for the whole session.
+static u32 player_sink_rate;
+static enum resample_quality player_resample_quality = RESAMPLE_MEDIUM;
+static struct resampler *player_resampler;
+static u8 *player_scratch;
+static size_t player_scratch_size;
+
+// Software gain applied to the samples in the sink buffer.
+enum player_replaygain {
+    PLAYER_REPLAYGAIN_OFF,
+    PLAYER_REPLAYGAIN_TRACK,
+    PLAYER_REPLAYGAIN_ALBUM,
+};
 
-static struct loop_timer *player_pos_timer;
-static u64 player_pos_update_time;
-static u32 player_pos_msec;
-static u32 player_pos_sec = (u32)-1;
+static enum player_replaygain player_replaygain_mode;
+static float player_replaygain_preamp; // in dB
+static bool player_replaygain_limit = true;
+static u32 player_volume = 100; // in percent
+
+// During a crossfade the last input fades in while player_fading, the input before it,
+// fades out. Both are read concurrently from their decode-ahead buffers. The fading
+// input keeps the resampler it was using before the crossfade started. Positions are
+// in sink frames. The first player_fade_carried frames of the scratch buffer have been
+// read from the fading input but not mixed yet.
+static u32 player_crossfade_ms;
+static struct player_input *player_fading;
+static struct resampler *player_fade_resampler;
+static u64 player_fade_pos;
+static u64 player_fade_len;
+static u8 *player_fade_scratch;
+static size_t player_fade_scratch_size;
+static size_t player_fade_carried;
+
+// Used to poll the sink while it switches to a new stream.
+#define PLAYER_TRACK_CHANGE_POLL_MS 10
 
 static struct loop_timer *player_track_change_timer;
-static u64 player_track_change_update_time;
+
+// Filters are applied in place to the sink buffer right before it is committed. Their
+// instances are opened for the sink format of the current sink stream.
+struct player_filter {
+    struct filter *filter;
+    struct filter_instance *instance;
+    u64 frames;
+    u64 ns;
+};
+
+UTILS_VECTOR(player_filter, struct player_filter)
+
+static struct player_filter_vector player_filters;
+static struct audio_format player_filter_fmt;
 
 static struct player_input *player_node_to_input(struct list *node)
 {
@@ -61,84 +173,177 @@ static struct player_input *player_last_input(void)
     return player_node_to_input(player_inputs.prev);
 }
 
-static void player_timing_update(bool seeked)
+static size_t player_frame_size(const struct audio_format *fmt)
+{
+    return audio_bytes_per_sample(fmt->sample_fmt) * fmt->channels;
+}
+
+// Frames of an input that has been read completely which the sink has not played yet.
+// Inputs committed to an older sink stream are done once the new stream has started.
+static u64 player_input_unplayed(struct player_input *input, u64 played)
 {
-    auto input = player_first_input();
+    if (input->segment != player_segment)
+        return played > 0 ? 0 : 1;
+    return input->end > played ? input->end - played : 0;
+}
 
-    if (!input) {
-        player_pos_msec = 0;
-        player_pos_sec = 0;
+static void player_filters_close(void)
+{
+    for (size_t i = 0; i < player_filters.len; i++) {
+        auto f = &player_filters.ptr[i];
+        if (f->instance)
+            f->instance->close(move(f->instance));
     }
+    player_filter_fmt = (struct audio_format){ 0 };
+}
 
-    if ((player_paused && !seeked) || !input || !player_sink) {
-        loop_timer_disable(player_pos_timer);
-        main_position_changed(player_pos_sec);
+static void player_filter_open(struct player_filter *f)
+{
+    f->instance = f->filter->open(f->filter, &player_filter_fmt);
+    if (!f->instance)
+        diag_info(main_diag, "filter %s does not support the sink format",
+                f->filter->name);
+}
+
+// Opens the filters for a new sink stream or resets them if the format is unchanged.
+static void player_filters_load(const struct audio_format *fmt)
+{
+    if (!fmt || !audio_formats_eq(fmt, &player_filter_fmt)) {
+        player_filters_close();
+        if (!fmt)
+            return;
+        player_filter_fmt = *fmt;
+        for (size_t i = 0; i < player_filters.len; i++)
+            player_filter_open(&player_filters.ptr[i]);
         return;
     }
+    for (size_t i = 0; i < player_filters.len; i++) {
+        auto instance = player_filters.ptr[i].instance;
+        if (instance)
+            instance->reset(instance);
+    }
+}
 
-    player_pos_update_time = utils_get_mono_time_ms();
-    player_pos_msec = (u32)(1000 * input->pos_samples / input->stream->fmt.sample_rate);
-    u32 latency;
-
-    if (input->eof) {
-        auto diff = (u32)(player_pos_update_time - player_track_change_update_time);
-        latency = (u32)input->remaining_ms - diff;
-        if (diff > input->remaining_ms)
-            latency = 0;
-    } else
-        latency = player_sink->latency(player_sink);
+static bool player_filter_active(struct player_filter *f)
+{
+    return f->instance && !atomic_load_explicit(&f->filter->bypass, memory_order_relaxed);
+}
 
-    if (player_pos_msec > latency)
-        player_pos_msec -= latency;
-    else
-        player_pos_msec = 0;
-    auto new_sec = player_pos_msec / 1000;
-    if (new_sec != player_pos_sec && (new_sec > player_pos_sec || seeked)) {
-        player_pos_sec = new_sec;
-        main_position_changed(new_sec);
+static void player_filters_process(u8 *buf, size_t frames)
+{
+    for (size_t i = 0; i < player_filters.len; i++) {
+        auto f = &player_filters.ptr[i];
+        if (!player_filter_active(f))
+            continue;
+        auto start = utils_get_mono_time_ns();
+        f->instance->process(f->instance, buf, frames);
+        f->ns += utils_get_mono_time_ns() - start;
+        f->frames += frames;
     }
+}
 
-    auto rem_msec = 1000 - (player_pos_msec % 1000);
-    auto rem_sec = player_pos_sec - new_sec;
-    if (rem_msec == 1000) {
-        rem_msec = 0;
-        rem_sec += 1;
+// Frames by which the filters delay the samples.
+static u64 player_filters_latency(void)
+{
+    u64 latency = 0;
+    for (size_t i = 0; i < player_filters.len; i++) {
+        auto f = &player_filters.ptr[i];
+        if (player_filter_active(f))
+            latency += f->instance->latency(f->instance);
     }
+    return latency;
+}
 
-    struct itimerspec timer = {
-        .it_interval = {
-            .tv_sec = 1,
-            .tv_nsec = 0,
-        },
-        .it_value = {
-            .tv_sec = rem_sec,
-            .tv_nsec = 1000 * 1000 * rem_msec,
-        },
-    };
-
-    loop_timer_set(player_pos_timer, &timer, false);
+static void player_update_played(void)
+{
+    if (player_sink)
+        player_played = player_sink->played(player_sink);
 }
 
-static void player_pos_tick(struct loop_timer *t, void *opaque)
+// The frame of the first input that is being played, based on the last value of
+// player_played.
+static u64 player_first_position(struct player_input *first)
 {
-    (void)t;
-    (void)opaque;
+    u64 unplayed = 0;
+    if (first->eof)
+        unplayed = player_input_unplayed(first, player_played);
+    else if (player_committed > player_played)
+        unplayed = player_committed - player_played;
+    unplayed += player_filters_latency();
+    auto rate = first->stream->fmt.sample_rate;
+    if (player_sink_fmt.sample_rate)
+        unplayed = unplayed * rate / player_sink_fmt.sample_rate;
+    return first->pos_samples > unplayed ? first->pos_samples - unplayed : 0;
+}
 
-    if (player_paused)
-        return;
+static void player_clock_update(void)
+{
+    auto first = player_first_input();
+    u64 pos = 0, limit = 0;
+    u32 rate = 0;
+
+    player_update_played();
+    if (first) {
+        rate = first->stream->fmt.sample_rate;
+        limit = first->pos_samples;
+        pos = player_first_position(first);
+    }
+    auto running = first && player_sink && !player_paused && player_played > 0;
+
+    seqlock_write_begin(&player_clock.lock);
+    atomic_store_explicit(&player_clock.time_ms, utils_get_mono_time_ms(),
+            memory_order_relaxed);
+    atomic_store_explicit(&player_clock.pos, pos, memory_order_relaxed);
+    atomic_store_explicit(&player_clock.limit, limit, memory_order_relaxed);
+    atomic_store_explicit(&player_clock.rate, rate, memory_order_relaxed);
+    atomic_store_explicit(&player_clock.running, running, memory_order_relaxed);
+    seqlock_write_end(&player_clock.lock);
+}
 
-    auto old = player_pos_update_time;
-    player_pos_update_time = utils_get_mono_time_ms();
-    player_pos_msec += player_pos_update_time - old;
-    auto new_sec = player_pos_msec / 1000;
-    if (new_sec != player_pos_sec) {
-        player_pos_sec = new_sec;
-        main_position_changed(new_sec);
+u64 player_get_position_ms(void)
+{
+    u64 time, pos, limit;
+    u32 rate, seq;
+    bool running;
+
+    do {
+        seq = seqlock_read_begin(&player_clock.lock);
+        time = atomic_load_explicit(&player_clock.time_ms, memory_order_relaxed);
+        pos = atomic_load_explicit(&player_clock.pos, memory_order_relaxed);
+        limit = atomic_load_explicit(&player_clock.limit, memory_order_relaxed);
+        rate = atomic_load_explicit(&player_clock.rate, memory_order_relaxed);
+        running = atomic_load_explicit(&player_clock.running, memory_order_relaxed);
+    } while (seqlock_read_retry(&player_clock.lock, seq));
+
+    if (rate == 0)
+        return 0;
+    if (running) {
+        auto elapsed = utils_get_mono_time_ms() - time;
+        pos = min(pos + elapsed * rate / 1000, limit);
     }
+    return 1000 * pos / rate;
+}
+
+static void player_update_provide_input_defer(void)
+{
+    auto enable = player_input_requested && !player_starving;
+    loop_defer_set(player_provide_input_defer, enable);
+}
+
+static void player_fade_clear(void)
+{
+    player_fading = NULL;
+    player_fade_carried = 0;
+    if (player_fade_resampler)
+        resampler_free(move(player_fade_resampler));
 }
 
 static void player_input_free(struct player_input *input)
 {
+    if (input == player_fading)
+        player_fade_clear();
+    loop_watch_free(input->watch);
+    prefetch_free(input->prefetch);
     input->stream->close(input->stream);
     list_remove(&input->node);
     free(input);
@@ -146,81 +351,158 @@ static void player_input_free(struct player_input *input)
 
 static void player_track_change(struct player_input *input)
 {
-    main_track_changed(input->cookie);
     player_input_free(input);
-    player_timing_update(true);
+    auto first = player_first_input();
+    main_track_changed(first ? first->cookie : NULL);
+    player_clock_update();
 }
 
-static void player_continue_track_change_timer(void)
+static void player_update_track_change_timer(void)
 {
-    if (player_paused)
+    auto first = player_first_input();
+    if (player_paused || !player_sink || !first || !first->eof) {
+        loop_timer_disable(player_track_change_timer);
         return;
+    }
 
-    struct player_input *first;
-
-    while (1) {
-        first = player_first_input();
-        if (!first || !first->eof)
-            return;
-        if (first->remaining_ms <= 0)
-            player_track_change(first);
-        else
-            break;
+    u64 ms = PLAYER_TRACK_CHANGE_POLL_MS;
+    if (first->segment == player_segment) {
+        auto unplayed = player_input_unplayed(first, player_played);
+        ms = 1 + 1000 * unplayed / player_sink_fmt.sample_rate;
     }
 
-    long rem_sec = first->remaining_ms / 1000;
-    long rem_msec = first->remaining_ms % 1000;
     struct itimerspec timer = {
         .it_interval = { 0 },
         .it_value = {
-            .tv_sec = rem_sec,
-            .tv_nsec = 1000 * 1000 * rem_msec,
+            .tv_sec = (time_t)(ms / 1000),
+            .tv_nsec = (long)(1000 * 1000 * (ms % 1000)),
         },
     };
     loop_timer_set(player_track_change_timer, &timer, false);
 }
 
+static void player_check_track_change(void)
+{
+    if (player_sink) {
+        player_update_played();
+        struct player_input *first;
+        while ((first = player_first_input()) && first->eof &&
+                player_input_unplayed(first, player_played) == 0)
+            player_track_change(first);
+    }
+    player_update_track_change_timer();
+}
+
 static void player_track_change_tick(struct loop_timer *t, void *opaque)
 {
     (void)t;
     (void)opaque;
 
-    auto old = player_track_change_update_time;
-    player_track_change_update_time = utils_get_mono_time_ms();
-    auto diff = player_track_change_update_time - old;
+    player_check_track_change();
+}
 
-    struct player_input *input;
-    list_for_each_entry(input, &player_inputs, node) {
-        input->remaining_ms -= diff;
-    }
+static void player_input_set_eof(struct player_input *input, u64 end);
 
-    struct list *node, *n;
-    list_for_each_safe(node, n, &player_inputs) {
-        input = player_node_to_input(node);
-        if (input->remaining_ms > 0 || !input->eof)
-            break;
-        player_track_change(input);
-    }
+// The fading input has been read up to frame end of the current sink stream.
+static void player_fade_end(u64 end)
+{
+    if (!player_fading)
+        return;
+    player_input_set_eof(player_fading, end);
+    player_fade_clear();
+}
 
-    player_continue_track_change_timer();
+static void player_new_segment(const struct audio_format *fmt)
+{
+    // The remainder of a crossfade cannot continue in a new sink stream.
+    player_fade_end(player_committed);
+    player_segment++;
+    player_committed = 0;
+    player_played = 0;
+    if (player_resampler)
+        resampler_reset(player_resampler);
+    player_have_sink_fmt = fmt != NULL;
+    if (fmt)
+        player_sink_fmt = *fmt;
+    player_filters_load(fmt);
 }
 
-static void player_pause_track_change_timer(void)
+// Sample formats the decoded samples are converted to if the sink does not support the
+// format of the decoder, in order of preference.
+static const audio_sample_fmt_type player_sample_fmts[] = {
+    AUDIO_FORMAT_FLOAT32,
+    AUDIO_FORMAT_S32,
+    AUDIO_FORMAT_S24_IN_32,
+    AUDIO_FORMAT_S24,
+    AUDIO_FORMAT_S16,
+    AUDIO_FORMAT_FLOAT64,
+};
+
+static void player_output_format(const struct audio_format *in, struct audio_format *out)
 {
-    loop_timer_disable(player_track_change_timer);
-    player_track_change_tick(player_track_change_timer, NULL);
+    *out = *in;
+
+    auto range = &player_sink->range;
+    if (!player_sink_rate)
+        player_sink_rate = in->sample_rate;
+    out->sample_rate = player_sink_rate;
+    out->sample_rate = max(out->sample_rate, range->min_sample_rate);
+    out->sample_rate = min(out->sample_rate, range->max_sample_rate);
+
+    // Formats supported by all filters are preferred so that none of them has to be
+    // skipped.
+    auto fmts = range->sample_fmts;
+    for (size_t i = 0; i < player_filters.len; i++) {
+        auto f = player_filters.ptr[i].filter;
+        if (fmts & f->sample_fmts)
+            fmts &= f->sample_fmts;
+    }
+    if (fmts & in->sample_fmt)
+        return;
+    for (size_t i = 0; i < N_ELEMENTS(player_sample_fmts); i++) {
+        if (fmts & player_sample_fmts[i]) {
+            out->sample_fmt = player_sample_fmts[i];
+            return;
+        }
+    }
+    out->sample_fmt = fmts & -fmts;
 }
 
-static void player_start_track_change_timer(void)
+// The following two functions take the format of the decoder and configure the sink
+// with the format the samples are converted to.
+
+static void player_sink_set_format(const struct audio_format *fmt)
 {
-    player_track_change_update_time = utils_get_mono_time_ms();
-    player_continue_track_change_timer();
+    struct audio_format out;
+    if (fmt) {
+        player_output_format(fmt, &out);
+        fmt = &out;
+    }
+
+    if (!fmt)
+        player_have_sink_fmt = false;
+    else if (!player_have_sink_fmt || !audio_formats_eq(&player_sink_fmt, fmt))
+        player_new_segment(fmt);
+    player_sink->set_format(player_sink, fmt);
+}
+
+static void player_sink_flush(const struct audio_format *fmt)
+{
+    struct audio_format out;
+    if (fmt) {
+        player_output_format(fmt, &out);
+        fmt = &out;
+    }
+
+    player_new_segment(fmt);
+    player_sink->flush(player_sink, fmt);
 }
 
 static void player_sink_stop(void)
 {
-    loop_defer_set(player_provide_input_defer, false);
-    player_sink->set_format(player_sink, NULL);
+    player_input_requested = false;
+    player_update_provide_input_defer();
+    player_sink_set_format(NULL);
 }
 
 static void player_sink_disable(void)
@@ -235,19 +517,77 @@ static void player_sink_load(struct sink *sink)
         player_sink_disable();
     }
     player_sink = sink;
+    player_have_sink_fmt = false;
     if (player_sink) {
         player_sink->enable(player_sink);
         auto last = player_last_input();
         if (last)
-            player_sink->set_format(player_sink, &last->stream->fmt);
+            player_sink_set_format(&last->stream->fmt);
+    }
+    player_check_track_change();
+}
+
+static void player_input_ready(struct loop_watch *w, void *opaque, int fd, u32 events)
+{
+    (void)w;
+    (void)fd;
+    (void)events;
+
+    struct player_input *input = opaque;
+    prefetch_clear_fd(input->prefetch);
+    if (input == player_last_input() || input == player_fading) {
+        player_starving = false;
+        player_update_provide_input_defer();
     }
 }
 
-static void player_input_load(struct decoder_stream *s, struct main_track_cookie *c,
-        bool flush)
+// Linear ReplayGain of a stream. Falls back to the track values if the album values
+// are missing. With clipping prevention the gain is lowered so that the peak stays at
+// or below full scale.
+static float player_replaygain(const struct gain_replaygain *rg)
+{
+    if (player_replaygain_mode == PLAYER_REPLAYGAIN_OFF)
+        return 1;
+
+    auto db = rg->track_gain;
+    auto peak = rg->track_peak;
+    if (player_replaygain_mode == PLAYER_REPLAYGAIN_ALBUM && !isnan(rg->album_gain)) {
+        db = rg->album_gain;
+        peak = rg->album_peak;
+    }
+    if (isnan(db))
+        db = 0;
+
+    auto gain = gain_from_db(db + player_replaygain_preamp);
+    if (player_replaygain_limit && !isnan(peak) && peak > 0)
+        gain = min(gain, 1 / peak);
+    return gain;
+}
+
+static float player_input_gain(struct player_input *input)
+{
+    return input->replaygain * (float)player_volume / 100;
+}
+
+static struct player_input *player_input_new(struct decoder_stream *s,
+        struct main_track_cookie *c)
+{
+    auto input = xnew0(struct player_input);
+    input->stream = s;
+    input->cookie = c;
+    input->replaygain = player_replaygain(&s->replaygain);
+    input->prefetch = prefetch_new(s, player_buffer_ms);
+    input->watch = loop_watch_new(player_loop, player_input_ready, input);
+    loop_watch_set(input->watch, prefetch_fd(input->prefetch), EPOLLIN | EPOLLET);
+    list_init(&input->node);
+    return input;
+}
+
+static void player_input_load(struct player_input *input, bool flush)
 {
     bool was_playing = !list_empty(&player_inputs);
-    bool is_playing = s != NULL;
+    bool is_playing = input != NULL;
+    auto s = input ? input->stream : NULL;
 
     if (flush) {
         struct list *node, *n;
@@ -258,44 +598,332 @@ static void player_input_load(struct decoder_stream *s, struct main_track_cookie
     }
 
     if (list_empty(&player_inputs))
-        main_track_changed(c);
+        main_track_changed(input ? input->cookie : NULL);
 
-    auto last = xnew0(struct player_input);
-    last->stream = s;
-    last->cookie = c;
-    list_append(&player_inputs, &last->node);
+    if (input)
+        list_append(&player_inputs, &input->node);
+
+    player_starving = false;
+    player_update_provide_input_defer();
 
     if (player_sink) {
         if (was_playing && flush)
-            player_sink->flush(player_sink, &s->fmt);
+            player_sink_flush(s ? &s->fmt : NULL);
         else if (is_playing)
-            player_sink->set_format(player_sink, &s->fmt);
+            player_sink_set_format(&s->fmt);
         else if (was_playing)
             player_sink_stop();
     }
 
-    player_timing_update(true);
+    player_clock_update();
+}
+
+static void player_request_next(void)
+{
+    if (player_next_ready || player_next_requested)
+        return;
+    player_next_requested = true;
+    main_request_next_track(player_next_id);
+}
+
+static void player_drop_next(void)
+{
+    if (player_next)
+        player_input_free(move(player_next));
+    player_next_ready = false;
+    player_next_requested = false;
+    player_next_wanted = false;
+    player_next_flush = false;
+    player_next_id++;
 }
 
 static void player_goto_next_(bool flush)
 {
-    struct decoder_stream *next;
-    struct main_track_cookie *cookie;
-    main_get_next_track_SYNC(&next, &cookie);
-    player_input_load(next, cookie, flush);
+    if (!player_next_ready) {
+        player_request_next();
+        player_next_wanted = true;
+        player_next_flush |= flush;
+        if (!flush) {
+            player_starving = true;
+            player_update_provide_input_defer();
+        }
+        return;
+    }
+
+    player_next_ready = false;
+    player_input_load(move(player_next), flush);
+}
+
+static void player_input_set_eof(struct player_input *input, u64 end)
+{
+    input->eof = true;
+    input->segment = player_segment;
+    input->end = end;
+    if (input == player_first_input())
+        player_update_track_change_timer();
 }
 
 static void player_input_eof(void)
 {
     auto last = player_last_input();
-    last->remaining_ms = player_sink->latency(player_sink);
-    last->eof = true;
-    player_start_track_change_timer();
-    player_timing_update(false);
+    if (last->eof)
+        return;
+    player_input_set_eof(last, player_committed);
+    player_clock_update();
 
+    player_request_next();
     player_goto_next_(false);
 }
 
+static bool player_input_nearly_done(struct player_input *input)
+{
+    if (prefetch_decoded(input->prefetch))
+        return true;
+
+    auto length = input->stream->length;
+    auto lead_ms = PLAYER_NEXT_TRACK_LEAD_MS + player_crossfade_ms;
+    auto lead = (u64)input->stream->fmt.sample_rate * lead_ms / 1000;
+    return length > 0 && input->pos_samples + lead >= length;
+}
+
+// Appends the prepared next track to the inputs without touching the sink if it is
+// played with the same sink format as the last input. Its first frame then directly
+// follows the last frame of the previous track in the sink buffer.
+static bool player_can_splice_next(void)
+{
+    if (!player_next_ready || !player_next)
+        return false;
+    struct audio_format out;
+    player_output_format(&player_next->stream->fmt, &out);
+    return audio_formats_eq(&out, &player_sink_fmt);
+}
+
+static bool player_splice_next(void)
+{
+    if (!player_can_splice_next())
+        return false;
+
+    player_next_ready = false;
+    list_append(&player_inputs, &move(player_next)->node);
+    return true;
+}
+
+static u8 *player_get_scratch(size_t size)
+{
+    if (size > player_scratch_size) {
+        player_scratch = xrenew(player_scratch, u8, size);
+        player_scratch_size = size;
+    }
+    return player_scratch;
+}
+
+// An input has ended once all of its frames have been decoded and its resampler, if it
+// has one, has been drained. Resamplers are therefore only replaced or freed without
+// losing frames once the input that used them has ended.
+static bool player_input_done(const struct player_input *input,
+        const struct resampler *r)
+{
+    return prefetch_eof(input->prefetch) && (!r || resampler_drained(r));
+}
+
+static struct resampler *player_get_resampler(struct resampler **slot,
+        const struct audio_format *in)
+{
+    auto r = *slot;
+    if (r && resampler_in_rate(r) == in->sample_rate &&
+            resampler_channels(r) == in->channels)
+        return r;
+
+    if (r)
+        resampler_free(r);
+    *slot = resampler_new(in->sample_rate, player_sink_fmt.sample_rate, in->channels,
+            player_resample_quality);
+    return *slot;
+}
+
+// Reads samples of an input whose rate differs from the sink rate. The
+// samples are converted to floats in a scratch buffer, resampled, scaled by the gain,
+// and then converted to the sink format.
+static size_t player_input_resample(struct player_input *input, struct resampler **slot,
+        u8 *buf, size_t len)
+{
+    auto in = &input->stream->fmt;
+    auto r = player_get_resampler(slot, in);
+    auto in_frame = player_frame_size(in);
+    auto float_frame = sizeof(float) * in->channels;
+    auto out_frame = player_frame_size(&player_sink_fmt);
+
+    // The drain belongs to an input that has ended or to this input before a seek.
+    if (resampler_drained(r) || (resampler_draining(r) && !prefetch_eof(input->prefetch)))
+        resampler_reset(r);
+
+    auto wanted = min(len / out_frame, (size_t)PLAYER_RESAMPLE_FRAMES);
+    auto needed = resampler_draining(r) ? 0 : resampler_needed(r, wanted);
+    auto in_size = needed * max(in_frame, float_frame);
+    in_size = (in_size + 15) & ~(size_t)15;
+    auto scratch = player_get_scratch(in_size + wanted * float_frame);
+    auto resampled = (float *)(scratch + in_size);
+
+    size_t frames = 0;
+    if (!resampler_draining(r)) {
+        auto n = prefetch_read(input->prefetch, scratch, needed * in_frame) / in_frame;
+        convert_samples(in->sample_fmt, AUDIO_FORMAT_FLOAT32, scratch, scratch,
+                n * in->channels);
+        resampler_push(r, (float *)scratch, n);
+        frames = resampler_pull(r, resampled, wanted);
+    }
+    // The last frames of the input are held back by the filter until it is drained.
+    if (frames < wanted && prefetch_eof(input->prefetch))
+        frames += resampler_drain(r, resampled + frames * in->channels, wanted - frames);
+    gain_apply(AUDIO_FORMAT_FLOAT32, resampled, frames * in->channels,
+            player_input_gain(input));
+    convert_samples(AUDIO_FORMAT_FLOAT32, player_sink_fmt.sample_fmt, resampled, buf,
+            frames * in->channels);
+    return frames * out_frame;
+}
+
+// Reads samples of an input whose rate matches the sink rate. A conversion to the sink
+// format clips and quantizes the samples, so the gain is applied in float before it.
+// Samples that are already in the sink format are scaled in place. Samples are only
+// converted in place if that fills the buffer, which it does not if they shrink.
+static size_t player_input_convert(struct player_input *input, u8 *buf, size_t len)
+{
+    auto in = &input->stream->fmt;
+    auto in_frame = player_frame_size(in);
+    auto out_frame = player_frame_size(&player_sink_fmt);
+    auto sink_fmt = player_sink_fmt.sample_fmt;
+    auto gain = player_input_gain(input);
+
+    if (in->sample_fmt == sink_fmt || (gain == 1.0f && in_frame <= out_frame)) {
+        auto frames = len / out_frame;
+        frames = prefetch_read(input->prefetch, buf, frames * in_frame) / in_frame;
+        convert_samples(in->sample_fmt, sink_fmt, buf, buf, frames * in->channels);
+        gain_apply(sink_fmt, buf, frames * in->channels, gain);
+        return frames * out_frame;
+    }
+
+    auto float_frame = sizeof(float) * in->channels;
+    auto frames = len / out_frame;
+    auto scratch = player_get_scratch(frames * max(in_frame, float_frame));
+    frames = prefetch_read(input->prefetch, scratch, frames * in_frame) / in_frame;
+    convert_samples(in->sample_fmt, AUDIO_FORMAT_FLOAT32, scratch, scratch,
+            frames * in->channels);
+    gain_apply(AUDIO_FORMAT_FLOAT32, scratch, frames * in->channels, gain);
+    convert_samples(AUDIO_FORMAT_FLOAT32, sink_fmt, scratch, buf,
+            frames * in->channels);
+    return frames * out_frame;
+}
+
+// Reads samples of the input into the sink buffer in the format of the sink with the
+// gain applied. slot holds the resampler used for this input. Returns the number of
+// bytes available to the sink.
+static size_t player_input_read(struct player_input *input, struct resampler **slot,
+        u8 *buf, size_t len)
+{
+    if (input->stream->fmt.sample_rate != player_sink_fmt.sample_rate)
+        return player_input_resample(input, slot, buf, len);
+
+    if (*slot)
+        resampler_free(move(*slot));
+    return player_input_convert(input, buf, len);
+}
+
+// Starts crossfading into the prepared next track once the remaining frames of the
+// last input fit into the crossfade.
+static bool player_crossfade_begin(struct player_input *last)
+{
+    if (!player_crossfade_ms || player_fading || last->eof || !player_can_splice_next())
+        return false;
+
+    auto rate = last->stream->fmt.sample_rate;
+    auto length = last->stream->length;
+    auto pos = last->pos_samples;
+    if (!length || pos >= length)
+        return false;
+    auto remaining = length - pos;
+    if (remaining > (u64)rate * player_crossfade_ms / 1000)
+        return false;
+
+    player_fading = last;
+    player_fade_pos = 0;
+    player_fade_len = max(remaining * player_sink_fmt.sample_rate / rate, (u64)1);
+    player_fade_resampler = move(player_resampler);
+    player_splice_next();
+    return true;
+}
+
+// Reads the next chunk of a crossfade into buf. committed is the sink frame at which
+// buf starts. Frames are only mixed while both inputs have some available, so a fading
+// input that runs short stretches the fade instead of being replaced by silence. Once
+// the incoming input has ended, the fading input continues alone. The crossfade ends
+// when the fading input is exhausted.
+static size_t player_crossfade_read(struct player_input *input, u8 *buf, size_t len,
+        u64 committed)
+{
+    auto out = player_fading;
+    auto fmt = player_sink_fmt.sample_fmt;
+    auto channels = player_sink_fmt.channels;
+    auto frame = player_frame_size(&player_sink_fmt);
+
+    // The carried frames are at the start of the scratch buffer, which keeps its
+    // contents when it grows.
+    auto size = PLAYER_FADE_FRAMES * (frame + 2 * sizeof(float) * channels);
+    if (size > player_fade_scratch_size) {
+        player_fade_scratch = xrenew(player_fade_scratch, u8, size);
+        player_fade_scratch_size = size;
+    }
+    auto out_buf = player_fade_scratch;
+    auto fin = (float *)(out_buf + PLAYER_FADE_FRAMES * frame);
+    auto fout = fin + PLAYER_FADE_FRAMES * channels;
+
+    auto frames = min(len / frame, (size_t)PLAYER_FADE_FRAMES);
+    auto m = player_fade_carried;
+    while (m < frames) {
+        auto r = player_input_read(out, &player_fade_resampler, out_buf + m * frame,
+                (frames - m) * frame) / frame;
+        if (r == 0)
+            break;
+        m += r;
+    }
+    out->pos_samples = prefetch_pos(out->prefetch);
+    auto out_done = m < frames && player_input_done(out, player_fade_resampler);
+
+    if (m == 0) {
+        if (out_done)
+            player_fade_end(committed);
+        return 0;
+    }
+
+    auto n = player_input_read(input, &player_resampler, buf, m * frame) / frame;
+    auto k = n;
+    if (n < m && player_input_done(input, player_resampler))
+        k = m;
+    if (k == 0) {
+        player_fade_carried = m;
+        return 0;
+    }
+
+    convert_samples(fmt, AUDIO_FORMAT_FLOAT32, buf, fin, n * channels);
+    memset(fin + n * channels, 0, sizeof(float) * (k - n) * channels);
+    convert_samples(fmt, AUDIO_FORMAT_FLOAT32, out_buf, fout, k * channels);
+    gain_crossfade(fin, fout, k, channels, player_fade_pos, player_fade_len);
+    convert_samples(AUDIO_FORMAT_FLOAT32, fmt, fin, buf, k * channels);
+
+    memmove(out_buf, out_buf + k * frame, (m - k) * frame);
+    player_fade_carried = m - k;
+    player_fade_pos += k;
+    if (out_done && player_fade_carried == 0)
+        player_fade_end(committed + k);
+    return k * frame;
+}
+
+static void player_commit_buf(u8 *buf, size_t len)
+{
+    trace_begin(TRACE_COMMIT_BUF, len, 0);
+    BUG_ON(player_sink->commit_buf(player_sink, buf, len));
+    trace_end(TRACE_COMMIT_BUF, 0, 0);
+}
+
 static void player_provide_input(struct loop_defer *d, void *opaque)
 {
     (void)d;
@@ -303,23 +931,61 @@ static void player_provide_input(struct loop_defer *d, void *opaque)
 
     u8 *buf;
     size_t len;
+    trace_begin(TRACE_PROVIDE_BUF, 0, 0);
     BUG_ON(player_sink->provide_buf(player_sink, &buf, &len));
+    trace_end(TRACE_PROVIDE_BUF, len, 0);
 
     if (len == 0) {
-        BUG_ON(player_sink->commit_buf(player_sink, buf, len));
-        loop_defer_set(player_provide_input_defer, false);
+        player_commit_buf(buf, len);
+        player_input_requested = false;
+        player_update_provide_input_defer();
         return;
     }
 
-    auto last = player_last_input();
+    struct player_input *last;
+    size_t done = 0;
+    while (1) {
+        last = player_last_input();
+        if (player_crossfade_begin(last))
+            last = player_last_input();
+        if (player_fading) {
+            auto frame = player_frame_size(&player_sink_fmt);
+            auto committed = player_committed + done / frame;
+            done += player_crossfade_read(last, buf + done, len - done, committed);
+            last->pos_samples = prefetch_pos(last->prefetch);
+            if (player_fading || done == len)
+                break;
+            continue;
+        }
+        done += player_input_read(last, &player_resampler, buf + done, len - done);
+        last->pos_samples = prefetch_pos(last->prefetch);
+        if (!player_input_done(last, player_resampler) || last->eof)
+            break;
+        auto end = player_committed + done / player_frame_size(&player_sink_fmt);
+        if (!player_splice_next())
+            break;
+        player_input_set_eof(last, end);
+    }
+    len = done;
+    player_committed += len / player_frame_size(&player_sink_fmt);
+    player_filters_process(buf, len / player_frame_size(&player_sink_fmt));
+    player_commit_buf(buf, len);
 
-    BUG_ON(last->stream->read(last->stream, buf, &len, &last->pos_samples));
-    BUG_ON(player_sink->commit_buf(player_sink, buf, len));
+    player_buffer_fill_ms = prefetch_fill_ms(last->prefetch);
+    player_buffer_size_ms = prefetch_size_ms(last->prefetch);
+
+    if (player_input_nearly_done(last))
+        player_request_next();
 
-    if (len > 0)
-        player_timing_update(false);
-    else
+    if (len > 0) {
+        player_clock_update();
+    } else if (!player_fading && player_input_done(last, player_resampler)) {
         player_input_eof();
+    } else {
+        player_starving = true;
+        player_update_provide_input_defer();
+        return;
+    }
 
     loop_force_iteration(player_loop);
 }
@@ -328,21 +994,94 @@ static void *player_run(void *opaque)
 {
     (void)opaque;
 
+    trace_thread_name("player");
     loop_run(player_loop);
 
     player_sink_load(NULL);
-    player_input_load(NULL, NULL, false);
+    player_drop_next();
+    player_input_load(NULL, true);
+
+    if (player_resampler)
+        resampler_free(player_resampler);
+    free(player_scratch);
+    free(player_fade_scratch);
+    player_filters_close();
+    free(player_filters.ptr);
 
     return NULL;
 }
 
+static void player_init_buffer_ms(void)
+{
+    char *end, *ms = getenv(PLAYER_BUFFER_ENV);
+    if (!ms || *ms == 0)
+        return;
+    unsigned long tmp = strtoul(ms, &end, 10);
+    if (*end == 0)
+        player_buffer_ms = (u32)tmp;
+}
+
+static void player_init_resampling(void)
+{
+    char *end, *rate = getenv(PLAYER_RATE_ENV);
+    if (rate && *rate) {
+        unsigned long tmp = strtoul(rate, &end, 10);
+        if (*end == 0)
+            player_sink_rate = (u32)tmp;
+    }
+
+    auto quality = getenv(PLAYER_QUALITY_ENV);
+    if (!quality)
+        return;
+    if (strcmp(quality, "fast") == 0)
+        player_resample_quality = RESAMPLE_FAST;
+    else if (strcmp(quality, "medium") == 0)
+        player_resample_quality = RESAMPLE_MEDIUM;
+    else if (strcmp(quality, "high") == 0)
+        player_resample_quality = RESAMPLE_HIGH;
+}
+
+static void player_init_crossfade(void)
+{
+    char *end, *ms = getenv(PLAYER_CROSSFADE_ENV);
+    if (!ms || *ms == 0)
+        return;
+    unsigned long tmp = strtoul(ms, &end, 10);
+    if (*end == 0)
+        player_crossfade_ms = (u32)tmp;
+}
+
+static void player_init_replaygain(void)
+{
+    auto mode = getenv(PLAYER_REPLAYGAIN_ENV);
+    if (mode && strcmp(mode, "track") == 0)
+        player_replaygain_mode = PLAYER_REPLAYGAIN_TRACK;
+    else if (mode && strcmp(mode, "album") == 0)
+        player_replaygain_mode = PLAYER_REPLAYGAIN_ALBUM;
+
+    char *end, *preamp = getenv(PLAYER_PREAMP_ENV);
+    if (preamp && *preamp) {
+        float tmp = strtof(preamp, &end);
+        if (*end == 0)
+            player_replaygain_preamp = tmp;
+    }
+
+    auto limit = getenv(PLAYER_LIMIT_ENV);
+    if (limit && strcmp(limit, "0") == 0)
+        player_replaygain_limit = false;
+}
+
 void player_init(void)
 {
-    player_loop = loop_new();
+    player_init_buffer_ms();
+    player_init_resampling();
+    player_init_replaygain();
+    player_init_crossfade();
+    player_loop = loop_new_backend(main_loop_backend);
+    if (main_loop_stats)
+        loop_enable_stats(player_loop);
     player_provide_input_defer = loop_defer_new(player_loop, player_provide_input, NULL);
     loop_defer_set(player_provide_input_defer, false);
-    player_pos_timer = loop_timer_new(player_loop, player_pos_tick, CLOCK_MONOTONIC,
-            NULL);
     player_track_change_timer = loop_timer_new(player_loop, player_track_change_tick,
             CLOCK_MONOTONIC, NULL);
     list_init(&player_inputs);
@@ -367,7 +1106,6 @@ void player_exit(void)
     player_delegate(&d);
     thread_join(player_thread, NULL);
     loop_defer_free(player_provide_input_defer);
-    loop_timer_free(player_pos_timer);
     loop_timer_free(player_track_change_timer);
     loop_free(player_loop);
 }
@@ -398,6 +1136,27 @@ void player_toggle_mute(void)
     player_delegate(&d);
 }
 
+struct player_change_volume {
+    struct delegate d;
+    i32 diff;
+};
+
+static void player_change_volume_delegate(struct delegate *d)
+{
+    auto_free auto op = container_of(d, struct player_change_volume, d);
+    auto volume = (i64)player_volume + op->diff;
+    player_volume = (u32)max(min(volume, (i64)100), (i64)0);
+    diag_info(main_diag, "software volume: %"PRIu32"%%", player_volume);
+}
+
+void player_change_volume(i32 diff)
+{
+    auto d = xnew0(struct player_change_volume);
+    d->d.run = player_change_volume_delegate;
+    d->diff = diff;
+    player_delegate(&d->d);
+}
+
 struct player_seek {
     struct delegate d;
     i64 diff;
@@ -411,25 +1170,31 @@ static void player_seek_delegate(struct delegate *d)
     if (!first)
         return;
 
-    u32 latency = 0;
-    if (player_sink) {
-        latency = player_sink->latency(player_sink);
-    }
+    // The seek is relative to the frame that is being played, not to the frame that
+    // was read last.
+    player_update_played();
+    auto rate = first->stream->fmt.sample_rate;
+    auto target = (i64)player_first_position(first) + seek->diff * (i64)rate / 1000;
+    target = max(target, (i64)0);
 
-    bool eof;
-    first->stream->seek(first->stream, seek->diff - (i64)latency, &first->pos_samples,
-            &eof);
+    bool eof = false;
+    if (prefetch_seek(first->prefetch, target - (i64)first->pos_samples, &eof)) {
+        diag_err(main_diag, "unable to seek");
+        return;
+    }
+    first->pos_samples = prefetch_pos(first->prefetch);
 
     if (eof) {
         player_input_free(first);
         first = player_first_input();
         if (first) {
-            first->stream->seek_abs(first->stream, 0, &first->pos_samples);
+            prefetch_seek_abs(first->prefetch, 0);
+            first->pos_samples = prefetch_pos(first->prefetch);
         }
     }
 
     if (player_sink) {
-        player_sink->flush(player_sink, first ? &first->stream->fmt : NULL);
+        player_sink_flush(first ? &first->stream->fmt : NULL);
     }
 
     if (!first) {
@@ -438,6 +1203,20 @@ static void player_seek_delegate(struct delegate *d)
     }
 
     list_remove(&first->node);
+
+    // The input following the seeked one becomes the prepared next track again.
+    auto second = player_first_input();
+    if (second) {
+        player_drop_next();
+        list_remove(&second->node);
+        list_init(&second->node);
+        second->eof = false;
+        prefetch_seek_abs(second->prefetch, 0);
+        second->pos_samples = prefetch_pos(second->prefetch);
+        player_next = second;
+        player_next_ready = true;
+    }
+
     struct list *node, *n;
     list_for_each_safe(node, n, &player_inputs) {
         auto input = player_node_to_input(node);
@@ -446,14 +1225,17 @@ static void player_seek_delegate(struct delegate *d)
     list_append(&player_inputs, &first->node);
 
     first->eof = false;
-    player_pause_track_change_timer();
+    player_update_track_change_timer();
 
-    player_timing_update(true);
+    player_starving = false;
+    player_update_provide_input_defer();
+
+    player_clock_update();
 }
 
 void player_seek(i64 diff)
 {
-    auto seek = xnew_uninit(struct player_seek);
+    auto seek = xnew0(struct player_seek);
     seek->d.run = player_seek_delegate;
     seek->diff = diff;
     player_delegate(&seek->d);
@@ -472,12 +1254,61 @@ static void player_set_sink_delegate(struct delegate *d)
 
 void player_set_sink(struct sink *sink)
 {
-    auto d = xnew_uninit(struct player_set_sink);
+    auto d = xnew0(struct player_set_sink);
     d->d.run = player_set_sink_delegate;
     d->sink = sink;
     player_delegate(&d->d);
 }
 
+struct player_add_filter {
+    struct delegate d;
+    struct filter *filter;
+};
+
+static void player_add_filter_delegate(struct delegate *d)
+{
+    auto_free auto op = container_of(d, struct player_add_filter, d);
+    player_filter_vector_push(&player_filters, (struct player_filter){ op->filter });
+    if (player_have_sink_fmt)
+        player_filter_open(&player_filters.ptr[player_filters.len - 1]);
+}
+
+void player_add_filter(struct filter *filter)
+{
+    auto d = xnew0(struct player_add_filter);
+    d->d.run = player_add_filter_delegate;
+    d->filter = filter;
+    player_delegate(&d->d);
+}
+
+static void player_print_filter_stats_delegate(struct delegate *d)
+{
+    (void)d;
+    for (size_t i = 0; i < player_filters.len; i++) {
+        auto f = &player_filters.ptr[i];
+        auto ns_per_frame = f->frames ? (double)f->ns / f->frames : 0;
+        diag_info(main_diag, "filter %s: %"PRIu64" frames, %"PRIu64" us, %.2f ns/frame%s",
+                f->filter->name, f->frames, f->ns / 1000, ns_per_frame,
+                f->instance ? "" : " (inactive)");
+    }
+}
+
+void player_print_filter_stats(void)
+{
+    static struct delegate d = { player_print_filter_stats_delegate };
+    player_delegate(&d);
+}
+
+void player_get_delegate_stats(struct delegator_stats *s)
+{
+    loop_get_delegate_stats(player_loop, s);
+}
+
+void player_dump_loop_stats(FILE *file)
+{
+    loop_dump_stats(player_loop, "player", file);
+}
+
 struct player_set_input {
     struct delegate d;
     struct decoder_stream *s;
@@ -487,28 +1318,70 @@ struct player_set_input {
 static void player_set_input_delegate(struct delegate *d)
 {
     auto_free auto input = container_of(d, struct player_set_input, d);
-    player_input_load(input->s, input->c, true);
+    player_drop_next();
+    player_input_load(input->s ? player_input_new(input->s, input->c) : NULL, true);
 }
 
 void player_set_input(struct decoder_stream *s, struct main_track_cookie *c)
 {
-    auto d = xnew_uninit(struct player_set_input);
+    auto d = xnew0(struct player_set_input);
     d->d.run = player_set_input_delegate;
     d->s = s;
     d->c = c;
     player_delegate(&d->d);
 }
 
+struct player_next_track {
+    struct delegate d;
+    u64 id;
+    struct decoder_stream *s;
+    struct main_track_cookie *c;
+};
+
+static void player_next_track_delegate(struct delegate *d)
+{
+    auto_free auto next = container_of(d, struct player_next_track, d);
+
+    if (next->id != player_next_id || !player_next_requested) {
+        if (next->s)
+            next->s->close(next->s);
+        return;
+    }
+
+    player_next_requested = false;
+    player_next_ready = true;
+    player_next = next->s ? player_input_new(next->s, next->c) : NULL;
+
+    if (player_next_wanted) {
+        auto flush = player_next_flush;
+        player_next_wanted = false;
+        player_next_flush = false;
+        player_goto_next_(flush);
+    }
+}
+
+void player_set_next_track(u64 id, struct decoder_stream *s, struct main_track_cookie *c)
+{
+    auto d = xnew0(struct player_next_track);
+    d->d.run = player_next_track_delegate;
+    d->id = id;
+    d->s = s;
+    d->c = c;
+    player_delegate(&d->d);
+}
+
 static void player_goto_next_delegate(struct delegate *d)
 {
-    (void)d;
+    free(d);
     player_goto_next_(true);
 }
 
+// Every call skips a track, so the calls must not be coalesced.
 void player_goto_next(void)
 {
-    static struct delegate d = { player_goto_next_delegate };
-    player_delegate(&d);
+    auto d = xnew0(struct delegate);
+    d->run = player_goto_next_delegate;
+    player_delegate(d);
 }
 
 static void player_stop_delegate(struct delegate *d)
@@ -527,7 +1400,8 @@ static int player_sink_request_input(struct sink *sink, bool request)
 {
     BUG_ON(player_sink != sink);
 
-    loop_defer_set(player_provide_input_defer, request);
+    player_input_requested = request;
+    player_update_provide_input_defer();
     if (request) {
         loop_force_iteration(player_loop);
     }
@@ -542,12 +1416,9 @@ static int player_sink_info_changed(struct sink *sink, struct sink_info *i)
     player_paused = i->paused;
     player_mute = i->mute;
 
-    if (player_paused)
-        player_pause_track_change_timer();
-    else
-        player_start_track_change_timer();
+    player_check_track_change();
 
-    player_timing_update(false);
+    player_clock_update();
 
     main_sink_info_changed(i);
     return 0;
@@ -566,6 +1437,12 @@ static struct sink_ops player_sink_ops = {
     .failed = player_sink_failed,
 };
 
+void player_get_buffer_fill(u32 *fill_ms, u32 *size_ms)
+{
+    *fill_ms = player_buffer_fill_ms;
+    *size_ms = player_buffer_size_ms;
+}
+
 void player_get_sink_ops(const struct sink_ops **ops, struct loop **loop)
 {
     *ops = &player_sink_ops;
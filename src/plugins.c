@@ -3,23 +3,29 @@
 #include <dirent.h>
 #include <dlfcn.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 #include "utils/utils.h"
 #include "utils/xmalloc.h"
 #include "utils/diag.h"
 #include "utils/vec.h"
+#include "utils/cache.h"
 
 #include "globals.h"
 #include "plugins.h"
 #include "plugin.h"
 #include "player.h"
+#include "metacache.h"
 
 #define PLUGIN_ENV "OKA_PLUGIN_DIR"
+#define SINK_ENV "OKA_SINK"
 
 UTILS_VECTOR(plugin, struct plugin *)
 UTILS_VECTOR(sink, struct sink *)
 UTILS_VECTOR(decoder, struct decoder *)
+UTILS_VECTOR(filter, struct filter *)
 
 struct plugin {
     const struct plugin_api *api;
@@ -30,6 +36,7 @@ static char *plugins_dir;
 static struct plugin_vector plugins;
 static struct decoder_vector plugins_decoders;
 static struct sink_vector plugins_sinks;
+static struct filter_vector plugins_filters;
 static struct sink *plugins_current_sink;
 
 static int plugins_add_sink(struct sink *sink, const struct sink_ops **ops,
@@ -61,9 +68,23 @@ static int plugins_add_decoder(struct decoder *decoder)
     return 0;
 }
 
+static int plugins_add_filter(struct filter *filter)
+{
+    for (size_t i = 0; i < plugins_filters.len; i++) {
+        auto f = plugins_filters.ptr[i];
+        if (strcmp(f->name, filter->name) == 0)
+            return -1;
+    }
+
+    filter_vector_push(&plugins_filters, filter);
+
+    return 0;
+}
+
 static const struct plugin_ops plugin_ops = {
     .add_sink = plugins_add_sink,
     .add_decoder = plugins_add_decoder,
+    .add_filter = plugins_add_filter,
 };
 
 static void plugins_load_one(const char *name)
@@ -113,15 +134,42 @@ static void plugins_dir_init(void)
     plugins_dir = strdup(dir);
 }
 
+// Uses the sink named by OKA_SINK. Otherwise the null sink is only used if there is no
+// other sink.
+static struct sink *plugins_select_sink(void)
+{
+    auto name = getenv(SINK_ENV);
+    struct sink *fallback = NULL;
+    for (size_t i = 0; i < plugins_sinks.len; i++) {
+        auto sink = plugins_sinks.ptr[i];
+        if (name) {
+            if (strcmp(sink->name, name) == 0)
+                return sink;
+        } else if (strcmp(sink->name, "null") != 0) {
+            return sink;
+        } else if (!fallback) {
+            fallback = sink;
+        }
+    }
+    if (name)
+        diag_err(main_diag, SINK_ENV ": there is no sink named %s", name);
+    return fallback;
+}
+
 void plugins_init(void)
 {
     plugins_dir_init();
     plugins_load();
+}
 
-    if (plugins_sinks.len > 0) {
-        plugins_current_sink = plugins_sinks.ptr[0];
+void plugins_start_player(void)
+{
+    for (size_t i = 0; i < plugins_filters.len; i++)
+        player_add_filter(plugins_filters.ptr[i]);
+
+    plugins_current_sink = plugins_select_sink();
+    if (plugins_current_sink)
         player_set_sink(plugins_current_sink);
-    }
 }
 
 static void plugin_free(struct plugin *p)
@@ -149,23 +197,86 @@ void plugins_exit(void)
     }
     free(plugins_sinks.ptr);
 
+    for (size_t i = 0; i < plugins_filters.len; i++) {
+        auto filter = plugins_filters.ptr[i];
+        filter->free(filter);
+    }
+    free(plugins_filters.ptr);
+
     for (size_t i = 0; i < plugins.len; i++)
         plugin_free(plugins.ptr[i]);
     free(plugins.ptr);
 }
 
-struct decoder_stream *plugins_open(const char *path)
+void plugins_get_filters(struct filter ***filters, size_t *num)
 {
-    auto decoder = plugins_decoders.ptr[0];
-    char *metadata[METADATA_NUM_TAGS] = { 0 };
-    decoder->metadata(decoder, path, metadata);
-    for (size_t i = 0; i < METADATA_NUM_TAGS; i++) {
-        if (metadata[i]) {
-            diag_info(main_diag, "%zu: %s", i, metadata[i]);
-            free(metadata[i]);
+    *filters = plugins_filters.ptr;
+    *num = plugins_filters.len;
+}
+
+struct decoder *plugins_find_decoder(const char *path)
+{
+    auto ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/'))
+        return NULL;
+    ext++;
+
+    for (size_t i = 0; i < plugins_decoders.len; i++) {
+        auto d = plugins_decoders.ptr[i];
+        for (auto e = d->extensions; e && *e; e++) {
+            if (strcasecmp(*e, ext) == 0)
+                return d;
         }
     }
-    return decoder->open(decoder, path, &plugins_current_sink->range);
+    return NULL;
+}
+
+struct metadata *plugins_read_metadata(struct decoder *decoder, const char *path)
+{
+    char *tags[METADATA_NUM_TAGS] = { 0 };
+    decoder->metadata(decoder, path, tags);
+    auto md = metadata_new(tags);
+    for (size_t i = 0; i < METADATA_NUM_TAGS; i++)
+        free(tags[i]);
+    return md;
+}
+
+// A cache hit costs a stat and a hash lookup. Misses are added to the cache.
+static struct metadata *plugins_metadata(struct decoder *decoder, const char *path)
+{
+    struct cache_key key;
+    auto have_key = cache_key_get(path, &key) == 0;
+    if (have_key) {
+        auto md = metacache_get(path, &key);
+        if (md)
+            return md;
+    }
+
+    auto md = plugins_read_metadata(decoder, path);
+    if (have_key)
+        metacache_put(path, &key, md);
+    return md;
+}
+
+struct decoder_stream *plugins_open(const char *path)
+{
+    if (plugins_decoders.len == 0)
+        return NULL;
+
+    auto decoder = plugins_find_decoder(path);
+    if (!decoder)
+        decoder = plugins_decoders.ptr[0];
+    auto md = plugins_metadata(decoder, path);
+    struct gain_replaygain rg;
+    gain_replaygain_parse(&rg, md);
+    for (auto p = md->pairs; p->key != METADATA_INVALID; p++)
+        diag_info(main_diag, "%d: %s", p->key, p->val);
+    metadata_unref(md);
+    // The player converts to the sink format, so let the decoder use its native one.
+    auto s = decoder->open(decoder, path, NULL);
+    if (s)
+        s->replaygain = rg;
+    return s;
 }
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
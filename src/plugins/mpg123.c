@@ -1,24 +1,57 @@
 #include <mpg123.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "utils/utils.h"
 #include "utils/xmalloc.h"
 #include "utils/thread.h"
 #include "utils/id3.h"
 #include "utils/diag.h"
+#include "utils/cache.h"
+#include "utils/signals.h"
 
 #include "plugin.h"
 
 #define auto_delete __attribute__((cleanup(ip_mpg123_deletep))) mpg123_handle *
 
+// Without an accurate TOC mpg123 has to scan VBR files to seek. A full frame index is
+// therefore built in the background on the first open and stored in the cache.
+#define IP_INDEX_CACHE_DIR "mpg123-index"
+#define IP_INDEX_MAGIC "OKAMPI1"
+// Negative values let the index grow in steps of this many entries with one entry per
+// frame.
+#define IP_INDEX_SIZE -1000
+
 static pthread_once_t ip_init_once = PTHREAD_ONCE_INIT;
 static bool ip_inited;
 static struct diag *ip_diag;
 
+// Payload of an index cache entry.
+struct ip_index_data {
+    u64 length; // in samples
+    i64 step;
+    u64 fill;
+    i64 offsets[];
+};
+
+struct ip_index_build {
+    pthread_t thread;
+    char *path;
+    struct cache_key key;
+    _Atomic bool cancel;
+    _Atomic bool done;
+    off_t *offsets;
+    off_t step;
+    size_t fill;
+};
+
 struct ip_stream {
     struct decoder_stream d;
     mpg123_handle *h;
+    // Index being built for this stream, NULL once installed.
+    struct ip_index_build *build;
 };
 
 static void ip_mpg123_deletep(mpg123_handle **p)
@@ -32,9 +65,117 @@ static struct ip_stream *ip_to_stream(struct decoder_stream *d)
     return container_of(d, struct ip_stream, d);
 }
 
+static void ip_index_store(struct ip_index_build *b, mpg123_handle *h)
+{
+    off_t *offsets;
+    off_t step;
+    size_t fill;
+    if (mpg123_index(h, &offsets, &step, &fill) != MPG123_OK || fill == 0)
+        return;
+
+    b->offsets = xnew_array(off_t, fill);
+    memcpy(b->offsets, offsets, sizeof(off_t) * fill);
+    b->step = step;
+    b->fill = fill;
+
+    auto size = sizeof(struct ip_index_data) + sizeof(i64) * fill;
+    auto_free struct ip_index_data *data = (void *)xnew_array(u8, size);
+    auto length = mpg123_length(h);
+    data->length = length > 0 ? (u64)length : 0;
+    data->step = step;
+    data->fill = fill;
+    for (size_t i = 0; i < fill; i++)
+        data->offsets[i] = offsets[i];
+    if (cache_store(IP_INDEX_CACHE_DIR, IP_INDEX_MAGIC, b->path, &b->key, data, size))
+        diag_info(ip_diag, "mpg123: could not store the index of %s", b->path);
+}
+
+// Parses all frames of the file with a separate handle. Parsing does not decode, and
+// mpg123 records the position of every frame it parses in its index.
+static void *ip_index_run(void *opaque)
+{
+    struct ip_index_build *b = opaque;
+
+    auto_delete h = mpg123_new(NULL, NULL);
+    if (h && mpg123_param(h, MPG123_INDEX_SIZE, IP_INDEX_SIZE, 0) == MPG123_OK &&
+            mpg123_open(h, b->path) == MPG123_OK) {
+        int rc;
+        do {
+            rc = mpg123_framebyframe_next(h);
+        } while ((rc == MPG123_OK || rc == MPG123_NEW_FORMAT) &&
+                !atomic_load_explicit(&b->cancel, memory_order_relaxed));
+        if (rc == MPG123_DONE)
+            ip_index_store(b, h);
+        mpg123_close(h);
+    }
+
+    atomic_store_explicit(&b->done, true, memory_order_release);
+    return NULL;
+}
+
+static void ip_index_build_free(struct ip_index_build *b)
+{
+    atomic_store_explicit(&b->cancel, true, memory_order_relaxed);
+    thread_join(b->thread, NULL);
+    free(b->offsets);
+    free(b->path);
+    free(b);
+}
+
+static struct ip_index_build *ip_index_build_start(const char *path,
+        const struct cache_key *key)
+{
+    auto b = xnew0(struct ip_index_build);
+    b->path = xstrdup(path);
+    b->key = *key;
+    auto_restore sigs = signals_block_all();
+    thread_create(&b->thread, NULL, ip_index_run, b);
+    return b;
+}
+
+// The index can only be handed to the handle on the thread that uses it.
+static void ip_index_install(struct ip_stream *s)
+{
+    auto b = s->build;
+    if (!b || !atomic_load_explicit(&b->done, memory_order_acquire))
+        return;
+    if (b->offsets)
+        mpg123_set_index(s->h, b->offsets, b->step, b->fill);
+    ip_index_build_free(move(s->build));
+}
+
+static bool ip_index_load(mpg123_handle *h, const char *path,
+        const struct cache_key *key, u64 *length)
+{
+    struct cache_entry e;
+    if (cache_load(IP_INDEX_CACHE_DIR, IP_INDEX_MAGIC, path, key, &e))
+        return false;
+
+    const struct ip_index_data *data = e.data;
+    auto ok = e.len >= sizeof(*data) &&
+        (e.len - sizeof(*data)) / sizeof(i64) >= data->fill;
+    if (ok) {
+        // mpg123 copies the index, so the mapping can be used directly.
+        auto_free off_t *copy = NULL;
+        auto offsets = (off_t *)data->offsets;
+        if (sizeof(off_t) != sizeof(i64)) {
+            copy = xnew_array(off_t, data->fill);
+            for (size_t i = 0; i < data->fill; i++)
+                copy[i] = (off_t)data->offsets[i];
+            offsets = copy;
+        }
+        ok = mpg123_set_index(h, offsets, (off_t)data->step, data->fill) == MPG123_OK;
+        *length = data->length;
+    }
+    cache_entry_free(&e);
+    return ok;
+}
+
 static void ip_close(struct decoder_stream *d)
 {
     auto_free auto s = ip_to_stream(d);
+    if (s->build)
+        ip_index_build_free(s->build);
     mpg123_close(s->h);
     mpg123_delete(s->h);
 }
@@ -44,6 +185,8 @@ static int ip_read(struct decoder_stream *d, u8 *buf, size_t *len, u64 *pos)
     auto s = ip_to_stream(d);
     size_t tlen = 0;
 
+    ip_index_install(s);
+
     *pos = (u64)mpg123_tell(s->h);
 
     do {
@@ -64,7 +207,12 @@ static int ip_seek(struct decoder_stream *d, i64 diff, u64 *pos, bool *eof)
 {
     auto s = ip_to_stream(d);
 
-    *pos = (u64)mpg123_seek(s->h, (diff * 44100) / 1000, SEEK_CUR);
+    ip_index_install(s);
+    // With gapless decoding mpg123 seeks sample-accurately.
+    auto off = mpg123_seek(s->h, (off_t)diff, SEEK_CUR);
+    if (off < 0)
+        return -1;
+    *pos = (u64)off;
     *eof = mpg123_read(s->h, NULL, 0, NULL) == MPG123_DONE;
     return 0;
 }
@@ -73,7 +221,11 @@ static int ip_seek_abs(struct decoder_stream *d, u64 pos, u64 *opos)
 {
     auto s = ip_to_stream(d);
 
-    *opos = (u64)mpg123_seek(s->h, (pos * 44100) / 1000, SEEK_SET);
+    ip_index_install(s);
+    auto off = mpg123_seek(s->h, (off_t)pos, SEEK_SET);
+    if (off < 0)
+        return -1;
+    *opos = (u64)off;
     return 0;
 }
 
@@ -189,6 +341,8 @@ static struct decoder_stream *ip_open(struct decoder *d, const char *path,
     auto_delete h = mpg123_new(NULL, NULL);
     if (!h)
         return NULL;
+    if (mpg123_param(h, MPG123_INDEX_SIZE, IP_INDEX_SIZE, 0) != MPG123_OK)
+        return NULL;
     if (mpg123_open(h, path) != MPG123_OK)
         return NULL;
     if (ip_set_range(h, range))
@@ -199,6 +353,15 @@ static struct decoder_stream *ip_open(struct decoder *d, const char *path,
     if (ip_fix_format(h, &format))
         return NULL;
 
+    auto length = mpg123_length(h);
+
+    struct cache_key key;
+    bool have_key = cache_key_get(path, &key) == 0;
+    u64 cached_length = 0;
+    bool indexed = have_key && ip_index_load(h, path, &key, &cached_length);
+    if (cached_length > 0)
+        length = (off_t)cached_length;
+
     auto s = xnew_uninit(struct ip_stream);
     s->h = move(h);
     s->d.close = ip_close;
@@ -206,32 +369,20 @@ static struct decoder_stream *ip_open(struct decoder *d, const char *path,
     s->d.seek_abs = ip_seek_abs;
     s->d.read = ip_read;
     s->d.fmt = format;
+    s->d.length = length > 0 ? (u64)length : 0;
+    s->build = have_key && !indexed ? ip_index_build_start(path, &key) : NULL;
 
     return &s->d;
 }
 
+static const char *const ip_extensions[] = { "mp3", "mp2", "mp1", NULL };
+
 static int ip_metadata(struct decoder *d, const char *path,
         char *metadata[static METADATA_NUM_TAGS])
 {
     (void)d;
 
-    thread_once(&ip_init_once, ip_init);
-
-    auto_delete h = mpg123_new(NULL, NULL);
-    if (!h)
-        return -1;
-    if (mpg123_open(h, path) != MPG123_OK)
-        return -1;
-    mpg123_scan(h);
-    mpg123_id3v2 *v2;
-    mpg123_id3(h, NULL, &v2);
-    for (size_t i = 0; i < v2->texts; i++) {
-        auto text = &v2->text[i];
-        if (text->text.size == 0)
-            continue;
-        id3_metadata(text->id, text->text.p, metadata);
-    }
-    return 0;
+    return id3_read(path, metadata);
 }
 
 static int plugin_init(const struct plugin_ops *ops, struct diag *diag)
@@ -240,6 +391,7 @@ static int plugin_init(const struct plugin_ops *ops, struct diag *diag)
 
     auto decoder = xnew_uninit(struct decoder);
     decoder->name = "mpg123";
+    decoder->extensions = ip_extensions;
     decoder->free = ip_free;
     decoder->open = ip_open;
     decoder->metadata = ip_metadata;
@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "utils/utils.h"
+#include "utils/xmalloc.h"
+#include "utils/diag.h"
+#include "utils/loop.h"
+
+#include "plugin.h"
+
+// A sink that discards all samples. By default it consumes them as fast as the player
+// produces them so that the throughput of the pipeline can be measured without a sound
+// server. With OKA_NULL_REALTIME=1 it consumes them at the sample rate like a device.
+
+#define NULL_REALTIME_ENV "OKA_NULL_REALTIME"
+#define NULL_BUFFER_FRAMES 65536
+#define NULL_REALTIME_BUFFER_MS 200
+#define NULL_REPORT_MS 1000
+#define NULL_NS_PER_SEC (1000 * 1000 * 1000ull)
+
+struct null_stats {
+    u64 frames;
+    u64 busy_ns;
+    u64 buffers;
+};
+
+struct null_sink {
+    struct sink sink;
+    const struct sink_ops *ops;
+    struct loop *loop;
+    struct diag *diag;
+    bool realtime;
+    bool enabled;
+
+    // Callbacks into the player are never made from within a sink function.
+    struct loop_defer *notify;
+    struct loop_timer *wakeup;
+    struct loop_timer *report;
+    bool requested;
+    bool request_dirty;
+    bool info_dirty;
+
+    struct audio_format fmt;
+    bool have_fmt;
+    bool draining;
+    bool stopped;
+    bool paused;
+    bool mute;
+    u8 *buf;
+    size_t buf_frames;
+
+    // In realtime mode the device has played (now - start_ns) * rate frames but never
+    // more than it has been given. start_ns is moved forward on underruns and pauses.
+    u64 written;
+    u64 start_ns;
+    u64 paused_played;
+
+    u64 provide_ns;
+    struct null_stats total;
+    struct null_stats interval;
+    u64 interval_start_ns;
+};
+
+static struct null_sink *null_from_sink(struct sink *sink)
+{
+    return container_of(sink, struct null_sink, sink);
+}
+
+static size_t null_frame_size(struct null_sink *s)
+{
+    return audio_bytes_per_sample(s->fmt.sample_fmt) * s->fmt.channels;
+}
+
+static u64 null_clock(struct null_sink *s)
+{
+    if (s->paused)
+        return s->paused_played;
+    auto elapsed = utils_get_mono_time_ns() - s->start_ns;
+    return elapsed * s->fmt.sample_rate / NULL_NS_PER_SEC;
+}
+
+static void null_set_clock(struct null_sink *s, u64 played)
+{
+    auto ns = played * NULL_NS_PER_SEC / s->fmt.sample_rate;
+    s->start_ns = utils_get_mono_time_ns() - ns;
+}
+
+static u64 null_played(struct null_sink *s)
+{
+    if (!s->realtime || !s->fmt.sample_rate)
+        return s->written;
+    return min(null_clock(s), s->written);
+}
+
+static u64 null_buffered(struct null_sink *s)
+{
+    return s->written - null_played(s);
+}
+
+static void null_notify(struct null_sink *s)
+{
+    if (s->enabled)
+        loop_defer_set(s->notify, true);
+}
+
+static void null_request(struct null_sink *s, bool request)
+{
+    if (s->requested == request)
+        return;
+    s->requested = request;
+    s->request_dirty = true;
+    null_notify(s);
+}
+
+static void null_info_changed(struct null_sink *s)
+{
+    s->info_dirty = true;
+    null_notify(s);
+}
+
+static void null_arm_wakeup(struct null_sink *s, u64 frames)
+{
+    auto ns = max(frames * NULL_NS_PER_SEC / s->fmt.sample_rate, (u64)1);
+    struct itimerspec timer = {
+        .it_value = {
+            .tv_sec = (time_t)(ns / NULL_NS_PER_SEC),
+            .tv_nsec = (long)(ns % NULL_NS_PER_SEC),
+        },
+    };
+    loop_timer_set(s->wakeup, &timer, false);
+}
+
+// Requests input if there is room in the buffer, otherwise waits until a quarter of the
+// buffer has been played. A draining stream stops once everything has been played.
+static void null_update(struct null_sink *s)
+{
+    if (!s->enabled)
+        return;
+
+    loop_timer_disable(s->wakeup);
+
+    if (s->draining) {
+        null_request(s, false);
+        auto buffered = null_buffered(s);
+        if (buffered == 0) {
+            s->draining = false;
+            s->stopped = true;
+            null_info_changed(s);
+        } else if (!s->paused) {
+            null_arm_wakeup(s, buffered);
+        }
+        return;
+    }
+
+    if (!s->have_fmt || s->paused) {
+        null_request(s, false);
+        return;
+    }
+
+    auto buffered = null_buffered(s);
+    if (buffered < s->buf_frames) {
+        null_request(s, true);
+    } else {
+        null_request(s, false);
+        null_arm_wakeup(s, buffered - s->buf_frames * 3 / 4);
+    }
+}
+
+static void null_notify_cb(struct loop_defer *d, void *opaque)
+{
+    struct null_sink *s = opaque;
+
+    loop_defer_set(d, false);
+
+    if (s->request_dirty) {
+        s->request_dirty = false;
+        s->ops->request_input(&s->sink, s->requested);
+    }
+    if (s->info_dirty) {
+        s->info_dirty = false;
+        struct sink_info i = {
+            .stopped = s->stopped,
+            .paused = s->paused,
+            .mute = s->mute,
+            .vol_l = 100,
+            .vol_r = 100,
+        };
+        s->ops->info_changed(&s->sink, &i);
+    }
+}
+
+static void null_wakeup_cb(struct loop_timer *t, void *opaque)
+{
+    (void)t;
+    null_update(opaque);
+}
+
+static void null_print_stats(struct null_sink *s, const char *what,
+        const struct null_stats *st, u64 ns)
+{
+    if (ns == 0)
+        return;
+    auto secs = (double)ns / NULL_NS_PER_SEC;
+    diag_info(s->diag, "null: %s: %.0f frames/s, %.1f%% busy providing input,"
+            " %.1f us per buffer", what, st->frames / secs,
+            100.0 * st->busy_ns / ns,
+            st->buffers ? st->busy_ns / 1000.0 / st->buffers : 0);
+}
+
+static void null_report_cb(struct loop_timer *t, void *opaque)
+{
+    (void)t;
+    struct null_sink *s = opaque;
+
+    auto now = utils_get_mono_time_ns();
+    if (s->interval.buffers)
+        null_print_stats(s, "last interval", &s->interval, now - s->interval_start_ns);
+    s->interval = (struct null_stats){ 0 };
+    s->interval_start_ns = now;
+}
+
+static void null_new_stream(struct null_sink *s, const struct audio_format *fmt)
+{
+    s->written = 0;
+    s->paused_played = 0;
+    s->draining = false;
+    s->have_fmt = fmt != NULL;
+    if (!fmt)
+        return;
+
+    s->fmt = *fmt;
+    null_set_clock(s, 0);
+    s->buf_frames = NULL_BUFFER_FRAMES;
+    if (s->realtime)
+        s->buf_frames = max((u64)fmt->sample_rate * NULL_REALTIME_BUFFER_MS / 1000,
+                (u64)1);
+    free(s->buf);
+    s->buf = xnew_array(u8, s->buf_frames * null_frame_size(s));
+    if (s->stopped) {
+        s->stopped = false;
+        null_info_changed(s);
+    }
+}
+
+static int null_sink_enable(struct sink *sink)
+{
+    auto s = null_from_sink(sink);
+
+    s->notify = loop_defer_new(s->loop, null_notify_cb, s);
+    loop_defer_set(s->notify, false);
+    s->wakeup = loop_timer_new(s->loop, null_wakeup_cb, CLOCK_MONOTONIC, s);
+    s->report = loop_timer_new(s->loop, null_report_cb, CLOCK_MONOTONIC, s);
+    struct itimerspec timer = {
+        .it_interval = { .tv_sec = NULL_REPORT_MS / 1000 },
+        .it_value = { .tv_sec = NULL_REPORT_MS / 1000 },
+    };
+    loop_timer_set(s->report, &timer, false);
+    s->interval_start_ns = utils_get_mono_time_ns();
+    s->enabled = true;
+    s->requested = false;
+    s->stopped = true;
+    null_info_changed(s);
+    null_update(s);
+    return 0;
+}
+
+static int null_sink_disable(struct sink *sink)
+{
+    auto s = null_from_sink(sink);
+
+    if (!s->enabled)
+        return 0;
+    s->enabled = false;
+    loop_defer_free(s->notify);
+    loop_timer_free(s->wakeup);
+    loop_timer_free(s->report);
+    s->have_fmt = false;
+    s->draining = false;
+    return 0;
+}
+
+static int null_sink_free(struct sink *sink)
+{
+    auto s = null_from_sink(sink);
+
+    null_sink_disable(sink);
+    if (s->total.buffers) {
+        diag_info(s->diag, "null: total: %"PRIu64" frames in %"PRIu64" buffers",
+                s->total.frames, s->total.buffers);
+    }
+    free(s->buf);
+    free(s);
+    return 0;
+}
+
+static int null_sink_set_format(struct sink *sink, const struct audio_format *fmt)
+{
+    auto s = null_from_sink(sink);
+
+    if (!fmt) {
+        if (s->have_fmt) {
+            s->have_fmt = false;
+            s->draining = true;
+        }
+    } else if (!s->have_fmt || !audio_formats_eq(fmt, &s->fmt)) {
+        // A draining stream with the same format simply continues.
+        if (s->draining && audio_formats_eq(fmt, &s->fmt)) {
+            s->draining = false;
+            s->have_fmt = true;
+        } else {
+            null_new_stream(s, fmt);
+        }
+    }
+    null_update(s);
+    return 0;
+}
+
+static int null_sink_flush(struct sink *sink, const struct audio_format *fmt)
+{
+    auto s = null_from_sink(sink);
+
+    null_new_stream(s, fmt);
+    if (!fmt && !s->stopped) {
+        s->stopped = true;
+        null_info_changed(s);
+    }
+    null_update(s);
+    return 0;
+}
+
+static int null_sink_pause(struct sink *sink, bool pause)
+{
+    auto s = null_from_sink(sink);
+
+    if (s->paused == pause)
+        return 0;
+    if (s->have_fmt || s->draining) {
+        if (pause)
+            s->paused_played = null_played(s);
+        else
+            null_set_clock(s, s->paused_played);
+    }
+    s->paused = pause;
+    null_info_changed(s);
+    null_update(s);
+    return 0;
+}
+
+static int null_sink_mute(struct sink *sink, bool mute)
+{
+    auto s = null_from_sink(sink);
+
+    s->mute = mute;
+    null_info_changed(s);
+    return 0;
+}
+
+static int null_sink_provide_buf(struct sink *sink, u8 **buf, size_t *len)
+{
+    auto s = null_from_sink(sink);
+
+    s->provide_ns = utils_get_mono_time_ns();
+    *buf = s->buf;
+    *len = 0;
+    if (!s->have_fmt || s->paused)
+        return 0;
+
+    auto frames = s->buf_frames;
+    if (s->realtime)
+        frames -= min(null_buffered(s), frames);
+    *len = frames * null_frame_size(s);
+    return 0;
+}
+
+static int null_sink_commit_buf(struct sink *sink, u8 *buf, size_t len)
+{
+    auto s = null_from_sink(sink);
+    (void)buf;
+
+    auto busy = utils_get_mono_time_ns() - s->provide_ns;
+    s->total.busy_ns += busy;
+    s->interval.busy_ns += busy;
+    if (len == 0)
+        return 0;
+
+    auto frames = len / null_frame_size(s);
+    s->total.frames += frames;
+    s->total.buffers++;
+    s->interval.frames += frames;
+    s->interval.buffers++;
+
+    // After an underrun the device continues with the new frames.
+    if (s->realtime && !s->paused && null_clock(s) > s->written)
+        null_set_clock(s, s->written);
+    s->written += frames;
+    null_update(s);
+    return 0;
+}
+
+static u32 null_sink_latency(struct sink *sink)
+{
+    auto s = null_from_sink(sink);
+
+    if (!s->fmt.sample_rate)
+        return 0;
+    return (u32)(null_buffered(s) * 1000 / s->fmt.sample_rate);
+}
+
+static u64 null_sink_played(struct sink *sink)
+{
+    return null_played(null_from_sink(sink));
+}
+
+static const struct sink null_sink_template = {
+    .name = "null",
+
+    .range = (struct audio_format_range) {
+        .sample_fmts = AUDIO_FORMAT(24) - 1,
+        .min_sample_rate = 1,
+        .max_sample_rate = 768000,
+        .min_channels = 1,
+        .max_channels = 32,
+    },
+
+    .enable = null_sink_enable,
+    .disable = null_sink_disable,
+    .free = null_sink_free,
+
+    .set_format = null_sink_set_format,
+    .pause = null_sink_pause,
+    .mute = null_sink_mute,
+
+    .provide_buf = null_sink_provide_buf,
+    .commit_buf = null_sink_commit_buf,
+    .flush = null_sink_flush,
+    .latency = null_sink_latency,
+    .played = null_sink_played,
+};
+
+static int null_plugin_init(const struct plugin_ops *ops, struct diag *diag)
+{
+    auto s = xnew0(struct null_sink);
+    s->sink = null_sink_template;
+    s->diag = diag;
+
+    auto realtime = getenv(NULL_REALTIME_ENV);
+    s->realtime = realtime && strcmp(realtime, "1") == 0;
+
+    if (ops->add_sink(&s->sink, &s->ops, &s->loop)) {
+        diag_err(diag, "null: unable to register sink");
+        free(s);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void null_plugin_exit(void)
+{
+}
+
+const struct plugin_api plugin_api = {
+    .version = PLUGIN_API_VERSION,
+
+    .init = null_plugin_init,
+    .exit = null_plugin_exit,
+};
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
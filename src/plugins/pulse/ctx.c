@@ -20,6 +20,10 @@ struct pulse_ctx_priv {
     const struct sink_ops *ops;
     struct pulse_stream_ptr_vector streams;
     struct pulse_stream *input;
+    // The stream most recently used as input. It keeps counting played frames while it
+    // drains. Once it has been drained, played holds the final count.
+    struct pulse_stream *played_stream;
+    u64 played;
     enum pulse_ctx_state state;
     bool mute;
     bool paused;
@@ -36,6 +40,8 @@ static struct pulse_ctx_priv *pulse_ctx_to_priv(struct pulse_ctx *cc)
 static void pulse_ctx_set_input(struct pulse_ctx_priv *c, struct pulse_stream *s)
 {
     c->input = s;
+    c->played_stream = s;
+    c->played = 0;
     c->fmt = s->fmt;
     c->have_fmt = true;
     c->ops->request_input(&c->sink, s->requested_bytes != 0);
@@ -210,6 +216,8 @@ int pulse_ctx_flush(struct pulse_ctx *cc, const struct audio_format *f)
         }
         c->streams.len = min(c->streams.len, (size_t)1);
         c->input = NULL;
+        c->played_stream = NULL;
+        c->played = 0;
         c->have_fmt = false;
 
         auto s = pulse_ctx_playing_stream(c);
@@ -244,6 +252,19 @@ u32 pulse_ctx_latency(struct pulse_ctx *cc)
     return (u32)(total / 1000);
 }
 
+u64 pulse_ctx_played(struct pulse_ctx *cc)
+{
+    auto c = pulse_ctx_to_priv(cc);
+
+    if (c->state != PULSE_CTX_READY) {
+        return 0;
+    }
+    if (c->played_stream) {
+        return pulse_stream_played(c->played_stream);
+    }
+    return c->played;
+}
+
 void pulse_ctx_stream_state_changed(struct pulse_ctx *c, struct pulse_stream *s)
 {
     (void)c;
@@ -256,6 +277,11 @@ void pulse_ctx_stream_drained(struct pulse_ctx *cc, struct pulse_stream *s)
 {
     auto c = pulse_ctx_to_priv(cc);
 
+    if (s == c->played_stream) {
+        c->played = pulse_stream_written(s);
+        c->played_stream = NULL;
+    }
+
     if (s == pulse_ctx_playing_stream(c)) {
         pulse_stream_free(s);
         pulse_stream_ptr_vector_remove(&c->streams, 0);
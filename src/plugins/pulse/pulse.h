@@ -49,6 +49,7 @@ int pulse_ctx_set_mute(struct pulse_ctx *c, bool mute);
 int pulse_ctx_provide_buf(struct pulse_ctx *c, u8 **buf, size_t *len);
 int pulse_ctx_commit_buf(struct pulse_ctx *c, u8 *buf, size_t len);
 u32 pulse_ctx_latency(struct pulse_ctx *c);
+u64 pulse_ctx_played(struct pulse_ctx *c);
 int pulse_ctx_free(struct pulse_ctx *c);
 const char *pulse_ctx_last_err(struct pulse_ctx *c);
 void pulse_ctx_get_sink_input_info(struct pulse_ctx *c, struct pulse_stream *s);
@@ -66,6 +67,8 @@ void pulse_stream_flush(struct pulse_stream *ss);
 int pulse_stream_commit_buf(struct pulse_stream *ss, u8 *buf, size_t len);
 int pulse_stream_provide_buf(struct pulse_stream *ss, u8 **buf, size_t *len);
 pa_usec_t pulse_stream_latency(struct pulse_stream *ss);
+u64 pulse_stream_played(struct pulse_stream *ss);
+u64 pulse_stream_written(struct pulse_stream *ss);
 void pulse_stream_set_drain(struct pulse_stream *ss, bool drain);
 void pulse_stream_query_info(struct pulse_stream *ss);
 void pulse_stream_set_mute(struct pulse_stream *ss, bool mute);
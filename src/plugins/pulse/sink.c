@@ -56,6 +56,11 @@ static u32 pulse_sink_latency(struct sink *sink)
     return pulse_ctx_latency(pulse_ctx_from_sink(sink));
 }
 
+static u64 pulse_sink_played(struct sink *sink)
+{
+    return pulse_ctx_played(pulse_ctx_from_sink(sink));
+}
+
 struct sink pulse_sink_template = {
     .name = "pulse",
 
@@ -84,6 +89,7 @@ struct sink pulse_sink_template = {
     .commit_buf = pulse_sink_commit_buf,
     .flush = pulse_sink_flush,
     .latency = pulse_sink_latency,
+    .played = pulse_sink_played,
 };
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -3,6 +3,7 @@
 
 #include "utils/utils.h"
 #include "utils/xmalloc.h"
+#include "utils/trace.h"
 #include "plugin.h"
 
 #include "pulse.h"
@@ -12,6 +13,8 @@ struct pulse_stream_priv {
     struct pulse_ctx *ctx;
     pa_stream *pa_stream;
     struct pa_operation *drain_op;
+    u64 base; // stream time in frames at the last flush
+    u64 written; // frames written since the last flush
 };
 
 static struct pulse_stream_priv *pulse_stream_to_priv(struct pulse_stream *s)
@@ -88,6 +91,34 @@ pa_usec_t pulse_stream_latency(struct pulse_stream *ss)
     return latency;
 }
 
+static u64 pulse_stream_time(struct pulse_stream_priv *s)
+{
+    pa_usec_t usec;
+    if (s->pub.state != PULSE_STREAM_READY) {
+        return 0;
+    }
+    if (pa_stream_get_time(s->pa_stream, &usec) < 0) {
+        return 0;
+    }
+    return usec * s->pub.fmt.sample_rate / PA_USEC_PER_SEC;
+}
+
+u64 pulse_stream_played(struct pulse_stream *ss)
+{
+    auto s = pulse_stream_to_priv(ss);
+
+    auto time = pulse_stream_time(s);
+    if (time < s->base) {
+        return 0;
+    }
+    return min(time - s->base, s->written);
+}
+
+u64 pulse_stream_written(struct pulse_stream *ss)
+{
+    return pulse_stream_to_priv(ss)->written;
+}
+
 int pulse_stream_provide_buf(struct pulse_stream *ss, u8 **buf, size_t *len)
 {
     auto s = pulse_stream_to_priv(ss);
@@ -149,6 +180,7 @@ static void pulse_stream_on_writeable(pa_stream *p, size_t nbytes, void *userdat
     (void)p;
     struct pulse_stream_priv *s = userdata;
 
+    trace_instant(TRACE_SINK_REQUEST, nbytes, 0);
     s->pub.requested_bytes = nbytes;
     pulse_ctx_stream_request_changed(s->ctx, &s->pub);
 }
@@ -175,6 +207,8 @@ int pulse_stream_commit_buf(struct pulse_stream *ss, u8 *buf, size_t len)
         return -1;
     }
 
+    s->written += len / audio_bytes_per_sample(ss->fmt.sample_fmt) / ss->fmt.channels;
+
     return 0;
 }
 
@@ -184,6 +218,9 @@ void pulse_stream_flush(struct pulse_stream *ss)
 
     BUG_ON(ss->state != PULSE_STREAM_READY);
 
+    s->base = pulse_stream_time(s);
+    s->written = 0;
+
     auto op = pa_stream_flush(s->pa_stream, NULL, NULL);
     if (!op) {
         auto err = pulse_ctx_latest_error(s->ctx);
@@ -0,0 +1,254 @@
+#include <pthread.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "utils/utils.h"
+#include "utils/ring.h"
+#include "utils/thread.h"
+#include "utils/signals.h"
+#include "utils/xmalloc.h"
+#include "utils/diag.h"
+#include "utils/trace.h"
+
+#include "prefetch.h"
+#include "globals.h"
+
+// Number of frames the decoder thread reads at most before publishing them to the
+// consumer. It is also the amount of space that has to be free before a sleeping
+// decoder thread is woken up again.
+#define PREFETCH_CHUNK_FRAMES 4096
+
+struct prefetch {
+    struct decoder_stream *stream;
+    struct ring *ring;
+    size_t frame_size;
+    size_t chunk;
+    pthread_t thread;
+    int fd;
+    u64 pos;
+    u64 skip; // frames to discard after a seek, only used by the decoder thread
+
+    atomic_bool stop;
+    atomic_bool eof;
+    atomic_bool starving;
+    atomic_bool waiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static size_t prefetch_space(const struct prefetch *p)
+{
+    return ring_size(p->ring) - ring_fill(p->ring);
+}
+
+static bool prefetch_wait_for_space(struct prefetch *p)
+{
+    auto_unlock lock = thread_mutex_lock(&p->mutex);
+    p->waiting = true;
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!p->stop && prefetch_space(p) < p->chunk)
+        thread_cond_wait(&p->cond, &p->mutex);
+    p->waiting = false;
+    return !p->stop;
+}
+
+static void prefetch_wake_consumer(struct prefetch *p)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&p->starving, false))
+        utils_signal_eventfd(p->fd);
+}
+
+static void *prefetch_run(void *opaque)
+{
+    struct prefetch *p = opaque;
+    trace_thread_name("decoder");
+
+    // The thread is restarted after a failed seek, possibly when it has already decoded
+    // everything.
+    while (!p->eof && prefetch_wait_for_space(p)) {
+        size_t len;
+        auto buf = ring_write_buf(p->ring, &len);
+        len = min(len, p->chunk);
+
+        u64 pos;
+        trace_begin(TRACE_DECODE, len, 0);
+        if (p->stream->read(p->stream, buf, &len, &pos)) {
+            diag_err(main_diag, "unable to decode stream");
+            len = 0;
+        }
+        trace_end(TRACE_DECODE, len, pos);
+
+        if (len == 0) {
+            p->eof = true;
+            prefetch_wake_consumer(p);
+            break;
+        }
+
+        if (p->skip > 0) {
+            auto skip = min(p->skip, (u64)(len / p->frame_size));
+            p->skip -= skip;
+            len -= skip * p->frame_size;
+            memmove(buf, buf + skip * p->frame_size, len);
+            if (len == 0)
+                continue;
+        }
+
+        ring_write_commit(p->ring, len);
+        prefetch_wake_consumer(p);
+    }
+
+    return NULL;
+}
+
+static void prefetch_start(struct prefetch *p)
+{
+    p->stop = false;
+
+    auto_restore sigs = signals_block_all();
+    thread_create(&p->thread, NULL, prefetch_run, p);
+}
+
+static void prefetch_stop(struct prefetch *p)
+{
+    auto_unlock lock = thread_mutex_lock(&p->mutex);
+    p->stop = true;
+    thread_cond_signal(&p->cond);
+    thread_mutex_unlock(move(lock));
+
+    thread_join(p->thread, NULL);
+}
+
+struct prefetch *prefetch_new(struct decoder_stream *s, u32 buffer_ms)
+{
+    auto frame_size = audio_bytes_per_sample(s->fmt.sample_fmt) * s->fmt.channels;
+    auto frames = max((size_t)s->fmt.sample_rate * buffer_ms / 1000,
+            (size_t)2 * PREFETCH_CHUNK_FRAMES);
+
+    auto p = xnew0(struct prefetch);
+    p->stream = s;
+    p->ring = ring_new(frames * frame_size);
+    p->frame_size = frame_size;
+    p->chunk = PREFETCH_CHUNK_FRAMES * frame_size;
+    p->fd = utils_eventfd();
+    p->mutex = THREAD_MUTEX_INIT;
+    p->cond = THREAD_COND_INIT;
+
+    prefetch_start(p);
+
+    return p;
+}
+
+void prefetch_free(struct prefetch *p)
+{
+    prefetch_stop(p);
+    ring_free(p->ring);
+    close(p->fd);
+    free(p);
+}
+
+int prefetch_fd(const struct prefetch *p)
+{
+    return p->fd;
+}
+
+void prefetch_clear_fd(const struct prefetch *p)
+{
+    utils_clear_eventfd(p->fd);
+}
+
+size_t prefetch_read(struct prefetch *p, u8 *buf, size_t len)
+{
+    len -= len % p->frame_size;
+
+    auto done = ring_read(p->ring, buf, len);
+    p->pos += done / p->frame_size;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (p->waiting && prefetch_space(p) >= p->chunk) {
+        auto_unlock lock = thread_mutex_lock(&p->mutex);
+        thread_cond_signal(&p->cond);
+    }
+
+    if (done < len && !p->eof) {
+        p->starving = true;
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring_fill(p->ring) > 0 || p->eof)
+            prefetch_wake_consumer(p);
+    }
+
+    return done;
+}
+
+bool prefetch_eof(const struct prefetch *p)
+{
+    return p->eof && ring_fill(p->ring) == 0;
+}
+
+bool prefetch_decoded(const struct prefetch *p)
+{
+    return p->eof;
+}
+
+u64 prefetch_pos(const struct prefetch *p)
+{
+    return p->pos;
+}
+
+static u32 prefetch_bytes_to_ms(const struct prefetch *p, size_t bytes)
+{
+    auto frames = (u64)(bytes / p->frame_size);
+    return (u32)(1000 * frames / p->stream->fmt.sample_rate);
+}
+
+u32 prefetch_fill_ms(const struct prefetch *p)
+{
+    return prefetch_bytes_to_ms(p, ring_fill(p->ring));
+}
+
+u32 prefetch_size_ms(const struct prefetch *p)
+{
+    return prefetch_bytes_to_ms(p, ring_size(p->ring));
+}
+
+// Called after the decoder has seeked. The buffered frames were decoded before the seek
+// and are dropped.
+static void prefetch_set_target(struct prefetch *p, u64 target, u64 landed)
+{
+    ring_reset(p->ring);
+    p->eof = false;
+    p->starving = false;
+    p->skip = target > landed ? target - landed : 0;
+    p->pos = max(target, landed);
+}
+
+int prefetch_seek(struct prefetch *p, i64 diff, bool *eof)
+{
+    prefetch_stop(p);
+
+    // The decoder is ahead of the consumer by the buffered frames.
+    auto buffered = (i64)(ring_fill(p->ring) / p->frame_size);
+    auto target = (u64)max((i64)p->pos + diff, (i64)0);
+    u64 landed;
+    auto rc = p->stream->seek(p->stream, (i64)target - (i64)p->pos - buffered, &landed,
+            eof);
+    if (rc == 0)
+        prefetch_set_target(p, target, landed);
+
+    prefetch_start(p);
+    return rc;
+}
+
+int prefetch_seek_abs(struct prefetch *p, u64 pos)
+{
+    prefetch_stop(p);
+    u64 landed;
+    auto rc = p->stream->seek_abs(p->stream, pos, &landed);
+    if (rc == 0)
+        prefetch_set_target(p, pos, landed);
+    prefetch_start(p);
+    return rc;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
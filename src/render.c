@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "utils/utils.h"
+#include "utils/xmalloc.h"
+#include "utils/thread.h"
+#include "utils/signals.h"
+#include "utils/diag.h"
+#include "utils/convert.h"
+#include "utils/trace.h"
+
+#include "render.h"
+#include "globals.h"
+#include "main.h"
+#include "plugins.h"
+#include "decoder.h"
+#include "filter.h"
+
+#define RENDER_THREADS_ENV "OKA_RENDER_THREADS"
+#define RENDER_BLOCK_FRAMES 16384
+#define RENDER_MAX_SAMPLE_SIZE 8
+#define RENDER_WAV_HEADER_SIZE 44
+#define RENDER_WAV_PCM 1
+#define RENDER_WAV_FLOAT 3
+
+struct render_job {
+    const char *in;
+    const char *out;
+};
+
+struct render_wav {
+    FILE *file;
+    struct audio_format fmt;
+    u64 frames;
+};
+
+static struct render_job *render_jobs;
+static size_t render_num_jobs;
+static _Atomic size_t render_next_job;
+static _Atomic size_t render_failed;
+static _Atomic size_t render_running;
+static pthread_t *render_threads;
+static size_t render_num_threads;
+
+// Samples are written in the closest format WAV supports.
+static audio_sample_fmt_type render_wav_sample_fmt(audio_sample_fmt_type fmt)
+{
+    switch (fmt) {
+    case AUDIO_FORMAT_U8:
+    case AUDIO_FORMAT_S16_LE:
+    case AUDIO_FORMAT_S24_LE:
+    case AUDIO_FORMAT_S32_LE:
+    case AUDIO_FORMAT_FLOAT32_LE:
+    case AUDIO_FORMAT_FLOAT64_LE:
+        return fmt;
+    case AUDIO_FORMAT_FLOAT32_BE:
+        return AUDIO_FORMAT_FLOAT32_LE;
+    case AUDIO_FORMAT_FLOAT64_BE:
+        return AUDIO_FORMAT_FLOAT64_LE;
+    }
+    switch (audio_bytes_per_sample(fmt)) {
+    case 1:
+    case 2:
+        return AUDIO_FORMAT_S16_LE;
+    case 3:
+        return AUDIO_FORMAT_S24_LE;
+    default:
+        return AUDIO_FORMAT_S32_LE;
+    }
+}
+
+static void render_put_le(u8 *p, u64 v, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++)
+        p[i] = (u8)(v >> (8 * i));
+}
+
+static int render_wav_write_header(struct render_wav *w)
+{
+    auto sample = audio_bytes_per_sample(w->fmt.sample_fmt);
+    auto frame = sample * w->fmt.channels;
+    auto data = min(w->frames * frame, (u64)UINT32_MAX - RENDER_WAV_HEADER_SIZE);
+    auto is_float = w->fmt.sample_fmt == AUDIO_FORMAT_FLOAT32_LE ||
+        w->fmt.sample_fmt == AUDIO_FORMAT_FLOAT64_LE;
+
+    u8 h[RENDER_WAV_HEADER_SIZE];
+    memcpy(h, "RIFF", 4);
+    render_put_le(h + 4, data + RENDER_WAV_HEADER_SIZE - 8, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    render_put_le(h + 16, 16, 4);
+    render_put_le(h + 20, is_float ? RENDER_WAV_FLOAT : RENDER_WAV_PCM, 2);
+    render_put_le(h + 22, w->fmt.channels, 2);
+    render_put_le(h + 24, w->fmt.sample_rate, 4);
+    render_put_le(h + 28, (u64)w->fmt.sample_rate * frame, 4);
+    render_put_le(h + 32, frame, 2);
+    render_put_le(h + 34, 8 * sample, 2);
+    memcpy(h + 36, "data", 4);
+    render_put_le(h + 40, data, 4);
+
+    if (fseek(w->file, 0, SEEK_SET) || fwrite(h, sizeof(h), 1, w->file) != 1)
+        return -1;
+    return 0;
+}
+
+static int render_wav_open(struct render_wav *w, const char *path,
+        const struct audio_format *fmt)
+{
+    *w = (struct render_wav) { .fmt = *fmt };
+    w->file = fopen(path, "wb");
+    if (!w->file)
+        return -1;
+    // The sizes are filled in once all samples have been written.
+    return render_wav_write_header(w);
+}
+
+static int render_wav_write(struct render_wav *w, const u8 *buf, size_t frames)
+{
+    auto frame = audio_bytes_per_sample(w->fmt.sample_fmt) * w->fmt.channels;
+    if (frames && fwrite(buf, frame, frames, w->file) != frames)
+        return -1;
+    w->frames += frames;
+    return 0;
+}
+
+static int render_wav_close(struct render_wav *w)
+{
+    auto res = render_wav_write_header(w);
+    if (fclose(w->file))
+        res = -1;
+    return res;
+}
+
+// The filters of a job. The format is the one the filters process.
+struct render_chain {
+    struct audio_format fmt;
+    struct filter_instance **instances;
+    size_t num;
+    u64 latency;
+};
+
+static void render_chain_open(struct render_chain *c, const struct audio_format *in)
+{
+    struct filter **filters;
+    size_t num;
+    plugins_get_filters(&filters, &num);
+
+    c->fmt = *in;
+    for (size_t i = 0; i < num; i++)
+        if (!(filters[i]->sample_fmts & c->fmt.sample_fmt))
+            c->fmt.sample_fmt = AUDIO_FORMAT_FLOAT32;
+
+    c->instances = xnew_array(struct filter_instance *, max(num, (size_t)1));
+    c->num = 0;
+    c->latency = 0;
+    for (size_t i = 0; i < num; i++) {
+        auto f = filters[i];
+        if (atomic_load_explicit(&f->bypass, memory_order_relaxed))
+            continue;
+        auto instance = f->open(f, &c->fmt);
+        if (!instance) {
+            diag_info(main_diag, "render: filter %s does not support the format",
+                    f->name);
+            continue;
+        }
+        c->instances[c->num++] = instance;
+        c->latency += instance->latency(instance);
+    }
+}
+
+static void render_chain_process(struct render_chain *c, u8 *buf, size_t frames)
+{
+    for (size_t i = 0; i < c->num; i++)
+        c->instances[i]->process(c->instances[i], buf, frames);
+}
+
+static void render_chain_close(struct render_chain *c)
+{
+    for (size_t i = 0; i < c->num; i++)
+        c->instances[i]->close(c->instances[i]);
+    free(c->instances);
+}
+
+// State of a running job. Samples are converted in place: from the decoder format to
+// the format of the filters and then to the format of the WAV file.
+struct render_ctx {
+    struct render_chain chain;
+    struct render_wav wav;
+    u8 *buf;
+    u64 skip; // frames of filter latency still to be dropped
+};
+
+static int render_block(struct render_ctx *c, audio_sample_fmt_type from, size_t frames)
+{
+    auto chain = &c->chain;
+    auto sample = audio_bytes_per_sample(chain->fmt.sample_fmt);
+    auto samples = frames * chain->fmt.channels;
+    convert_samples(from, chain->fmt.sample_fmt, c->buf, c->buf, samples);
+    render_chain_process(chain, c->buf, frames);
+
+    auto skip = min(c->skip, (u64)frames);
+    c->skip -= skip;
+    auto out = c->buf + skip * chain->fmt.channels * sample;
+    convert_samples(chain->fmt.sample_fmt, c->wav.fmt.sample_fmt, out, out,
+            samples - skip * chain->fmt.channels);
+    return render_wav_write(&c->wav, out, frames - skip);
+}
+
+// Pushes silence through the filters so that the samples they still hold are written.
+static int render_drain(struct render_ctx *c)
+{
+    auto remaining = c->chain.latency;
+    auto channels = c->chain.fmt.channels;
+    while (remaining > 0) {
+        auto frames = min(remaining, (u64)RENDER_BLOCK_FRAMES);
+        memset(c->buf, 0, sizeof(float) * frames * channels);
+        if (render_block(c, AUDIO_FORMAT_FLOAT32, frames))
+            return -1;
+        remaining -= frames;
+    }
+    return 0;
+}
+
+static int render_stream(struct render_job *job, struct decoder_stream *s, u64 *frames)
+{
+    auto in = &s->fmt;
+    auto in_frame = audio_bytes_per_sample(in->sample_fmt) * in->channels;
+
+    struct render_ctx c = { 0 };
+    render_chain_open(&c.chain, in);
+    c.skip = c.chain.latency;
+
+    struct audio_format out = c.chain.fmt;
+    out.sample_fmt = render_wav_sample_fmt(out.sample_fmt);
+    if (render_wav_open(&c.wav, job->out, &out)) {
+        diag_err(main_diag, "render: could not create %s: %s", job->out,
+                utils_strerr(errno));
+        if (c.wav.file)
+            fclose(c.wav.file);
+        render_chain_close(&c.chain);
+        return -1;
+    }
+
+    auto block = (size_t)RENDER_BLOCK_FRAMES * in->channels * RENDER_MAX_SAMPLE_SIZE;
+    c.buf = xnew_array(u8, block);
+    auto cap = (size_t)RENDER_BLOCK_FRAMES * in_frame;
+
+    // A block is processed once it is full or the stream has ended. A partial frame at
+    // the end of the stream is dropped.
+    size_t have = 0;
+    int res = 0;
+    bool write_failed = false;
+    while (res == 0) {
+        auto len = cap - have;
+        u64 pos;
+        trace_begin(TRACE_DECODE, len, 0);
+        auto rc = s->read(s, c.buf + have, &len, &pos);
+        trace_end(TRACE_DECODE, len, pos);
+        if (rc) {
+            diag_err(main_diag, "render: could not decode %s", job->in);
+            res = -1;
+            break;
+        }
+        have += len;
+        if (len > 0 && have < cap)
+            continue;
+        if (have >= in_frame && render_block(&c, in->sample_fmt, have / in_frame))
+            write_failed = true;
+        res = write_failed ? -1 : 0;
+        have = 0;
+        if (len == 0)
+            break;
+    }
+
+    if (res == 0 && render_drain(&c))
+        write_failed = true;
+    if (render_wav_close(&c.wav))
+        write_failed = true;
+    if (write_failed) {
+        diag_err(main_diag, "render: could not write %s: %s", job->out,
+                utils_strerr(errno));
+        res = -1;
+    }
+    *frames = c.wav.frames;
+
+    free(c.buf);
+    render_chain_close(&c.chain);
+    return res;
+}
+
+static void render_job_run(struct render_job *job)
+{
+    auto start = utils_get_mono_time_ms();
+
+    auto s = plugins_open(job->in);
+    if (!s) {
+        diag_err(main_diag, "render: could not open %s", job->in);
+        render_failed++;
+        return;
+    }
+
+    auto rate = s->fmt.sample_rate;
+    u64 frames;
+    auto res = render_stream(job, s, &frames);
+    s->close(s);
+    if (res) {
+        render_failed++;
+        return;
+    }
+
+    auto ms = max(utils_get_mono_time_ms() - start, (u64)1);
+    diag_info(main_diag, "render: %s: %"PRIu64" frames in %"PRIu64" ms (%.1fx real time)",
+            job->out, frames, ms, rate ? (double)frames * 1000 / rate / ms : 0);
+}
+
+static void *render_run(void *opaque)
+{
+    (void)opaque;
+
+    trace_thread_name("render");
+    size_t i;
+    while ((i = render_next_job++) < render_num_jobs)
+        render_job_run(&render_jobs[i]);
+
+    if (--render_running == 0)
+        main_render_done();
+
+    return NULL;
+}
+
+static size_t render_thread_count(void)
+{
+    char *end, *threads = getenv(RENDER_THREADS_ENV);
+    if (threads && *threads) {
+        unsigned long tmp = strtoul(threads, &end, 10);
+        if (*end == 0 && tmp > 0)
+            return tmp;
+    }
+    auto cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+void render_init(char **paths, size_t num)
+{
+    render_jobs = xnew_array(struct render_job, max(num, (size_t)1));
+    for (size_t i = 0; i < num; i++) {
+        render_jobs[i].in = paths[2 * i];
+        render_jobs[i].out = paths[2 * i + 1];
+    }
+    render_num_jobs = num;
+
+    render_num_threads = max(min(render_thread_count(), num), (size_t)1);
+    render_running = render_num_threads;
+    render_threads = xnew_array(pthread_t, render_num_threads);
+    auto_restore sigs = signals_block_all();
+    for (size_t i = 0; i < render_num_threads; i++)
+        thread_create(&render_threads[i], NULL, render_run, NULL);
+}
+
+size_t render_exit(void)
+{
+    for (size_t i = 0; i < render_num_threads; i++)
+        thread_join(render_threads[i], NULL);
+    free(render_threads);
+    free(render_jobs);
+    return render_failed;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
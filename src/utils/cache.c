@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "utils/utils.h"
+#include "utils/cache.h"
+#include "utils/xmalloc.h"
+
+struct cache_header {
+    char magic[8];
+    struct cache_key key;
+    u64 path_len;
+    u64 data_len;
+};
+
+static size_t cache_align(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static u64 cache_hash(const char *s)
+{
+    u64 h = 0xcbf29ce484222325ull;
+    for (; *s; s++) {
+        h ^= (u8)*s;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static int cache_mkdir(char *path)
+{
+    for (auto p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = 0;
+        auto res = mkdir(path, 0755);
+        *p = '/';
+        if (res && errno != EEXIST)
+            return -1;
+    }
+    if (mkdir(path, 0755) && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+char *cache_dir(const char *dir, bool create)
+{
+    auto base = getenv("XDG_CACHE_HOME");
+    auto_free char *home = NULL;
+    if (!base || *base != '/') {
+        auto h = getenv("HOME");
+        if (!h || !*h)
+            return NULL;
+        home = xstrjoin(h, "/.cache");
+        base = home;
+    }
+
+    auto res = xstrjoin(base, "/oka/", dir);
+    if (create && cache_mkdir(res)) {
+        free(res);
+        return NULL;
+    }
+    return res;
+}
+
+// Entries are named after a hash of the path. The full path is stored in the entry to
+// detect collisions.
+static char *cache_file(const char *dir, const char *path, bool create)
+{
+    auto_free auto base = cache_dir(dir, create);
+    if (!base)
+        return NULL;
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long)cache_hash(path));
+    return xstrjoin(base, name);
+}
+
+int cache_key_get(const char *path, struct cache_key *key)
+{
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+    *key = (struct cache_key) {
+        .size = (u64)st.st_size,
+        .mtime_sec = st.st_mtim.tv_sec,
+        .mtime_nsec = st.st_mtim.tv_nsec,
+    };
+    return 0;
+}
+
+int cache_load(const char *dir, const char magic[static 8], const char *path,
+        const struct cache_key *key, struct cache_entry *entry)
+{
+    auto_free auto file = cache_file(dir, path, false);
+    if (!file)
+        return -1;
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct cache_header))
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    auto len = (size_t)st.st_size;
+    const struct cache_header *h = map;
+    auto path_len = strlen(path);
+    auto off = sizeof(*h) + cache_align(path_len);
+    if (memcmp(h->magic, magic, 8) || memcmp(&h->key, key, sizeof(*key)) ||
+            h->path_len != path_len || off > len || h->data_len > len - off ||
+            memcmp((const u8 *)map + sizeof(*h), path, path_len)) {
+        munmap(map, len);
+        return -1;
+    }
+
+    *entry = (struct cache_entry) {
+        .map = map,
+        .map_len = len,
+        .data = (const u8 *)map + off,
+        .len = h->data_len,
+    };
+    return 0;
+}
+
+void cache_entry_free(struct cache_entry *entry)
+{
+    munmap(entry->map, entry->map_len);
+}
+
+int cache_store(const char *dir, const char magic[static 8], const char *path,
+        const struct cache_key *key, const void *data, size_t len)
+{
+    auto_free auto file = cache_file(dir, path, true);
+    if (!file)
+        return -1;
+
+    struct cache_header h = {
+        .key = *key,
+        .path_len = strlen(path),
+        .data_len = len,
+    };
+    memcpy(h.magic, magic, 8);
+    static const u8 pad[8];
+
+    struct iovec iov[] = {
+        { &h, sizeof(h) },
+        { (void *)path, h.path_len },
+        { (void *)pad, cache_align(h.path_len) - h.path_len },
+        { (void *)data, len },
+    };
+    size_t total = 0;
+    for (size_t i = 0; i < N_ELEMENTS(iov); i++)
+        total += iov[i].iov_len;
+
+    // Readers map the entry, so it is replaced by renaming a new file over it.
+    auto_free auto tmp = xstrjoin(file, ".XXXXXX");
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return -1;
+    fchmod(fd, 0644);
+    auto res = writev(fd, iov, N_ELEMENTS(iov)) == (ssize_t)total ? 0 : -1;
+    if (close(fd))
+        res = -1;
+    if (res == 0)
+        res = rename(tmp, file);
+    if (res)
+        unlink(tmp);
+    return res;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
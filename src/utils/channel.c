@@ -1,43 +1,54 @@
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <unistd.h>
 
 #include "utils/channel.h"
 #include "utils/utils.h"
-#include "utils/list.h"
 #include "utils/xmalloc.h"
 #include "utils/thread.h"
 #include "utils/debug.h"
 
+// An intrusive MPSC queue. Producers swap themselves into head and then link the
+// previous node to themselves. The consumer pops at tail. The stub keeps the queue from
+// ever being empty, so pushing never has to update tail.
+//
+// Nodes the consumer has taken out of the queue while removing are kept in the front
+// list and popped before the queue.
+//
+// The eventfd is only written by the push that finds signaled unset. The consumer
+// unsets it in channel_clear_fd, before it pops.
 struct channel {
-    struct list head;
+    struct channel_node *_Atomic head;
+    struct channel_node *tail;
+    struct channel_node stub;
+    struct channel_node *front;
+    struct channel_node *front_tail;
+    atomic_bool waiting;
+    atomic_bool signaled;
+    _Atomic u64 signals;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     int fd;
 };
 
-struct channel_entry {
-    struct list node;
-    void *data;
-};
-
 struct channel *channel_new(bool need_fd)
 {
-    auto channel = xnew_uninit(struct channel);
-    list_init(&channel->head);
+    auto channel = xnew0(struct channel);
+    channel->head = &channel->stub;
+    channel->tail = &channel->stub;
     channel->mutex = THREAD_MUTEX_INIT;
     channel->cond = THREAD_COND_INIT;
     channel->fd = need_fd ? utils_eventfd() : -1;
     return channel;
 }
 
+// The nodes that are still queued belong to the caller.
 void channel_free(struct channel *c)
 {
     if (c->fd != -1) {
         close(c->fd);
     }
-    while (channel_pop(c, void)) {
-    }
     free(c);
 }
 
@@ -51,58 +62,134 @@ void channel_clear_fd(struct channel *c)
 {
     BUG_ON(c->fd == -1);
     utils_clear_eventfd(c->fd);
+    c->signaled = false;
 }
 
-static struct channel_entry *channel_entry_from_node(struct list *node)
+void channel_fd_cleared(struct channel *c)
 {
-    return container_of(node, struct channel_entry, node);
+    c->signaled = false;
 }
 
-void channel_push(struct channel *c, void *data)
+void channel_signal_fd(struct channel *c)
 {
-    auto entry = xnew_uninit(struct channel_entry);
-    entry->data = data;
-    auto_unlock lock = thread_mutex_lock(&c->mutex);
-    list_append(&c->head, &entry->node);
-    if (c->fd != -1) {
+    BUG_ON(c->fd == -1);
+    if (!c->signaled && !atomic_exchange(&c->signaled, true)) {
+        c->signals++;
         utils_signal_eventfd(c->fd);
     }
-    thread_cond_signal(&c->cond);
 }
 
-void *channel_pop__(struct channel *c)
+u64 channel_fd_signals(struct channel *c)
 {
-    auto_unlock lock = thread_mutex_lock(&c->mutex);
-    auto entry_node = list_pop_first(&c->head);
-    if (!entry_node) {
+    return c->signals;
+}
+
+static void channel_link(struct channel *c, struct channel_node *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    auto prev = atomic_exchange(&c->head, node);
+    atomic_store(&prev->next, node);
+}
+
+// The consumer is only woken up after the node has been linked. Before that, it
+// cannot be popped.
+void channel_push(struct channel *c, struct channel_node *node)
+{
+    channel_link(c, node);
+    if (c->fd != -1) {
+        channel_signal_fd(c);
+    }
+    if (c->waiting) {
+        auto_unlock lock = thread_mutex_lock(&c->mutex);
+        thread_cond_signal(&c->cond);
+    }
+}
+
+// Returns NULL if the queue is empty or the next node has not been linked yet.
+static struct channel_node *channel_take(struct channel *c)
+{
+    auto tail = c->tail;
+    auto next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &c->stub) {
+        if (!next) {
+            return NULL;
+        }
+        c->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        c->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&c->head)) {
         return NULL;
     }
-    auto_free auto entry = channel_entry_from_node(entry_node);
-    return entry->data;
+    // tail is the last node. Queue the stub behind it so that it can be taken.
+    channel_link(c, &c->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        c->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+struct channel_node *channel_pop(struct channel *c)
+{
+    auto node = c->front;
+    if (!node) {
+        return channel_take(c);
+    }
+    c->front = atomic_load_explicit(&node->next, memory_order_relaxed);
+    return node;
 }
 
-void *channel_pop_wait__(struct channel *c)
+struct channel_node *channel_pop_wait(struct channel *c)
 {
+    auto node = channel_pop(c);
+    if (node) {
+        return node;
+    }
     auto_unlock lock = thread_mutex_lock(&c->mutex);
-    while (list_empty(&c->head)) {
+    c->waiting = true;
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!(node = channel_pop(c))) {
         thread_cond_wait(&c->cond, &c->mutex);
     }
-    auto entry_node = list_pop_first(&c->head);
-    auto_free auto entry = channel_entry_from_node(entry_node);
-    return entry->data;
+    c->waiting = false;
+    return node;
 }
 
+// Only nodes whose push has completed are considered.
 void channel_remove(struct channel *c, channel_remove_cb cb, void *opaque)
 {
-    auto_unlock lock = thread_mutex_lock(&c->mutex);
-    struct list *node, *n;
-    list_for_each_safe(node, n, &c->head) {
-        auto e = channel_entry_from_node(node);
-        if (cb(e->data, opaque)) {
-            list_remove(node);
-            free(e);
+    struct channel_node *node;
+    while ((node = channel_take(c))) {
+        atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+        if (c->front) {
+            atomic_store_explicit(&c->front_tail->next, node, memory_order_relaxed);
+        } else {
+            c->front = node;
+        }
+        c->front_tail = node;
+    }
+
+    struct channel_node *prev = NULL;
+    for (node = c->front; node; ) {
+        auto next = atomic_load_explicit(&node->next, memory_order_relaxed);
+        if (cb(node, opaque)) {
+            if (prev) {
+                atomic_store_explicit(&prev->next, next, memory_order_relaxed);
+            } else {
+                c->front = next;
+            }
+        } else {
+            prev = node;
         }
+        node = next;
     }
+    c->front_tail = prev;
 }
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
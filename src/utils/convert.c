@@ -0,0 +1,499 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define CONVERT_X86 1
+#endif
+
+#include "utils/utils.h"
+#include "utils/audio.h"
+#include "utils/convert.h"
+#include "utils/thread.h"
+
+// Every conversion goes through a block of native signed 32 bit samples. Decoding into
+// and encoding from this block have vectorized kernels for the native S16, S32, and
+// FLOAT32 formats. All other formats use the generic scalar code. Conversions between
+// two float formats go through doubles instead so that they neither clip nor lose
+// precision.
+#define CONVERT_BLOCK 1024
+
+enum convert_kind {
+    CONVERT_SIGNED,
+    CONVERT_UNSIGNED,
+    CONVERT_FLOAT,
+    CONVERT_ALAW,
+    CONVERT_ULAW,
+};
+
+struct convert_info {
+    audio_sample_fmt_type fmt;
+    enum convert_kind kind;
+    u8 size;
+    u8 bits;
+    bool be;
+};
+
+static const struct convert_info convert_infos[] = {
+    { AUDIO_FORMAT_ALAW,         CONVERT_ALAW,     1, 8,  false },
+    { AUDIO_FORMAT_ULAW,         CONVERT_ULAW,     1, 8,  false },
+    { AUDIO_FORMAT_S8,           CONVERT_SIGNED,   1, 8,  false },
+    { AUDIO_FORMAT_S16_LE,       CONVERT_SIGNED,   2, 16, false },
+    { AUDIO_FORMAT_S16_BE,       CONVERT_SIGNED,   2, 16, true  },
+    { AUDIO_FORMAT_S24_LE,       CONVERT_SIGNED,   3, 24, false },
+    { AUDIO_FORMAT_S24_BE,       CONVERT_SIGNED,   3, 24, true  },
+    { AUDIO_FORMAT_S24_IN_32_LE, CONVERT_SIGNED,   4, 24, false },
+    { AUDIO_FORMAT_S24_IN_32_BE, CONVERT_SIGNED,   4, 24, true  },
+    { AUDIO_FORMAT_S32_LE,       CONVERT_SIGNED,   4, 32, false },
+    { AUDIO_FORMAT_S32_BE,       CONVERT_SIGNED,   4, 32, true  },
+    { AUDIO_FORMAT_U8,           CONVERT_UNSIGNED, 1, 8,  false },
+    { AUDIO_FORMAT_U16_LE,       CONVERT_UNSIGNED, 2, 16, false },
+    { AUDIO_FORMAT_U16_BE,       CONVERT_UNSIGNED, 2, 16, true  },
+    { AUDIO_FORMAT_U24_LE,       CONVERT_UNSIGNED, 3, 24, false },
+    { AUDIO_FORMAT_U24_BE,       CONVERT_UNSIGNED, 3, 24, true  },
+    { AUDIO_FORMAT_U24_IN_32_LE, CONVERT_UNSIGNED, 4, 24, false },
+    { AUDIO_FORMAT_U24_IN_32_BE, CONVERT_UNSIGNED, 4, 24, true  },
+    { AUDIO_FORMAT_U32_LE,       CONVERT_UNSIGNED, 4, 32, false },
+    { AUDIO_FORMAT_U32_BE,       CONVERT_UNSIGNED, 4, 32, true  },
+    { AUDIO_FORMAT_FLOAT32_LE,   CONVERT_FLOAT,    4, 32, false },
+    { AUDIO_FORMAT_FLOAT32_BE,   CONVERT_FLOAT,    4, 32, true  },
+    { AUDIO_FORMAT_FLOAT64_LE,   CONVERT_FLOAT,    8, 64, false },
+    { AUDIO_FORMAT_FLOAT64_BE,   CONVERT_FLOAT,    8, 64, true  },
+};
+
+typedef void (*convert_kernel)(const u8 *in, u8 *out, size_t n);
+
+static struct {
+    convert_kernel s16_to_s32;
+    convert_kernel s32_to_s16;
+    convert_kernel f32_to_s32;
+    convert_kernel s32_to_f32;
+} convert_kernels;
+
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+static i16 convert_alaw_table[256];
+static i16 convert_ulaw_table[256];
+
+#define CONVERT_F32_MAX 0x1.fffffep-1f
+#define CONVERT_S32_SCALE 2147483648.0
+
+static const struct convert_info *convert_info(audio_sample_fmt_type fmt)
+{
+    for (size_t i = 0; i < N_ELEMENTS(convert_infos); i++) {
+        if (convert_infos[i].fmt == fmt)
+            return &convert_infos[i];
+    }
+    BUG("unexpected audio format");
+}
+
+static i16 convert_alaw_decode(u8 a)
+{
+    a ^= 0x55;
+    i32 t = (a & 0x0f) << 4;
+    i32 seg = (a & 0x70) >> 4;
+    if (seg == 0)
+        t += 8;
+    else
+        t = (t + 0x108) << (seg - 1);
+    return (i16)((a & 0x80) ? t : -t);
+}
+
+static i16 convert_ulaw_decode(u8 u)
+{
+    u = (u8)~u;
+    i32 t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+    return (i16)((u & 0x80) ? 0x84 - t : t - 0x84);
+}
+
+static u32 convert_segment(i32 val, i32 first_end)
+{
+    u32 seg = 0;
+    for (i32 end = first_end; seg < 8 && val > end; end = 2 * end + 1)
+        seg++;
+    return seg;
+}
+
+static u8 convert_alaw_encode(i16 pcm)
+{
+    i32 val = pcm >> 3;
+    u8 mask = 0xd5;
+    if (val < 0) {
+        mask = 0x55;
+        val = -val - 1;
+    }
+    auto seg = convert_segment(val, 0x1f);
+    if (seg >= 8)
+        return 0x7f ^ mask;
+    auto shift = seg < 2 ? 1 : seg;
+    return (u8)((seg << 4) | ((u32)(val >> shift) & 0x0f)) ^ mask;
+}
+
+static u8 convert_ulaw_encode(i16 pcm)
+{
+    i32 val = pcm >> 2;
+    u8 mask = 0xff;
+    if (val < 0) {
+        mask = 0x7f;
+        val = -val;
+    }
+    val = min(val, 8159) + (0x84 >> 2);
+    auto seg = convert_segment(val, 0x3f);
+    if (seg >= 8)
+        return 0x7f ^ mask;
+    return (u8)((seg << 4) | ((u32)(val >> (seg + 1)) & 0x0f)) ^ mask;
+}
+
+static u64 convert_load(const u8 *p, size_t size, bool be)
+{
+    u64 v = 0;
+    for (size_t i = 0; i < size; i++)
+        v |= (u64)p[be ? size - 1 - i : i] << (8 * i);
+    return v;
+}
+
+static void convert_store(u8 *p, u64 v, size_t size, bool be)
+{
+    for (size_t i = 0; i < size; i++)
+        p[be ? size - 1 - i : i] = (u8)(v >> (8 * i));
+}
+
+static i32 convert_float_to_s32(double f)
+{
+    f *= CONVERT_S32_SCALE;
+    if (f >= INT32_MAX)
+        return INT32_MAX;
+    if (f <= INT32_MIN)
+        return INT32_MIN;
+    if (f != f)
+        return 0;
+    return (i32)f;
+}
+
+static double convert_load_float(const struct convert_info *ci, const u8 *p)
+{
+    if (ci->size == 4) {
+        auto v = (u32)convert_load(p, 4, ci->be);
+        float f;
+        memcpy(&f, &v, sizeof(f));
+        return f;
+    }
+    auto v = convert_load(p, 8, ci->be);
+    double f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+static void convert_store_float(const struct convert_info *ci, double f, u8 *p)
+{
+    if (ci->size == 4) {
+        auto ff = (float)f;
+        u32 v;
+        memcpy(&v, &ff, sizeof(v));
+        convert_store(p, v, 4, ci->be);
+    } else {
+        u64 v;
+        memcpy(&v, &f, sizeof(v));
+        convert_store(p, v, 8, ci->be);
+    }
+}
+
+static i32 convert_decode_one(const struct convert_info *ci, const u8 *p)
+{
+    switch (ci->kind) {
+    case CONVERT_ALAW:
+        return (i32)((u32)(u16)convert_alaw_table[*p] << 16);
+    case CONVERT_ULAW:
+        return (i32)((u32)(u16)convert_ulaw_table[*p] << 16);
+    case CONVERT_FLOAT:
+        return convert_float_to_s32(convert_load_float(ci, p));
+    case CONVERT_SIGNED:
+    case CONVERT_UNSIGNED:
+        break;
+    }
+
+    auto v = (u32)convert_load(p, ci->size, ci->be) << (32 - ci->bits);
+    if (ci->kind == CONVERT_UNSIGNED)
+        v ^= 0x80000000;
+    return (i32)v;
+}
+
+static void convert_encode_one(const struct convert_info *ci, i32 s, u8 *p)
+{
+    switch (ci->kind) {
+    case CONVERT_ALAW:
+        *p = convert_alaw_encode((i16)(s >> 16));
+        return;
+    case CONVERT_ULAW:
+        *p = convert_ulaw_encode((i16)(s >> 16));
+        return;
+    case CONVERT_FLOAT:
+        convert_store_float(ci, s / CONVERT_S32_SCALE, p);
+        return;
+    case CONVERT_SIGNED:
+        convert_store(p, (u32)(s >> (32 - ci->bits)), ci->size, ci->be);
+        return;
+    case CONVERT_UNSIGNED:
+        convert_store(p, ((u32)s ^ 0x80000000) >> (32 - ci->bits), ci->size, ci->be);
+        return;
+    }
+}
+
+static void convert_s16_to_s32_scalar(const u8 *in, u8 *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        i16 s;
+        memcpy(&s, in + 2 * i, 2);
+        auto d = (i32)((u32)(u16)s << 16);
+        memcpy(out + 4 * i, &d, 4);
+    }
+}
+
+static void convert_s32_to_s16_scalar(const u8 *in, u8 *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        i32 s;
+        memcpy(&s, in + 4 * i, 4);
+        auto d = (i16)(s >> 16);
+        memcpy(out + 2 * i, &d, 2);
+    }
+}
+
+static void convert_f32_to_s32_scalar(const u8 *in, u8 *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        float s;
+        memcpy(&s, in + 4 * i, 4);
+        auto d = convert_float_to_s32(s);
+        memcpy(out + 4 * i, &d, 4);
+    }
+}
+
+static void convert_s32_to_f32_scalar(const u8 *in, u8 *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        i32 s;
+        memcpy(&s, in + 4 * i, 4);
+        auto d = (float)(s / CONVERT_S32_SCALE);
+        memcpy(out + 4 * i, &d, 4);
+    }
+}
+
+#ifdef CONVERT_X86
+
+__attribute__((target("sse2")))
+static void convert_s16_to_s32_sse2(const u8 *in, u8 *out, size_t n)
+{
+    auto zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+        _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_unpacklo_epi16(zero, v));
+        _mm_storeu_si128((__m128i *)(out + 4 * i + 16), _mm_unpackhi_epi16(zero, v));
+    }
+    convert_s16_to_s32_scalar(in + 2 * i, out + 4 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32_to_s16_sse2(const u8 *in, u8 *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto lo = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+        auto hi = _mm_loadu_si128((const __m128i *)(in + 4 * i + 16));
+        lo = _mm_srai_epi32(lo, 16);
+        hi = _mm_srai_epi32(hi, 16);
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packs_epi32(lo, hi));
+    }
+    convert_s32_to_s16_scalar(in + 4 * i, out + 2 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_f32_to_s32_sse2(const u8 *in, u8 *out, size_t n)
+{
+    auto lo = _mm_set1_ps(-1.0f);
+    auto hi = _mm_set1_ps(CONVERT_F32_MAX);
+    auto scale = _mm_set1_ps((float)CONVERT_S32_SCALE);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto v = _mm_loadu_ps((const float *)(in + 4 * i));
+        v = _mm_mul_ps(_mm_min_ps(_mm_max_ps(v, lo), hi), scale);
+        _mm_storeu_si128((__m128i *)(out + 4 * i), _mm_cvttps_epi32(v));
+    }
+    convert_f32_to_s32_scalar(in + 4 * i, out + 4 * i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s32_to_f32_sse2(const u8 *in, u8 *out, size_t n)
+{
+    auto scale = _mm_set1_ps((float)(1 / CONVERT_S32_SCALE));
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto v = _mm_loadu_si128((const __m128i *)(in + 4 * i));
+        _mm_storeu_ps((float *)(out + 4 * i), _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+    }
+    convert_s32_to_f32_scalar(in + 4 * i, out + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16_to_s32_avx2(const u8 *in, u8 *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + 2 * i)));
+        _mm256_storeu_si256((__m256i *)(out + 4 * i), _mm256_slli_epi32(v, 16));
+    }
+    convert_s16_to_s32_scalar(in + 2 * i, out + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32_to_s16_avx2(const u8 *in, u8 *out, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto lo = _mm256_loadu_si256((const __m256i *)(in + 4 * i));
+        auto hi = _mm256_loadu_si256((const __m256i *)(in + 4 * i + 32));
+        lo = _mm256_srai_epi32(lo, 16);
+        hi = _mm256_srai_epi32(hi, 16);
+        // packs works on 128 bit lanes
+        auto v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), v);
+    }
+    convert_s32_to_s16_scalar(in + 4 * i, out + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_f32_to_s32_avx2(const u8 *in, u8 *out, size_t n)
+{
+    auto lo = _mm256_set1_ps(-1.0f);
+    auto hi = _mm256_set1_ps(CONVERT_F32_MAX);
+    auto scale = _mm256_set1_ps((float)CONVERT_S32_SCALE);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = _mm256_loadu_ps((const float *)(in + 4 * i));
+        v = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(v, lo), hi), scale);
+        _mm256_storeu_si256((__m256i *)(out + 4 * i), _mm256_cvttps_epi32(v));
+    }
+    convert_f32_to_s32_scalar(in + 4 * i, out + 4 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s32_to_f32_avx2(const u8 *in, u8 *out, size_t n)
+{
+    auto scale = _mm256_set1_ps((float)(1 / CONVERT_S32_SCALE));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = _mm256_loadu_si256((const __m256i *)(in + 4 * i));
+        v = _mm256_castps_si256(_mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+        _mm256_storeu_si256((__m256i *)(out + 4 * i), v);
+    }
+    convert_s32_to_f32_scalar(in + 4 * i, out + 4 * i, n - i);
+}
+
+#endif
+
+static void convert_init(void)
+{
+    for (size_t i = 0; i < 256; i++) {
+        convert_alaw_table[i] = convert_alaw_decode((u8)i);
+        convert_ulaw_table[i] = convert_ulaw_decode((u8)i);
+    }
+
+    convert_kernels.s16_to_s32 = convert_s16_to_s32_scalar;
+    convert_kernels.s32_to_s16 = convert_s32_to_s16_scalar;
+    convert_kernels.f32_to_s32 = convert_f32_to_s32_scalar;
+    convert_kernels.s32_to_f32 = convert_s32_to_f32_scalar;
+
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        convert_kernels.s16_to_s32 = convert_s16_to_s32_avx2;
+        convert_kernels.s32_to_s16 = convert_s32_to_s16_avx2;
+        convert_kernels.f32_to_s32 = convert_f32_to_s32_avx2;
+        convert_kernels.s32_to_f32 = convert_s32_to_f32_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        convert_kernels.s16_to_s32 = convert_s16_to_s32_sse2;
+        convert_kernels.s32_to_s16 = convert_s32_to_s16_sse2;
+        convert_kernels.f32_to_s32 = convert_f32_to_s32_sse2;
+        convert_kernels.s32_to_f32 = convert_s32_to_f32_sse2;
+    }
+#endif
+}
+
+static void convert_decode(const struct convert_info *ci, const u8 *in, i32 *out,
+        size_t n)
+{
+    if (ci->fmt == AUDIO_FORMAT_S16)
+        convert_kernels.s16_to_s32(in, (u8 *)out, n);
+    else if (ci->fmt == AUDIO_FORMAT_S32)
+        memcpy(out, in, 4 * n);
+    else if (ci->fmt == AUDIO_FORMAT_FLOAT32)
+        convert_kernels.f32_to_s32(in, (u8 *)out, n);
+    else {
+        for (size_t i = 0; i < n; i++)
+            out[i] = convert_decode_one(ci, in + i * ci->size);
+    }
+}
+
+static void convert_encode(const struct convert_info *ci, const i32 *in, u8 *out,
+        size_t n)
+{
+    if (ci->fmt == AUDIO_FORMAT_S16)
+        convert_kernels.s32_to_s16((const u8 *)in, out, n);
+    else if (ci->fmt == AUDIO_FORMAT_S32)
+        memcpy(out, in, 4 * n);
+    else if (ci->fmt == AUDIO_FORMAT_FLOAT32)
+        convert_kernels.s32_to_f32((const u8 *)in, out, n);
+    else {
+        for (size_t i = 0; i < n; i++)
+            convert_encode_one(ci, in[i], out + i * ci->size);
+    }
+}
+
+// Every sample is read before it is written, so in place conversions only have to run
+// from the back when the samples grow.
+static void convert_float(const struct convert_info *fi, const struct convert_info *ti,
+        const u8 *in, u8 *out, size_t samples)
+{
+    auto backwards = ti->size > fi->size;
+    for (size_t i = 0; i < samples; i++) {
+        auto j = backwards ? samples - 1 - i : i;
+        convert_store_float(ti, convert_load_float(fi, in + j * fi->size),
+                out + j * ti->size);
+    }
+}
+
+void convert_samples(audio_sample_fmt_type from, audio_sample_fmt_type to,
+        const void *in, void *out, size_t samples)
+{
+    auto fi = convert_info(from);
+    auto ti = convert_info(to);
+
+    if (from == to) {
+        if (in != out)
+            memmove(out, in, samples * fi->size);
+        return;
+    }
+
+    if (fi->kind == CONVERT_FLOAT && ti->kind == CONVERT_FLOAT) {
+        convert_float(fi, ti, in, out, samples);
+        return;
+    }
+
+    thread_once(&convert_once, convert_init);
+
+    // When converting in place to a bigger format, the blocks have to be processed
+    // from the back so that no block overwrites input that has not been read yet.
+    auto backwards = ti->size > fi->size;
+    auto blocks = (samples + CONVERT_BLOCK - 1) / CONVERT_BLOCK;
+    i32 tmp[CONVERT_BLOCK];
+
+    for (size_t i = 0; i < blocks; i++) {
+        auto off = (backwards ? blocks - 1 - i : i) * CONVERT_BLOCK;
+        auto n = min((size_t)CONVERT_BLOCK, samples - off);
+        convert_decode(fi, (const u8 *)in + off * fi->size, tmp, n);
+        convert_encode(ti, tmp, (u8 *)out + off * ti->size, n);
+    }
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
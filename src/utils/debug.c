@@ -1,7 +1,11 @@
+// For dladdr.
+#define _GNU_SOURCE
+
 #include <stdnoreturn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <dlfcn.h>
 
 #include "utils/debug.h"
 
@@ -31,4 +35,16 @@ void debug_warn__(const char *function, const char *fmt, ...)
     fprintf(stderr, "\n");
 }
 
+void debug_addr_name(uintptr_t addr, char *buf, size_t len)
+{
+    Dl_info info;
+    if (dladdr((void *)addr, &info) && info.dli_fname) {
+        const char *name = strrchr(info.dli_fname, '/');
+        snprintf(buf, len, "%s+0x%zx", name ? name + 1 : info.dli_fname,
+                (size_t)(addr - (uintptr_t)info.dli_fbase));
+    } else {
+        snprintf(buf, len, "0x%zx", (size_t)addr);
+    }
+}
+
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
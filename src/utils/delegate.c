@@ -5,9 +5,17 @@
 #include "utils/channel.h"
 #include "utils/delegate.h"
 #include "utils/thread.h"
+#include "utils/trace.h"
+
+// Number of delegates delegator_run runs before it lets the loop handle other events.
+#define DELEGATOR_BATCH 64
 
 struct delegator {
     struct channel *c;
+    _Atomic u64 delegates;
+    _Atomic u64 wakeups;
+    delegator_observer observer;
+    void *observer_opaque;
 };
 
 struct delegate_sync {
@@ -18,7 +26,7 @@ struct delegate_sync {
 
 struct delegator *delegator_new(void)
 {
-    auto d = xnew_uninit(struct delegator);
+    auto d = xnew0(struct delegator);
     d->c = channel_new(true);
     return d;
 }
@@ -28,12 +36,40 @@ int delegator_fd(struct delegator *d)
     return channel_fd(d->c);
 }
 
+static void delegator_run_batch(struct delegator *d)
+{
+    size_t n = 0;
+    struct delegate *dd;
+    while (n < DELEGATOR_BATCH &&
+            (dd = channel_entry(channel_pop(d->c), struct delegate, node))) {
+        // The delegate may free itself.
+        auto run = dd->run;
+        auto start = d->observer ? utils_get_mono_time_ns() : 0;
+        dd->queued = false;
+        trace_begin(TRACE_DELEGATE, (uintptr_t)run, 0);
+        run(dd);
+        trace_end(TRACE_DELEGATE, 0, 0);
+        if (d->observer)
+            d->observer(run, start, d->observer_opaque);
+        n++;
+    }
+    // Come back for the rest.
+    if (n == DELEGATOR_BATCH)
+        channel_signal_fd(d->c);
+    d->wakeups++;
+    d->delegates += n;
+}
+
 void delegator_run(struct delegator *d)
 {
     channel_clear_fd(d->c);
-    struct delegate *dd;
-    while ((dd = channel_pop(d->c, struct delegate)))
-        dd->run(dd);
+    delegator_run_batch(d);
+}
+
+void delegator_run_cleared(struct delegator *d)
+{
+    channel_fd_cleared(d->c);
+    delegator_run_batch(d);
 }
 
 void delegator_free(struct delegator *d)
@@ -44,7 +80,8 @@ void delegator_free(struct delegator *d)
 
 void delegator_delegate(struct delegator *d, struct delegate *dd)
 {
-    channel_push(d->c, dd);
+    if (!atomic_exchange(&dd->queued, true))
+        channel_push(d->c, &dd->node);
 }
 
 static void delegator_delegate_sync_delegate(struct delegate *d)
@@ -65,4 +102,19 @@ void delegator_delegate_sync(struct delegator *d, struct delegate *dd)
     thread_sync_wait(&sync.sync);
 }
 
+void delegator_set_observer(struct delegator *d, delegator_observer cb, void *opaque)
+{
+    d->observer = cb;
+    d->observer_opaque = opaque;
+}
+
+void delegator_get_stats(struct delegator *d, struct delegator_stats *s)
+{
+    *s = (struct delegator_stats) {
+        .delegates = d->delegates,
+        .wakeups = d->wakeups,
+        .signals = channel_fd_signals(d->c),
+    };
+}
+
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
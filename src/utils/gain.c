@@ -0,0 +1,298 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define GAIN_X86 1
+#endif
+
+#include "utils/utils.h"
+#include "utils/gain.h"
+#include "utils/convert.h"
+#include "utils/thread.h"
+
+// Formats without a kernel are converted to floats in blocks of this many samples.
+#define GAIN_BLOCK 1024
+
+typedef void (*gain_kernel)(u8 *buf, size_t n, float gain);
+typedef void (*gain_mix_kernel)(float *a, const float *b, const float *ga,
+        const float *gb, size_t n);
+
+static struct {
+    gain_kernel s16;
+    gain_kernel s32;
+    gain_kernel f32;
+    gain_mix_kernel mix;
+} gain_kernels;
+
+static pthread_once_t gain_once = PTHREAD_ONCE_INIT;
+
+static float gain_parse_one(const char *s)
+{
+    if (!s)
+        return NAN;
+    char *end;
+    auto v = strtof(s, &end);
+    return end == s ? NAN : v;
+}
+
+void gain_replaygain_parse(struct gain_replaygain *rg, const struct metadata *md)
+{
+    rg->track_gain = gain_parse_one(metadata_get(md, METADATA_REPLAYGAIN_TRACK_GAIN));
+    rg->track_peak = gain_parse_one(metadata_get(md, METADATA_REPLAYGAIN_TRACK_PEAK));
+    rg->album_gain = gain_parse_one(metadata_get(md, METADATA_REPLAYGAIN_ALBUM_GAIN));
+    rg->album_peak = gain_parse_one(metadata_get(md, METADATA_REPLAYGAIN_ALBUM_PEAK));
+}
+
+float gain_from_db(float db)
+{
+    return powf(10, db / 20);
+}
+
+static void gain_s16_scalar(u8 *buf, size_t n, float gain)
+{
+    for (size_t i = 0; i < n; i++) {
+        i16 s;
+        memcpy(&s, buf + 2 * i, 2);
+        auto v = lrintf(s * gain);
+        s = (i16)max(min(v, (long)INT16_MAX), (long)INT16_MIN);
+        memcpy(buf + 2 * i, &s, 2);
+    }
+}
+
+static void gain_s32_scalar(u8 *buf, size_t n, float gain)
+{
+    for (size_t i = 0; i < n; i++) {
+        i32 s;
+        memcpy(&s, buf + 4 * i, 4);
+        auto v = llrint(s * (double)gain);
+        s = (i32)max(min(v, (long long)INT32_MAX), (long long)INT32_MIN);
+        memcpy(buf + 4 * i, &s, 4);
+    }
+}
+
+static void gain_f32_scalar(u8 *buf, size_t n, float gain)
+{
+    for (size_t i = 0; i < n; i++) {
+        float s;
+        memcpy(&s, buf + 4 * i, 4);
+        s *= gain;
+        memcpy(buf + 4 * i, &s, 4);
+    }
+}
+
+static void gain_mix_scalar(float *a, const float *b, const float *ga, const float *gb,
+        size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        a[i] = a[i] * ga[i] + b[i] * gb[i];
+}
+
+#ifdef GAIN_X86
+
+__attribute__((target("sse")))
+static void gain_mix_sse(float *a, const float *b, const float *ga, const float *gb,
+        size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto x = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(ga + i));
+        auto y = _mm_mul_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(gb + i));
+        _mm_storeu_ps(a + i, _mm_add_ps(x, y));
+    }
+    gain_mix_scalar(a + i, b + i, ga + i, gb + i, n - i);
+}
+
+__attribute__((target("avx")))
+static void gain_mix_avx(float *a, const float *b, const float *ga, const float *gb,
+        size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto x = _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(ga + i));
+        auto y = _mm256_mul_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(gb + i));
+        _mm256_storeu_ps(a + i, _mm256_add_ps(x, y));
+    }
+    gain_mix_scalar(a + i, b + i, ga + i, gb + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void gain_s16_sse2(u8 *buf, size_t n, float gain)
+{
+    auto g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = _mm_loadu_si128((const __m128i *)(buf + 2 * i));
+        auto lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        auto hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), g));
+        hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), g));
+        _mm_storeu_si128((__m128i *)(buf + 2 * i), _mm_packs_epi32(lo, hi));
+    }
+    gain_s16_scalar(buf + 2 * i, n - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void gain_s32_sse2(u8 *buf, size_t n, float gain)
+{
+    auto g = _mm_set1_pd(gain);
+    auto lim_hi = _mm_set1_pd(INT32_MAX);
+    auto lim_lo = _mm_set1_pd(INT32_MIN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto v = _mm_loadu_si128((const __m128i *)(buf + 4 * i));
+        auto lo = _mm_mul_pd(_mm_cvtepi32_pd(v), g);
+        auto hi = _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, 0xee)), g);
+        lo = _mm_max_pd(_mm_min_pd(lo, lim_hi), lim_lo);
+        hi = _mm_max_pd(_mm_min_pd(hi, lim_hi), lim_lo);
+        v = _mm_unpacklo_epi64(_mm_cvtpd_epi32(lo), _mm_cvtpd_epi32(hi));
+        _mm_storeu_si128((__m128i *)(buf + 4 * i), v);
+    }
+    gain_s32_scalar(buf + 4 * i, n - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void gain_f32_sse2(u8 *buf, size_t n, float gain)
+{
+    auto g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto v = _mm_loadu_ps((const float *)(buf + 4 * i));
+        _mm_storeu_ps((float *)(buf + 4 * i), _mm_mul_ps(v, g));
+    }
+    gain_f32_scalar(buf + 4 * i, n - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void gain_s16_avx2(u8 *buf, size_t n, float gain)
+{
+    auto g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(buf + 2 * i)));
+        auto hi = _mm256_cvtepi16_epi32(
+                _mm_loadu_si128((const __m128i *)(buf + 2 * i + 16)));
+        lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), g));
+        hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), g));
+        // packs works on 128 bit lanes
+        auto v = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i *)(buf + 2 * i), v);
+    }
+    gain_s16_sse2(buf + 2 * i, n - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void gain_s32_avx2(u8 *buf, size_t n, float gain)
+{
+    auto g = _mm256_set1_pd(gain);
+    auto lim_hi = _mm256_set1_pd(INT32_MAX);
+    auto lim_lo = _mm256_set1_pd(INT32_MIN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto v = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(buf + 4 * i)));
+        v = _mm256_max_pd(_mm256_min_pd(_mm256_mul_pd(v, g), lim_hi), lim_lo);
+        _mm_storeu_si128((__m128i *)(buf + 4 * i), _mm256_cvtpd_epi32(v));
+    }
+    gain_s32_scalar(buf + 4 * i, n - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void gain_f32_avx2(u8 *buf, size_t n, float gain)
+{
+    auto g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = _mm256_loadu_ps((const float *)(buf + 4 * i));
+        _mm256_storeu_ps((float *)(buf + 4 * i), _mm256_mul_ps(v, g));
+    }
+    gain_f32_scalar(buf + 4 * i, n - i, gain);
+}
+
+#endif
+
+static void gain_init(void)
+{
+    gain_kernels.s16 = gain_s16_scalar;
+    gain_kernels.s32 = gain_s32_scalar;
+    gain_kernels.f32 = gain_f32_scalar;
+    gain_kernels.mix = gain_mix_scalar;
+
+#ifdef GAIN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        gain_kernels.mix = gain_mix_avx;
+    else if (__builtin_cpu_supports("sse"))
+        gain_kernels.mix = gain_mix_sse;
+    if (__builtin_cpu_supports("avx2")) {
+        gain_kernels.s16 = gain_s16_avx2;
+        gain_kernels.s32 = gain_s32_avx2;
+        gain_kernels.f32 = gain_f32_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        gain_kernels.s16 = gain_s16_sse2;
+        gain_kernels.s32 = gain_s32_sse2;
+        gain_kernels.f32 = gain_f32_sse2;
+    }
+#endif
+}
+
+void gain_apply(audio_sample_fmt_type fmt, void *buf, size_t samples, float gain)
+{
+    if (gain == 1.0f)
+        return;
+
+    thread_once(&gain_once, gain_init);
+
+    if (fmt == AUDIO_FORMAT_S16) {
+        gain_kernels.s16(buf, samples, gain);
+    } else if (fmt == AUDIO_FORMAT_S32) {
+        gain_kernels.s32(buf, samples, gain);
+    } else if (fmt == AUDIO_FORMAT_FLOAT32) {
+        gain_kernels.f32(buf, samples, gain);
+    } else if (fmt == AUDIO_FORMAT_FLOAT64) {
+        // Going through FLOAT32 would lose precision.
+        double *d = buf;
+        for (size_t i = 0; i < samples; i++)
+            d[i] *= gain;
+    } else {
+        auto size = audio_bytes_per_sample(fmt);
+        float tmp[GAIN_BLOCK];
+        for (size_t off = 0; off < samples; off += GAIN_BLOCK) {
+            auto n = min((size_t)GAIN_BLOCK, samples - off);
+            auto p = (u8 *)buf + off * size;
+            convert_samples(fmt, AUDIO_FORMAT_FLOAT32, p, tmp, n);
+            gain_kernels.f32((u8 *)tmp, n, gain);
+            convert_samples(AUDIO_FORMAT_FLOAT32, fmt, tmp, p, n);
+        }
+    }
+}
+
+void gain_crossfade(float *in, const float *out, size_t frames, u32 channels, u64 pos,
+        u64 len)
+{
+    BUG_ON(channels == 0 || channels > GAIN_BLOCK || len == 0);
+
+    thread_once(&gain_once, gain_init);
+
+    // The fade curves are expanded to one gain per sample so that the mix kernel does
+    // not have to know about channels.
+    float gin[GAIN_BLOCK], gout[GAIN_BLOCK];
+    auto block = GAIN_BLOCK / channels;
+    for (size_t off = 0; off < frames; off += block) {
+        auto n = min(block, frames - off);
+        for (size_t i = 0; i < n; i++) {
+            auto t = min((float)(pos + off + i) / len, 1.0f);
+            auto fin = sqrtf(t);
+            auto fout = sqrtf(1 - t);
+            for (u32 c = 0; c < channels; c++) {
+                gin[i * channels + c] = fin;
+                gout[i * channels + c] = fout;
+            }
+        }
+        auto samples = off * channels;
+        gain_kernels.mix(in + samples, out + samples, gin, gout, n * channels);
+    }
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
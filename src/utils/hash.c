@@ -46,7 +46,7 @@ static enum hash_map_bucket_status hash_map_search(struct hash_map *map, void *k
     auto idx = (size_t)hash & (map->buckets - 1);
     size_t del_pos = 0;
     bool del_pos_set = false;
-    for (size_t i = 1; ; idx += i, i++) {
+    for (size_t i = 1; ; idx = (idx + i) & (map->buckets - 1), i++) {
         auto bucket = map->bucket[idx];
         if (!bucket) {
             if (del_pos_set) {
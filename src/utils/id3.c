@@ -1,11 +1,48 @@
-#include <string.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "utils/utils.h"
 #include "utils/id3.h"
 #include "utils/metadata.h"
 #include "utils/xmalloc.h"
 
+#define ID3_HEADER_SIZE 10
+#define ID3_V1_SIZE 128
+#define APE_FOOTER_SIZE 32
+// Most tags fit into the first mapping. Larger ones are mapped again.
+#define ID3_HEAD_MAP (64 * 1024)
+#define ID3_TAIL_MAP (8 * 1024)
+
+#define ID3_FLAG_UNSYNC 0x80
+#define ID3_FLAG_EXTENDED 0x40
+
+#define ID3_V23_COMPRESSED 0x80
+#define ID3_V23_ENCRYPTED 0x40
+#define ID3_V23_GROUPED 0x20
+
+#define ID3_V24_GROUPED 0x40
+#define ID3_V24_COMPRESSED 0x08
+#define ID3_V24_ENCRYPTED 0x04
+#define ID3_V24_UNSYNC 0x02
+#define ID3_V24_DATA_LENGTH 0x01
+
+#define APE_ITEM_TYPE 0x06
+#define APE_ITEM_TEXT 0x00
+
+enum {
+    ID3_LATIN1,
+    ID3_UTF16,
+    ID3_UTF16BE,
+    ID3_UTF8,
+};
+
 enum {
     ID3_TDOR = METADATA_NUM_TAGS + 1,
     ID3_TORY,
@@ -40,6 +77,55 @@ static const struct {
     { { "TYER" }, ID3_TYER             },
 };
 
+static const struct {
+    const char *desc;
+    enum metadata_key key;
+} id3_txxx_map[] = {
+    { "replaygain_track_gain", METADATA_REPLAYGAIN_TRACK_GAIN },
+    { "replaygain_track_peak", METADATA_REPLAYGAIN_TRACK_PEAK },
+    { "replaygain_album_gain", METADATA_REPLAYGAIN_ALBUM_GAIN },
+    { "replaygain_album_peak", METADATA_REPLAYGAIN_ALBUM_PEAK },
+};
+
+static const struct {
+    char v22[4];
+    char v23[5];
+} id3_v22_map[] = {
+    { "TAL", "TALB" },
+    { "TBP", "TBPM" },
+    { "TCP", "TCMP" },
+    { "TCO", "TCON" },
+    { "TT2", "TIT2" },
+    { "TP1", "TPE1" },
+    { "TP2", "TPE2" },
+    { "TP4", "TPE4" },
+    { "TPA", "TPOS" },
+    { "TRK", "TRCK" },
+    { "TOR", "TORY" },
+    { "TYE", "TYER" },
+    { "TXX", "TXXX" },
+};
+
+// APEv2 keys are matched case-insensitively. Unknown keys are treated like TXXX
+// descriptions.
+static const struct {
+    const char *key;
+    char id[5];
+} id3_ape_map[] = {
+    { "Artist",       "TPE1" },
+    { "Album",        "TALB" },
+    { "Title",        "TIT2" },
+    { "Year",         "TDRC" },
+    { "Genre",        "TCON" },
+    { "Disc",         "TPOS" },
+    { "Track",        "TRCK" },
+    { "Album Artist", "TPE2" },
+    { "AlbumArtist",  "TPE2" },
+    { "Compilation",  "TCMP" },
+    { "BPM",          "TBPM" },
+    { "MixArtist",    "TPE4" },
+};
+
 static int id3_tag_to_metadata(const char tag_str[static 4])
 {
     u32 tag;
@@ -51,12 +137,21 @@ static int id3_tag_to_metadata(const char tag_str[static 4])
     return METADATA_INVALID;
 }
 
-static void id3_fill_year(enum metadata_key key, const char *txt, 
+static void id3_set(enum metadata_key key, const char *txt, size_t len,
+        char *metadata[static METADATA_NUM_TAGS])
+{
+    if (!metadata[key])
+        metadata[key] = xstrndup(txt, len);
+}
+
+static void id3_fill_year(enum metadata_key key, const char *txt, size_t len,
         char *metadata[static METADATA_NUM_TAGS])
 {
+    if (metadata[key])
+        return;
     auto date = xnew_uninit(metadata_date_format);
     size_t i = 0;
-    for (; i < sizeof(*date) - 1 && txt[i]; i++)
+    for (; i < sizeof(*date) - 1 && i < len; i++)
         (*date)[i] = txt[i];
     for (; i < sizeof(*date) - 1; i++)
         (*date)[i] = '0';
@@ -64,17 +159,16 @@ static void id3_fill_year(enum metadata_key key, const char *txt,
     metadata[key] = *date;
 }
 
-static void id3_fill_timestamp(enum metadata_key key, const char *txt, 
+static void id3_fill_timestamp(enum metadata_key key, const char *txt, size_t len,
         char *metadata[static METADATA_NUM_TAGS])
 {
+    if (metadata[key])
+        return;
     auto date = xnew_uninit(metadata_date_format);
     size_t i = 0;
-    for (; i < sizeof(*date) - 1 && txt[i]; i++) {
-        if (*txt == '-') {
-            txt++;
-            continue;
-        }
-        (*date)[i] = txt[i];
+    for (size_t j = 0; i < sizeof(*date) - 1 && j < len && txt[j] != 'T'; j++) {
+        if (txt[j] != '-')
+            (*date)[i++] = txt[j];
     }
     for (; i < sizeof(*date) - 1; i++)
         (*date)[i] = '0';
@@ -104,7 +198,7 @@ static const char *id3_genres[] = {
     "Euro-House", "Dance Hall", "Goa", "Drum & Bass", "Club-House", "Hardcore", "Terror",
     "Indie", "BritPop", "Negerpunk", "Polsk Punk", "Beat", "Christian Gangsta Rap",
     "Heavy Metal", "Black Metal", "Crossover", "Contemporary Christian", "Christian Rock",
-    "Merengue", "Salsa", "Thrash Metal", "Anime", "JPop", "Synthpop" "Abstract",
+    "Merengue", "Salsa", "Thrash Metal", "Anime", "JPop", "Synthpop", "Abstract",
     "Art Rock", "Baroque", "Bhangra", "Big Beat", "Breakbeat", "Chillout", "Downtempo",
     "Dub", "EBM", "Eclectic", "Electro", "Electroclash", "Emo", "Experimental", "Garage",
     "Global", "IDM", "Illbient", "Industro-Goth", "Jam Band", "Krautrock", "Leftfield",
@@ -114,31 +208,39 @@ static const char *id3_genres[] = {
     "G-Funk", "Dubstep", "Garage Rock", "Psybient",
 };
 
-static void id3_fill_genre(const char *txt, char *metadata[static METADATA_NUM_TAGS])
+static void id3_fill_genre(const char *txt, size_t len,
+        char *metadata[static METADATA_NUM_TAGS])
 {
-    if (txt[0] == '(') {
-        if (txt[1] == 'R' && txt[2] == 'X' && txt[3] == ')') {
+    if (metadata[METADATA_GENRE])
+        return;
+
+    // ID3v2.3 refers to ID3v1 genres as "(n)", ID3v2.4 as "n".
+    size_t paren = len > 0 && txt[0] == '(';
+    if (paren && len >= 4) {
+        if (memcmp(txt, "(RX)", 4) == 0) {
             metadata[METADATA_GENRE] = xstrdup("Remix");
             return;
         }
 
-        if (txt[1] == 'C' && txt[2] == 'R' && txt[3] == ')') {
+        if (memcmp(txt, "(CR)", 4) == 0) {
             metadata[METADATA_GENRE] = xstrdup("Cover");
             return;
         }
+    }
 
-        char *end;
-        unsigned long num = strtoul(txt + 1, &end, 10);
-        if (end != txt + 1 && *end == ')' && num < N_ELEMENTS(id3_genres)) {
-            metadata[METADATA_GENRE] = xstrdup(id3_genres[num]);
-            return;
-        }
+    size_t i = paren, num = 0;
+    for (; i < len && txt[i] >= '0' && txt[i] <= '9' && num < N_ELEMENTS(id3_genres); i++)
+        num = 10 * num + (size_t)(txt[i] - '0');
+    auto end = paren ? i < len && txt[i] == ')' : i == len;
+    if (i > paren && end && num < N_ELEMENTS(id3_genres)) {
+        metadata[METADATA_GENRE] = xstrdup(id3_genres[num]);
+        return;
     }
 
-    metadata[METADATA_GENRE] = xstrdup(txt);
+    metadata[METADATA_GENRE] = xstrndup(txt, len);
 }
 
-static void id3_fill_date(int tag, const char *txt,
+static void id3_fill_date(int tag, const char *txt, size_t len,
         char *metadata[static METADATA_NUM_TAGS])
 {
     auto fn = id3_fill_timestamp;
@@ -147,19 +249,506 @@ static void id3_fill_date(int tag, const char *txt,
         field = METADATA_ORIGINALDATE;
     if (tag == ID3_TORY || tag == ID3_TYER)
         fn = id3_fill_year;
-    fn(field, txt, metadata);
+    fn(field, txt, len, metadata);
 }
 
-void id3_metadata(const char tag[static 4], const char *txt,
+void id3_metadata(const char tag[static 4], const char *txt, size_t len,
         char *metadata[static METADATA_NUM_TAGS])
 {
     auto key = id3_tag_to_metadata(tag);
     if (key > METADATA_NUM_TAGS)
-        id3_fill_date(key, txt, metadata);
+        id3_fill_date(key, txt, len, metadata);
     else if (key == METADATA_GENRE)
-        id3_fill_genre(txt, metadata);
+        id3_fill_genre(txt, len, metadata);
     else if (key != METADATA_INVALID)
-        metadata[key] = xstrdup(txt);
+        id3_set(key, txt, len, metadata);
+}
+
+void id3_txxx_metadata(const char *desc, size_t desc_len, const char *txt, size_t len,
+        char *metadata[static METADATA_NUM_TAGS])
+{
+    for (size_t i = 0; i < N_ELEMENTS(id3_txxx_map); i++) {
+        auto name = id3_txxx_map[i].desc;
+        if (strlen(name) == desc_len && strncasecmp(desc, name, desc_len) == 0) {
+            id3_set(id3_txxx_map[i].key, txt, len, metadata);
+            return;
+        }
+    }
+}
+
+struct id3_buf {
+    char *ptr;
+    size_t cap;
+};
+
+// Values are handed to id3_metadata as slices of the mapped file. Only text that is
+// neither UTF-8 nor ASCII and unsynchronised tags are copied into the buffers first.
+struct id3_reader {
+    char **metadata;
+    struct id3_buf text[2];
+    struct id3_buf sync;
+};
+
+struct id3_text {
+    const char *p;
+    size_t len;
+};
+
+struct id3_mapping {
+    void *base;
+    size_t len;
+};
+
+static char *id3_buf_reserve(struct id3_buf *b, size_t len)
+{
+    if (b->cap < len) {
+        b->cap = max(len, 2 * b->cap);
+        b->ptr = xrenew(b->ptr, char, b->cap);
+    }
+    return b->ptr;
+}
+
+static u32 id3_be32(const u8 *p)
+{
+    return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+}
+
+static u32 id3_le32(const u8 *p)
+{
+    return (u32)p[3] << 24 | (u32)p[2] << 16 | (u32)p[1] << 8 | p[0];
+}
+
+static u32 id3_syncsafe(const u8 *p)
+{
+    return (u32)(p[0] & 0x7f) << 21 | (u32)(p[1] & 0x7f) << 14 |
+        (u32)(p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+}
+
+static void id3_latin1(struct id3_buf *b, const u8 *p, size_t len, struct id3_text *t)
+{
+    size_t ascii = 0;
+    while (ascii < len && p[ascii] < 0x80)
+        ascii++;
+    if (ascii == len) {
+        *t = (struct id3_text) { (const char *)p, len };
+        return;
+    }
+
+    auto out = id3_buf_reserve(b, 2 * len);
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] < 0x80) {
+            out[n++] = (char)p[i];
+        } else {
+            out[n++] = (char)(0xc0 | p[i] >> 6);
+            out[n++] = (char)(0x80 | (p[i] & 0x3f));
+        }
+    }
+    *t = (struct id3_text) { out, n };
+}
+
+static u32 id3_utf16_unit(const u8 *p, bool be)
+{
+    return be ? (u32)p[0] << 8 | p[1] : (u32)p[1] << 8 | p[0];
+}
+
+static size_t id3_put_utf8(char *out, u32 c)
+{
+    if (c < 0x80) {
+        out[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char)(0xc0 | c >> 6);
+        out[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char)(0xe0 | c >> 12);
+        out[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        out[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | c >> 18);
+    out[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    out[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+// Text without a byte order mark is assumed to be in the byte order of be.
+static void id3_utf16(struct id3_buf *b, const u8 *p, size_t len, bool be,
+        struct id3_text *t)
+{
+    if (len >= 2 && ((p[0] == 0xff && p[1] == 0xfe) || (p[0] == 0xfe && p[1] == 0xff))) {
+        be = p[0] == 0xfe;
+        p += 2;
+        len -= 2;
+    }
+
+    // A code unit becomes at most three bytes, a surrogate pair four.
+    auto out = id3_buf_reserve(b, 3 * (len / 2));
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        auto c = id3_utf16_unit(p + i, be);
+        if (c >= 0xd800 && c < 0xdc00 && i + 3 < len) {
+            auto lo = id3_utf16_unit(p + i + 2, be);
+            if (lo >= 0xdc00 && lo < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                i += 2;
+            }
+        }
+        if (c >= 0xd800 && c < 0xe000)
+            c = 0xfffd;
+        n += id3_put_utf8(out + n, c);
+    }
+    *t = (struct id3_text) { out, n };
+}
+
+// Decodes the string at the start of p, which ends at a terminator or at len. Returns
+// the number of bytes used including the terminator.
+static size_t id3_decode(struct id3_buf *b, u8 enc, const u8 *p, size_t len,
+        struct id3_text *t)
+{
+    size_t end, term = 1;
+    if (enc == ID3_UTF16 || enc == ID3_UTF16BE) {
+        term = 2;
+        for (end = 0; end + 1 < len && (p[end] || p[end + 1]); end += 2)
+            ;
+    } else {
+        const u8 *nul = memchr(p, 0, len);
+        end = nul ? (size_t)(nul - p) : len;
+    }
+
+    *t = (struct id3_text) { NULL, 0 };
+    switch (enc) {
+    case ID3_LATIN1:
+        id3_latin1(b, p, end, t);
+        break;
+    case ID3_UTF16:
+    case ID3_UTF16BE:
+        id3_utf16(b, p, end, enc == ID3_UTF16BE, t);
+        break;
+    case ID3_UTF8:
+        *t = (struct id3_text) { (const char *)p, end };
+        break;
+    }
+    return min(end + term, len);
+}
+
+// Removes the zero bytes that unsynchronisation inserts after every 0xff.
+static size_t id3_resync(struct id3_buf *b, const u8 *p, size_t len)
+{
+    auto out = (u8 *)id3_buf_reserve(b, len);
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        out[n++] = p[i];
+        if (p[i] == 0xff && i + 1 < len && p[i + 1] == 0)
+            i++;
+    }
+    return n;
+}
+
+// Only text frames are of interest. Multiple values are separated by terminators, only
+// the first one is used.
+static void id3_text_frame(struct id3_reader *r, const char id[static 4], const u8 *p,
+        size_t len)
+{
+    if (len < 1)
+        return;
+    auto enc = p[0];
+    p++;
+    len--;
+
+    struct id3_text value;
+    if (memcmp(id, "TXXX", 4) == 0) {
+        struct id3_text desc;
+        auto used = id3_decode(&r->text[0], enc, p, len, &desc);
+        id3_decode(&r->text[1], enc, p + used, len - used, &value);
+        if (desc.len && value.len)
+            id3_txxx_metadata(desc.p, desc.len, value.p, value.len, r->metadata);
+        return;
+    }
+
+    id3_decode(&r->text[0], enc, p, len, &value);
+    if (value.len)
+        id3_metadata(id, value.p, value.len, r->metadata);
+}
+
+static void id3_v2_frame(struct id3_reader *r, u8 major, bool unsync,
+        const char id[static 4], u8 flags, const u8 *p, size_t len)
+{
+    if (id[0] != 'T')
+        return;
+
+    if (major == 3) {
+        if (flags & (ID3_V23_COMPRESSED | ID3_V23_ENCRYPTED))
+            return;
+        if (flags & ID3_V23_GROUPED) {
+            if (len < 1)
+                return;
+            p++;
+            len--;
+        }
+    } else if (major == 4) {
+        if (flags & (ID3_V24_COMPRESSED | ID3_V24_ENCRYPTED))
+            return;
+        auto extra = (size_t)(flags & ID3_V24_GROUPED ? 1 : 0) +
+            (flags & ID3_V24_DATA_LENGTH ? 4 : 0);
+        if (len < extra)
+            return;
+        p += extra;
+        len -= extra;
+        if (unsync || flags & ID3_V24_UNSYNC) {
+            len = id3_resync(&r->sync, p, len);
+            p = (const u8 *)r->sync.ptr;
+        }
+    }
+
+    id3_text_frame(r, id, p, len);
+}
+
+static bool id3_v22_id(const u8 *p, char id[static 4])
+{
+    for (size_t i = 0; i < N_ELEMENTS(id3_v22_map); i++) {
+        if (memcmp(p, id3_v22_map[i].v22, 3) == 0) {
+            memcpy(id, id3_v22_map[i].v23, 4);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses the frames of an ID3v2 tag. p points behind the tag header.
+static void id3_v2_frames(struct id3_reader *r, u8 major, u8 flags, const u8 *p,
+        size_t len)
+{
+    // Before ID3v2.4 unsynchronisation applies to the whole tag including the frame
+    // headers.
+    if (flags & ID3_FLAG_UNSYNC && major < 4) {
+        len = id3_resync(&r->sync, p, len);
+        p = (const u8 *)r->sync.ptr;
+    }
+
+    if (flags & ID3_FLAG_EXTENDED) {
+        // In ID3v2.2 this flag marks a compressed tag.
+        if (major == 2 || len < 4)
+            return;
+        auto ext = major == 3 ? 4 + (size_t)id3_be32(p) : (size_t)id3_syncsafe(p);
+        if (ext > len)
+            return;
+        p += ext;
+        len -= ext;
+    }
+
+    size_t header = major == 2 ? 6 : 10;
+    while (len >= header && p[0]) {
+        char id[4] = { 0 };
+        size_t size;
+        u8 frame_flags = 0;
+        if (major == 2) {
+            size = (size_t)p[3] << 16 | (size_t)p[4] << 8 | p[5];
+            id3_v22_id(p, id);
+        } else {
+            memcpy(id, p, 4);
+            size = major == 3 ? id3_be32(p + 4) : id3_syncsafe(p + 4);
+            frame_flags = p[9];
+        }
+        p += header;
+        len -= header;
+        if (size > len)
+            break;
+        id3_v2_frame(r, major, flags & ID3_FLAG_UNSYNC, id, frame_flags, p, size);
+        p += size;
+        len -= size;
+    }
+}
+
+static void id3_ape_item(struct id3_reader *r, const char *key, size_t key_len,
+        const u8 *value, size_t len)
+{
+    // Lists are separated by zero bytes, only the first element is used.
+    const u8 *nul = memchr(value, 0, len);
+    if (nul)
+        len = (size_t)(nul - value);
+    if (len == 0)
+        return;
+
+    auto txt = (const char *)value;
+    for (size_t i = 0; i < N_ELEMENTS(id3_ape_map); i++) {
+        auto name = id3_ape_map[i].key;
+        if (strlen(name) == key_len && strncasecmp(key, name, key_len) == 0) {
+            id3_metadata(id3_ape_map[i].id, txt, len, r->metadata);
+            return;
+        }
+    }
+    id3_txxx_metadata(key, key_len, txt, len, r->metadata);
+}
+
+// Parses the items of an APEv2 tag. p points to the first item.
+static void id3_ape_items(struct id3_reader *r, const u8 *p, size_t len, u32 count)
+{
+    for (u32 i = 0; i < count && len >= 8; i++) {
+        auto size = (size_t)id3_le32(p);
+        auto flags = id3_le32(p + 4);
+        p += 8;
+        len -= 8;
+
+        const u8 *nul = memchr(p, 0, len);
+        if (!nul)
+            break;
+        auto key_len = (size_t)(nul - p);
+        auto value = nul + 1;
+        len -= key_len + 1;
+        if (size > len)
+            break;
+        if ((flags & APE_ITEM_TYPE) == APE_ITEM_TEXT)
+            id3_ape_item(r, (const char *)p, key_len, value, size);
+        p = value + size;
+        len -= size;
+    }
+}
+
+static void id3_v1_field(struct id3_reader *r, const char id[static 4], const u8 *p,
+        size_t len)
+{
+    const u8 *nul = memchr(p, 0, len);
+    if (nul)
+        len = (size_t)(nul - p);
+    while (len > 0 && p[len - 1] == ' ')
+        len--;
+    if (len == 0)
+        return;
+
+    struct id3_text t;
+    id3_latin1(&r->text[0], p, len, &t);
+    id3_metadata(id, t.p, t.len, r->metadata);
+}
+
+static void id3_v1(struct id3_reader *r, const u8 *p)
+{
+    id3_v1_field(r, "TIT2", p + 3, 30);
+    id3_v1_field(r, "TPE1", p + 33, 30);
+    id3_v1_field(r, "TALB", p + 63, 30);
+    id3_v1_field(r, "TYER", p + 93, 4);
+
+    // ID3v1.1 stores the track number in the last byte of the comment.
+    if (p[125] == 0 && p[126] != 0) {
+        char track[4];
+        auto len = snprintf(track, sizeof(track), "%u", p[126]);
+        id3_metadata("TRCK", track, (size_t)len, r->metadata);
+    }
+
+    if (p[127] < N_ELEMENTS(id3_genres) && !r->metadata[METADATA_GENRE])
+        r->metadata[METADATA_GENRE] = xstrdup(id3_genres[p[127]]);
+}
+
+static void id3_unmap(struct id3_mapping *m)
+{
+    if (m->base)
+        munmap(m->base, m->len);
+    m->base = NULL;
+}
+
+// Maps len bytes of the file starting at off. Previous mappings are released.
+static const u8 *id3_map_file(struct id3_mapping *m, int fd, u64 off, size_t len)
+{
+    id3_unmap(m);
+    auto page = (u64)sysconf(_SC_PAGESIZE);
+    auto delta = (size_t)(off % page);
+    auto base = mmap(NULL, len + delta, PROT_READ, MAP_PRIVATE, fd, (off_t)(off - delta));
+    if (base == MAP_FAILED)
+        return NULL;
+    m->base = base;
+    m->len = len + delta;
+    return (const u8 *)base + delta;
+}
+
+static void id3_read_head(struct id3_reader *r, int fd, u64 size)
+{
+    if (size < ID3_HEADER_SIZE)
+        return;
+
+    struct id3_mapping m = { 0 };
+    auto mapped = (size_t)min(size, (u64)ID3_HEAD_MAP);
+    auto p = id3_map_file(&m, fd, 0, mapped);
+    if (!p)
+        return;
+
+    if (memcmp(p, "ID3", 3) == 0 && p[3] >= 2 && p[3] <= 4 &&
+            (p[6] | p[7] | p[8] | p[9]) < 0x80) {
+        auto major = p[3];
+        auto flags = p[5];
+        auto len = (size_t)min((u64)id3_syncsafe(p + 6), size - ID3_HEADER_SIZE);
+        if (ID3_HEADER_SIZE + len > mapped)
+            p = id3_map_file(&m, fd, 0, ID3_HEADER_SIZE + len);
+        if (p)
+            id3_v2_frames(r, major, flags, p + ID3_HEADER_SIZE, len);
+    }
+
+    id3_unmap(&m);
+}
+
+// An APEv2 tag is located at the end of the file or right before an ID3v1 tag.
+static void id3_read_tail(struct id3_reader *r, int fd, u64 size)
+{
+    if (size == 0)
+        return;
+
+    struct id3_mapping m = { 0 };
+    auto mapped = (size_t)min(size, (u64)ID3_TAIL_MAP);
+    auto off = size - mapped;
+    auto p = id3_map_file(&m, fd, off, mapped);
+    if (!p)
+        return;
+
+    auto v1 = mapped >= ID3_V1_SIZE && memcmp(p + mapped - ID3_V1_SIZE, "TAG", 3) == 0;
+    auto end = mapped - (v1 ? ID3_V1_SIZE : 0);
+    if (end >= APE_FOOTER_SIZE && memcmp(p + end - APE_FOOTER_SIZE, "APETAGEX", 8) == 0) {
+        auto footer = p + end - APE_FOOTER_SIZE;
+        auto tag = (u64)id3_le32(footer + 12);
+        auto count = id3_le32(footer + 16);
+        if (tag >= APE_FOOTER_SIZE && tag <= size - (mapped - end)) {
+            if (tag > end) {
+                auto extra = (size_t)(tag - end);
+                mapped += extra;
+                end += extra;
+                off -= extra;
+                p = id3_map_file(&m, fd, off, mapped);
+            }
+            if (p)
+                id3_ape_items(r, p + end - tag, (size_t)tag - APE_FOOTER_SIZE, count);
+        }
+    }
+
+    if (p && v1)
+        id3_v1(r, p + mapped - ID3_V1_SIZE);
+
+    id3_unmap(&m);
+}
+
+int id3_read(const char *path, char *metadata[static METADATA_NUM_TAGS])
+{
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+
+    // Earlier tags take precedence: ID3v2, then APEv2, then ID3v1.
+    struct id3_reader r = { .metadata = metadata };
+    id3_read_head(&r, fd, (u64)st.st_size);
+    id3_read_tail(&r, fd, (u64)st.st_size);
+    close(fd);
+
+    for (size_t i = 0; i < N_ELEMENTS(r.text); i++)
+        free(r.text[i].ptr);
+    free(r.sync.ptr);
+    return 0;
 }
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
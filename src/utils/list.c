@@ -35,6 +35,18 @@ struct list *list_pop_first(struct list *head)
     return f;
 }
 
+// Moves all nodes of from to the end of head.
+void list_splice(struct list *head, struct list *from)
+{
+    if (list_empty(from))
+        return;
+    from->next->prev = head->prev;
+    from->prev->next = head;
+    head->prev->next = from->next;
+    head->prev = from->prev;
+    list_init(from);
+}
+
 bool list_empty(struct list *head)
 {
     return head->next == head;
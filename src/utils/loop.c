@@ -1,7 +1,13 @@
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
 
@@ -12,40 +18,144 @@
 #include "utils/xmalloc.h"
 #include "utils/debug.h"
 #include "utils/vec.h"
+#include "utils/list.h"
+#include "utils/uring.h"
+#include "utils/trace.h"
 
-UTILS_VECTOR(loop_defer, struct loop_defer *)
+#define LOOP_NS_PER_SEC 1000000000ull
+// The heap index of a timer that is not armed.
+#define LOOP_TIMER_IDLE SIZE_MAX
+#define LOOP_URING_ENTRIES 64
+// The number of events handled per iteration.
+#define LOOP_EVENTS 16
 
+// Callbacks are told apart by their address. A loop that has more distinct callbacks
+// accounts the rest to one entry.
+#define LOOP_STATS_SLOTS 256
+// Latencies are recorded in buckets with 8 sub-buckets per power of two, so the
+// percentiles are exact to 12.5%. Latencies of 2^40 ns and more share the last bucket.
+#define LOOP_HIST_SUB_BITS 3
+#define LOOP_HIST_SUB (1 << LOOP_HIST_SUB_BITS)
+#define LOOP_HIST_MAX_BITS 40
+#define LOOP_HIST_BUCKETS ((LOOP_HIST_MAX_BITS - LOOP_HIST_SUB_BITS + 1) * LOOP_HIST_SUB)
+
+UTILS_VECTOR(loop_clock, struct loop_clock *)
+UTILS_VECTOR(loop_timer, struct loop_timer *)
+
+// The low bits of the user data of an SQE tell what it belongs to. The completions of
+// SQEs without a tag are ignored. They only complete if they fail, so that they do not
+// end the wait.
+enum loop_tag {
+    LOOP_TAG_NONE,
+    LOOP_TAG_POLL,
+    LOOP_TAG_CLOCK,
+    LOOP_TAG_DELEGATOR,
+    LOOP_TAG_MASK = 3,
+};
+
+// kind is the kind of callback whose readiness the fd signals. poll is the request of
+// the io_uring backend.
 struct loop_watch {
     struct loop *loop;
     int fd;
+    u32 events;
     loop_watch_cb cb;
     void *opaque;
+    enum loop_kind kind;
+    struct loop_poll *poll;
     struct loop_watch *next;
 };
 
+// Changing a watch detaches its poll request, whose completions are then ignored. busy
+// is set while the kernel owns the request. It is freed after its last completion.
+struct loop_poll {
+    struct loop_watch *watch;
+    bool busy;
+    struct list node;
+};
+
+// Only the loop thread writes the stats, other threads read them at any time. Entries
+// are published by storing them in their slot and never removed.
+struct loop_cb_entry {
+    enum loop_kind kind;
+    uintptr_t cb;
+    _Atomic u64 calls;
+    _Atomic u64 total_ns;
+    _Atomic u64 max_ns;
+    _Atomic u64 hist[LOOP_HIST_BUCKETS];
+};
+
+struct loop_stats {
+    u64 start_ns;
+    _Atomic u64 wakeups;
+    _Atomic u64 by_kind[LOOP_NUM_KINDS];
+    struct loop_cb_entry *_Atomic slots[LOOP_STATS_SLOTS];
+    struct loop_cb_entry *_Atomic other;
+};
+
+// Enabled deferrals are linked into the ready list of the loop.
 struct loop_defer {
     struct loop *loop;
     loop_defer_cb cb;
     void *opaque;
     bool enabled;
-    bool freed;
+    struct list node;
+    struct loop_defer *next;
 };
 
+// Expiry times are in ns on the clock of the timer. pending is the number of times the
+// callback still has to be called for the current expiry. Changing the timer resets it.
 struct loop_timer {
-    struct loop_watch watch;
+    struct loop_clock *clock;
     loop_timer_cb cb;
+    void *opaque;
+    u64 expires;
+    u64 interval;
+    u64 pending;
+    size_t idx;
+    struct loop_timer *next;
 };
 
+// All timers of a clock share one timerfd. The armed timers are kept in a min-heap
+// ordered by expiry. armed is the expiry the timerfd has been set to, 0 if none. It is
+// only moved forward when the timerfd fires, so pushing a timer back costs nothing but
+// a spurious wakeup.
+//
+// With io_uring, a timeout replaces the timerfd if it supports the clock. pending is set
+// while the timeout has not completed. The kernel reads ts when the SQE is submitted.
+struct loop_clock {
+    struct loop *loop;
+    int id;
+    struct loop_watch watch;
+    struct loop_timer_vector heap;
+    struct loop_timer_vector expired;
+    u64 armed;
+    bool timeout;
+    bool pending;
+    u32 timeout_flags;
+    struct __kernel_timespec ts;
+};
+
+// Either epfd or uring is used. With io_uring, the fd of the delegator is read into
+// delegator_buf.
 struct loop {
     int epfd;
+    struct uring *uring;
+    struct list polls;
+    u64 delegator_buf;
 
     size_t objs;
 
     struct delegator *delegator;
-    struct loop_defer_vector deferred;
+    struct loop_stats *_Atomic stats;
+    struct list ready;
+    struct loop_clock_vector clocks;
 
+    // Freed objects are only released between iterations, so that callbacks that free
+    // them can still be running.
     struct loop_watch *freed_watches;
-    struct loop_watch *freed_timers;
+    struct loop_timer *freed_timers;
+    struct loop_defer *freed_defers;
 
     bool force_iteration;
     bool running;
@@ -65,37 +175,279 @@ static void loop_collect_garbage(struct loop *loop)
     }
     loop->freed_watches = NULL;
 
-    next = loop->freed_timers;
-    while (next) {
-        auto cur = container_of(next, struct loop_timer, watch);
-        next = next->next;
+    auto timer = loop->freed_timers;
+    while (timer) {
+        auto cur = timer;
+        timer = timer->next;
         free(cur);
         loop->objs--;
     }
     loop->freed_timers = NULL;
 
-    for (size_t i = 0; i < loop->deferred.len; i++) {
-        auto d = loop->deferred.ptr[i];
-        if (d->freed) {
-            free(d);
-            loop->objs--;
-            loop_defer_vector_swap_remove(&loop->deferred, i);
-            i--;
+    auto defer = loop->freed_defers;
+    while (defer) {
+        auto cur = defer;
+        defer = defer->next;
+        free(cur);
+        loop->objs--;
+    }
+    loop->freed_defers = NULL;
+}
+
+// A counter only the loop thread writes. It does not need a read-modify-write.
+static void loop_stat_add(_Atomic u64 *c, u64 val)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + val,
+            memory_order_relaxed);
+}
+
+static u64 loop_stat_get(_Atomic u64 *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static size_t loop_hist_bucket(u64 ns)
+{
+    if (ns < LOOP_HIST_SUB) {
+        return ns;
+    }
+    size_t msb = 63 - (size_t)__builtin_clzll(ns);
+    if (msb >= LOOP_HIST_MAX_BITS) {
+        return LOOP_HIST_BUCKETS - 1;
+    }
+    auto sub = (ns >> (msb - LOOP_HIST_SUB_BITS)) & (LOOP_HIST_SUB - 1);
+    return (msb - LOOP_HIST_SUB_BITS + 1) * LOOP_HIST_SUB + sub;
+}
+
+// The smallest latency of the bucket.
+static u64 loop_hist_value(size_t bucket)
+{
+    if (bucket < LOOP_HIST_SUB) {
+        return bucket;
+    }
+    auto msb = bucket / LOOP_HIST_SUB + LOOP_HIST_SUB_BITS - 1;
+    auto sub = bucket % LOOP_HIST_SUB;
+    return (u64)(LOOP_HIST_SUB + sub) << (msb - LOOP_HIST_SUB_BITS);
+}
+
+static struct loop_cb_entry *loop_stats_entry(struct loop_stats *stats,
+        enum loop_kind kind, uintptr_t cb)
+{
+    auto hash = (size_t)((cb >> 4) * 0x9e3779b97f4a7c15ull);
+    for (size_t i = 0; i < LOOP_STATS_SLOTS; i++) {
+        auto slot = &stats->slots[(hash + i) % LOOP_STATS_SLOTS];
+        auto e = atomic_load_explicit(slot, memory_order_relaxed);
+        if (e && e->cb == cb && e->kind == kind) {
+            return e;
+        }
+        if (!e) {
+            e = xnew0(struct loop_cb_entry);
+            e->kind = kind;
+            e->cb = cb;
+            atomic_store_explicit(slot, e, memory_order_release);
+            return e;
         }
     }
+    auto e = atomic_load_explicit(&stats->other, memory_order_relaxed);
+    if (!e) {
+        e = xnew0(struct loop_cb_entry);
+        e->kind = kind;
+        atomic_store_explicit(&stats->other, e, memory_order_release);
+    }
+    return e;
+}
+
+// Returns 0 if the stats are disabled, so that the callback is not timed.
+static u64 loop_stats_start(struct loop *loop)
+{
+    return loop->stats ? utils_get_mono_time_ns() : 0;
+}
+
+static void loop_stats_record(struct loop *loop, enum loop_kind kind, uintptr_t cb,
+        u64 start)
+{
+    auto stats = atomic_load_explicit(&loop->stats, memory_order_relaxed);
+    if (!stats) {
+        return;
+    }
+    auto ns = utils_get_mono_time_ns() - start;
+    auto e = loop_stats_entry(stats, kind, cb);
+    loop_stat_add(&e->calls, 1);
+    loop_stat_add(&e->total_ns, ns);
+    loop_stat_add(&e->hist[loop_hist_bucket(ns)], 1);
+    if (ns > loop_stat_get(&e->max_ns)) {
+        atomic_store_explicit(&e->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+static void loop_stats_delegate(void (*run)(struct delegate *), u64 start, void *opaque)
+{
+    loop_stats_record(opaque, LOOP_KIND_DELEGATE, (uintptr_t)run, start);
+}
+
+static void loop_stats_free(struct loop_stats *stats)
+{
+    if (!stats) {
+        return;
+    }
+    for (size_t i = 0; i < LOOP_STATS_SLOTS; i++) {
+        free(stats->slots[i]);
+    }
+    free(stats->other);
+    free(stats);
+}
+
+void loop_enable_stats(struct loop *loop)
+{
+    if (loop->stats) {
+        return;
+    }
+    auto stats = xnew0(struct loop_stats);
+    stats->start_ns = utils_get_mono_time_ns();
+    atomic_store_explicit(&loop->stats, stats, memory_order_release);
+    delegator_set_observer(loop->delegator, loop_stats_delegate, loop);
+}
+
+void loop_get_wakeup_stats(struct loop *loop, struct loop_wakeup_stats *s)
+{
+    *s = (struct loop_wakeup_stats) { 0 };
+    auto stats = atomic_load_explicit(&loop->stats, memory_order_acquire);
+    if (!stats) {
+        return;
+    }
+    s->elapsed_ns = utils_get_mono_time_ns() - stats->start_ns;
+    s->wakeups = loop_stat_get(&stats->wakeups);
+    for (size_t i = 0; i < LOOP_NUM_KINDS; i++) {
+        s->by_kind[i] = loop_stat_get(&stats->by_kind[i]);
+    }
+}
+
+static u64 loop_hist_percentile(struct loop_cb_entry *e, u64 calls, double p)
+{
+    auto rank = (u64)(p * (double)calls);
+    u64 seen = 0;
+    for (size_t i = 0; i < LOOP_HIST_BUCKETS; i++) {
+        seen += loop_stat_get(&e->hist[i]);
+        if (seen > rank) {
+            return loop_hist_value(i);
+        }
+    }
+    return loop_stat_get(&e->max_ns);
+}
+
+static void loop_cb_stats_get(struct loop_cb_entry *e, struct loop_cb_stats *s)
+{
+    auto calls = loop_stat_get(&e->calls);
+    *s = (struct loop_cb_stats) {
+        .kind = e->kind,
+        .cb = e->cb,
+        .calls = calls,
+        .total_ns = loop_stat_get(&e->total_ns),
+        .max_ns = loop_stat_get(&e->max_ns),
+        .p50_ns = loop_hist_percentile(e, calls, 0.5),
+        .p99_ns = loop_hist_percentile(e, calls, 0.99),
+        .p999_ns = loop_hist_percentile(e, calls, 0.999),
+    };
+}
+
+size_t loop_get_cb_stats(struct loop *loop, struct loop_cb_stats *s, size_t num)
+{
+    auto stats = atomic_load_explicit(&loop->stats, memory_order_acquire);
+    if (!stats) {
+        return 0;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < LOOP_STATS_SLOTS + 1 && n < num; i++) {
+        auto slot = i < LOOP_STATS_SLOTS ? &stats->slots[i] : &stats->other;
+        auto e = atomic_load_explicit(slot, memory_order_acquire);
+        if (e) {
+            loop_cb_stats_get(e, &s[n++]);
+        }
+    }
+    return n;
+}
+
+static int loop_cb_stats_cmp(const void *a, const void *b)
+{
+    const struct loop_cb_stats *x = a, *y = b;
+    return x->total_ns < y->total_ns ? 1 : x->total_ns > y->total_ns ? -1 : 0;
+}
+
+static void loop_cb_name(uintptr_t cb, char *buf, size_t len)
+{
+    if (cb) {
+        debug_addr_name(cb, buf, len);
+    } else {
+        snprintf(buf, len, "other");
+    }
+}
+
+void loop_dump_stats(struct loop *loop, const char *name, FILE *file)
+{
+    static const char *const kinds[] = { "watch", "timer", "defer", "delegate" };
+
+    struct loop_wakeup_stats w;
+    loop_get_wakeup_stats(loop, &w);
+    if (!w.elapsed_ns) {
+        fprintf(file, "loop %s: stats are disabled\n", name);
+        return;
+    }
+    auto secs = (double)w.elapsed_ns / LOOP_NS_PER_SEC;
+    fprintf(file, "loop %s: %.1f s, %.1f wakeups/s (", name, secs, w.wakeups / secs);
+    for (size_t i = 0; i < LOOP_NUM_KINDS; i++) {
+        fprintf(file, "%s%s %.1f/s", i ? ", " : "", kinds[i], w.by_kind[i] / secs);
+    }
+    fprintf(file, ")\n");
+
+    auto s = xnew_array(struct loop_cb_stats, LOOP_STATS_SLOTS + 1);
+    auto n = loop_get_cb_stats(loop, s, LOOP_STATS_SLOTS + 1);
+    qsort(s, n, sizeof(*s), loop_cb_stats_cmp);
+    for (size_t i = 0; i < n; i++) {
+        char cb[128];
+        loop_cb_name(s[i].cb, cb, sizeof(cb));
+        fprintf(file, "  %-8s %-24s %10"PRIu64" calls, avg %"PRIu64" ns, p50 %"PRIu64
+                " ns, p99 %"PRIu64" ns, p99.9 %"PRIu64" ns, max %"PRIu64" ns\n",
+                kinds[s[i].kind], cb, s[i].calls,
+                s[i].calls ? s[i].total_ns / s[i].calls : 0, s[i].p50_ns, s[i].p99_ns,
+                s[i].p999_ns, s[i].max_ns);
+    }
+    free(s);
 }
 
 void loop_free(struct loop *loop)
 {
-    loop_watch_free(loop->delegator_watch);
+    if (loop->delegator_watch) {
+        loop_watch_free(loop->delegator_watch);
+    }
 
     loop_collect_garbage(loop);
 
-    free(loop->deferred.ptr);
+    for (size_t i = 0; i < loop->clocks.len; i++) {
+        auto c = loop->clocks.ptr[i];
+        auto fd = c->watch.fd;
+        loop_watch_disable(&c->watch);
+        if (fd != -1) {
+            close(fd);
+        }
+        free(c->heap.ptr);
+        free(c->expired.ptr);
+        free(c);
+    }
+    free(loop->clocks.ptr);
 
-    delegator_free(loop->delegator);
+    // Closing the ring cancels the requests that are still pending.
+    if (loop->uring) {
+        uring_free(loop->uring);
+        struct list *node;
+        while ((node = list_pop_first(&loop->polls))) {
+            free(container_of(node, struct loop_poll, node));
+        }
+    } else {
+        close(loop->epfd);
+    }
 
-    close(loop->epfd);
+    delegator_free(loop->delegator);
+    loop_stats_free(loop->stats);
 
     BUG_ON(loop->objs > 0);
 
@@ -112,37 +464,210 @@ static void loop_handle_delegate(struct loop_watch *w, void *opaque, int fd, u32
     delegator_run(loop->delegator);
 }
 
+static u64 loop_user_data(void *ptr, enum loop_tag tag)
+{
+    return (uintptr_t)ptr | tag;
+}
+
+static void *loop_user_data_ptr(u64 user_data)
+{
+    return (void *)(uintptr_t)(user_data & ~(u64)LOOP_TAG_MASK);
+}
+
+// The read completes once a delegate has been queued.
+static void loop_read_delegator(struct loop *loop)
+{
+    auto sqe = uring_get_sqe(loop->uring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = delegator_fd(loop->delegator);
+    sqe->addr = (uintptr_t)&loop->delegator_buf;
+    sqe->len = sizeof(loop->delegator_buf);
+    sqe->off = (u64)-1;
+    sqe->user_data = loop_user_data(loop, LOOP_TAG_DELEGATOR);
+}
+
 struct loop *loop_new(void)
 {
-    int epfd = epoll_create1(EPOLL_CLOEXEC);
-    BUG_ON(epfd == -1);
+    return loop_new_backend(LOOP_BACKEND_EPOLL);
+}
 
+struct loop *loop_new_backend(enum loop_backend backend)
+{
     auto loop = xnew0(struct loop);
-    loop->epfd = epfd;
+    loop->epfd = -1;
+    list_init(&loop->ready);
+    list_init(&loop->polls);
     loop->delegator = delegator_new();
     loop->running = true;
+
+    if (backend == LOOP_BACKEND_URING) {
+        loop->uring = uring_new(LOOP_URING_ENTRIES);
+    }
+    if (loop->uring) {
+        loop_read_delegator(loop);
+        return loop;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    BUG_ON(loop->epfd == -1);
     loop->delegator_watch = loop_watch_new(loop, loop_handle_delegate, loop);
+    loop->delegator_watch->kind = LOOP_KIND_DELEGATE;
 
     loop_watch_set(loop->delegator_watch, delegator_fd(loop->delegator), EPOLLIN);
 
     return loop;
 }
 
+enum loop_backend loop_get_backend(struct loop *loop)
+{
+    return loop->uring ? LOOP_BACKEND_URING : LOOP_BACKEND_EPOLL;
+}
+
+static void loop_watch_dispatch(struct loop_watch *w, u32 events)
+{
+    // Timers and delegates are recorded one by one.
+    if (w->kind != LOOP_KIND_WATCH) {
+        w->cb(w, w->opaque, w->fd, events);
+        return;
+    }
+    auto loop = w->loop;
+    auto cb = w->cb;
+    auto start = loop_stats_start(loop);
+    trace_begin(TRACE_WATCH, (uintptr_t)cb, 0);
+    cb(w, w->opaque, w->fd, events);
+    trace_end(TRACE_WATCH, 0, 0);
+    loop_stats_record(loop, LOOP_KIND_WATCH, (uintptr_t)cb, start);
+}
+
 static void loop_handle_fd(struct epoll_event *event)
 {
     struct loop_watch *w = event->data.ptr;
-    if (w->fd != -1) {
-        w->cb(w, w->opaque, w->fd, event->events);
+    if (w->fd == -1) {
+        return;
+    }
+    loop_watch_dispatch(w, event->events);
+}
+
+static void loop_stats_wakeup(struct loop *loop, const bool *ready)
+{
+    auto stats = atomic_load_explicit(&loop->stats, memory_order_relaxed);
+    if (!stats) {
+        return;
+    }
+    loop_stat_add(&stats->wakeups, 1);
+    for (size_t i = 0; i < LOOP_NUM_KINDS; i++) {
+        if (ready[i]) {
+            loop_stat_add(&stats->by_kind[i], 1);
+        }
     }
 }
 
+// Each deferral is moved back to the ready list before its callback runs. Disabling
+// or freeing a deferral unlinks it from whichever list it is on, so callbacks can change
+// any deferral. Deferrals that are enabled by a callback run in the next iteration.
 static void loop_run_deferred(struct loop *loop)
 {
-    for (size_t i = 0; i < loop->deferred.len; i++) {
-        auto d = loop->deferred.ptr[i];
-        if (d->enabled) {
-            d->cb(d, d->opaque);
+    struct list run;
+    list_init(&run);
+    list_splice(&run, &loop->ready);
+
+    struct list *node;
+    while ((node = list_pop_first(&run))) {
+        auto d = container_of(node, struct loop_defer, node);
+        list_append(&loop->ready, node);
+        auto cb = d->cb;
+        auto start = loop_stats_start(loop);
+        trace_begin(TRACE_DEFER, (uintptr_t)cb, 0);
+        cb(d, d->opaque);
+        trace_end(TRACE_DEFER, 0, 0);
+        loop_stats_record(loop, LOOP_KIND_DEFER, (uintptr_t)cb, start);
+    }
+}
+
+static void loop_arm_clock(struct loop_clock *c);
+static void loop_poll_handle(struct loop_poll *p, const struct io_uring_cqe *cqe);
+static void loop_timeout_handle(struct loop_clock *c, const struct io_uring_cqe *cqe);
+
+static void loop_wait_epoll(struct loop *loop, bool wait)
+{
+    struct epoll_event events[LOOP_EVENTS];
+    auto num = epoll_wait(loop->epfd, events, LOOP_EVENTS, wait ? -1 : 0);
+    if (num == -1) {
+        BUG_ON(errno != EINTR);
+        return;
+    }
+    if (loop->stats && num > 0) {
+        bool ready[LOOP_NUM_KINDS] = { 0 };
+        for (int i = 0; i < num; i++) {
+            struct loop_watch *w = events[i].data.ptr;
+            ready[w->kind] = true;
         }
+        loop_stats_wakeup(loop, ready);
+    }
+    for (int i = 0; i < num; i++) {
+        loop_handle_fd(&events[i]);
+    }
+}
+
+// Returns LOOP_NUM_KINDS for completions that are ignored.
+static enum loop_kind loop_cqe_kind(const struct io_uring_cqe *cqe)
+{
+    switch (cqe->user_data & LOOP_TAG_MASK) {
+    case LOOP_TAG_POLL: {
+        struct loop_poll *p = loop_user_data_ptr(cqe->user_data);
+        return p->watch ? p->watch->kind : LOOP_NUM_KINDS;
+    }
+    case LOOP_TAG_CLOCK:
+        return LOOP_KIND_TIMER;
+    case LOOP_TAG_DELEGATOR:
+        return LOOP_KIND_DELEGATE;
+    default:
+        return LOOP_NUM_KINDS;
+    }
+}
+
+static void loop_handle_cqe(struct loop *loop, const struct io_uring_cqe *cqe)
+{
+    void *ptr = loop_user_data_ptr(cqe->user_data);
+    switch (cqe->user_data & LOOP_TAG_MASK) {
+    case LOOP_TAG_POLL:
+        loop_poll_handle(ptr, cqe);
+        break;
+    case LOOP_TAG_CLOCK:
+        loop_timeout_handle(ptr, cqe);
+        break;
+    case LOOP_TAG_DELEGATOR:
+        BUG_ON(cqe->res != sizeof(loop->delegator_buf));
+        loop_read_delegator(loop);
+        delegator_run_cleared(loop->delegator);
+        break;
+    default:
+        // The poll that is removed or the timeout that is updated may have completed
+        // already.
+        BUG_ON(cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EALREADY);
+        break;
+    }
+}
+
+// The SQEs that have been queued since the last iteration are submitted with the wait.
+static void loop_wait_uring(struct loop *loop, bool wait)
+{
+    uring_enter(loop->uring, wait);
+
+    struct io_uring_cqe cqes[LOOP_EVENTS];
+    auto num = uring_pop_cqes(loop->uring, cqes, LOOP_EVENTS);
+    if (loop->stats) {
+        bool ready[LOOP_NUM_KINDS + 1] = { 0 };
+        for (size_t i = 0; i < num; i++) {
+            ready[loop_cqe_kind(&cqes[i])] = true;
+        }
+        // Completions that are ignored do not count as a wakeup.
+        if (memchr(ready, true, LOOP_NUM_KINDS)) {
+            loop_stats_wakeup(loop, ready);
+        }
+    }
+    for (size_t i = 0; i < num; i++) {
+        loop_handle_cqe(loop, &cqes[i]);
     }
 }
 
@@ -151,18 +676,17 @@ int loop_run(struct loop *loop)
     while (loop->running) {
         loop_run_deferred(loop);
         loop_collect_garbage(loop);
+        for (size_t i = 0; i < loop->clocks.len; i++) {
+            loop_arm_clock(loop->clocks.ptr[i]);
+        }
 
-        int timeout = loop->force_iteration ? 0 : -1;
+        bool wait = !loop->force_iteration;
         loop->force_iteration = false;
 
-        struct epoll_event events[10];
-        ssize_t num = epoll_wait(loop->epfd, events, N_ELEMENTS(events), timeout);
-        if (num == -1) {
-            BUG_ON(errno != EINTR);
-            continue;
-        }
-        for (size_t i = 0; i < (size_t)num; i++) {
-            loop_handle_fd(&events[i]);
+        if (loop->uring) {
+            loop_wait_uring(loop, wait);
+        } else {
+            loop_wait_epoll(loop, wait);
         }
     }
 
@@ -190,6 +714,11 @@ void loop_delegate_sync(struct loop *loop, struct delegate *d)
     delegator_delegate_sync(loop->delegator, d);
 }
 
+void loop_get_delegate_stats(struct loop *loop, struct delegator_stats *s)
+{
+    delegator_get_stats(loop->delegator, s);
+}
+
 static void loop_watch_init(struct loop_watch *w, struct loop *loop, loop_watch_cb cb,
         void *opaque)
 {
@@ -197,6 +726,7 @@ static void loop_watch_init(struct loop_watch *w, struct loop *loop, loop_watch_
     w->fd = -1;
     w->cb = cb;
     w->opaque = opaque;
+    w->kind = LOOP_KIND_WATCH;
 }
 
 struct loop_watch *loop_watch_new(struct loop *loop, loop_watch_cb cb, void *opaque)
@@ -207,8 +737,88 @@ struct loop_watch *loop_watch_new(struct loop *loop, loop_watch_cb cb, void *opa
     return watch;
 }
 
+static void loop_poll_submit(struct loop_poll *p)
+{
+    auto w = p->watch;
+    auto sqe = uring_get_sqe(w->loop->uring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->fd;
+    sqe->poll32_events = w->events & ~(u32)EPOLLET;
+    // A multishot poll only completes again once the fd becomes ready again.
+    if (w->events & EPOLLET) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+    sqe->user_data = loop_user_data(p, LOOP_TAG_POLL);
+    p->busy = true;
+}
+
+// A request that is not busy is the one whose completion is being handled, which frees
+// it.
+static void loop_poll_detach(struct loop_watch *w)
+{
+    auto p = w->poll;
+    if (!p) {
+        return;
+    }
+    w->poll = NULL;
+    p->watch = NULL;
+    if (p->busy) {
+        auto sqe = uring_get_sqe(w->loop->uring);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = loop_user_data(p, LOOP_TAG_POLL);
+    }
+}
+
+static void loop_poll_set(struct loop_watch *w, int fd, u32 events)
+{
+    if (w->poll && w->fd == fd && w->events == events) {
+        return;
+    }
+    loop_poll_detach(w);
+    w->fd = fd;
+    w->events = events;
+    if (fd == -1) {
+        return;
+    }
+    auto p = xnew0(struct loop_poll);
+    p->watch = w;
+    list_append(&w->loop->polls, &p->node);
+    w->poll = p;
+    loop_poll_submit(p);
+}
+
+// One-shot polls, and multishot polls the kernel has ended, are submitted again after
+// the callback, so level-triggered watches fire for as long as the fd is ready.
+static void loop_poll_handle(struct loop_poll *p, const struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        p->busy = false;
+    }
+    auto w = p->watch;
+    if (w && cqe->res >= 0) {
+        loop_watch_dispatch(w, (u32)cqe->res);
+    } else if (w) {
+        BUG_ON(cqe->res != -ECANCELED);
+    }
+    if (p->busy) {
+        return;
+    }
+    if (p->watch) {
+        loop_poll_submit(p);
+    } else {
+        list_remove(&p->node);
+        free(p);
+    }
+}
+
 void loop_watch_set(struct loop_watch *w, int fd, u32 events)
 {
+    if (w->loop->uring) {
+        loop_poll_set(w, fd, events);
+        return;
+    }
+
     struct epoll_event e = { .data.ptr = w, .events = events };
 
     if (w->fd != fd) {
@@ -221,10 +831,16 @@ void loop_watch_set(struct loop_watch *w, int fd, u32 events)
     }
 
     w->fd = fd;
+    w->events = events;
 }
 
 void loop_watch_disable(struct loop_watch *w)
 {
+    if (w->loop->uring) {
+        loop_poll_detach(w);
+        w->fd = -1;
+        return;
+    }
     if (w->fd != -1) {
         BUG_ON(epoll_ctl(w->loop->epfd, EPOLL_CTL_DEL, w->fd, NULL));
         w->fd = -1;
@@ -244,60 +860,282 @@ struct loop_defer *loop_defer_new(struct loop *loop, loop_defer_cb cb, void *opa
     d->loop = loop;
     d->cb = cb;
     d->opaque = opaque;
-    d->enabled = true;
-    loop_defer_vector_push(&loop->deferred, d);
     loop->objs++;
+    loop_defer_set(d, true);
     return d;
 }
 
 void loop_defer_set(struct loop_defer *defer, bool enabled)
 {
+    if (enabled == defer->enabled) {
+        return;
+    }
+    if (enabled) {
+        list_append(&defer->loop->ready, &defer->node);
+    } else {
+        list_remove(&defer->node);
+    }
     defer->enabled = enabled;
 }
 
 void loop_defer_free(struct loop_defer *defer)
 {
-    defer->enabled = false;
-    defer->freed = true;
+    loop_defer_set(defer, false);
+    defer->next = defer->loop->freed_defers;
+    defer->loop->freed_defers = defer;
 }
 
-static void loop_timer_handle(struct loop_watch *w, void *opaque, int fd, u32 event)
+static u64 loop_ts_to_ns(const struct timespec *ts)
 {
-    (void)event;
+    return (u64)ts->tv_sec * LOOP_NS_PER_SEC + (u64)ts->tv_nsec;
+}
 
-    auto timer = container_of(w, struct loop_timer, watch);
+static u64 loop_clock_now(struct loop_clock *c)
+{
+    struct timespec ts;
+    BUG_ON(clock_gettime(c->id, &ts));
+    return loop_ts_to_ns(&ts);
+}
+
+static void loop_heap_place(struct loop_clock *c, struct loop_timer *t, size_t idx)
+{
+    c->heap.ptr[idx] = t;
+    t->idx = idx;
+}
+
+static void loop_heap_sift_up(struct loop_clock *c, size_t idx)
+{
+    auto t = c->heap.ptr[idx];
+    while (idx > 0) {
+        auto parent = (idx - 1) / 2;
+        if (c->heap.ptr[parent]->expires <= t->expires) {
+            break;
+        }
+        loop_heap_place(c, c->heap.ptr[parent], idx);
+        idx = parent;
+    }
+    loop_heap_place(c, t, idx);
+}
+
+static void loop_heap_sift_down(struct loop_clock *c, size_t idx)
+{
+    auto t = c->heap.ptr[idx];
+    while (1) {
+        auto child = 2 * idx + 1;
+        if (child >= c->heap.len) {
+            break;
+        }
+        if (child + 1 < c->heap.len &&
+                c->heap.ptr[child + 1]->expires < c->heap.ptr[child]->expires) {
+            child++;
+        }
+        if (t->expires <= c->heap.ptr[child]->expires) {
+            break;
+        }
+        loop_heap_place(c, c->heap.ptr[child], idx);
+        idx = child;
+    }
+    loop_heap_place(c, t, idx);
+}
+
+static void loop_heap_update(struct loop_clock *c, struct loop_timer *t)
+{
+    if (t->idx == LOOP_TIMER_IDLE) {
+        t->idx = c->heap.len;
+        loop_timer_vector_push(&c->heap, t);
+    }
+    loop_heap_sift_up(c, t->idx);
+    loop_heap_sift_down(c, t->idx);
+}
+
+static void loop_heap_remove(struct loop_clock *c, struct loop_timer *t)
+{
+    if (t->idx == LOOP_TIMER_IDLE) {
+        return;
+    }
+    auto idx = t->idx;
+    auto last = c->heap.ptr[--c->heap.len];
+    t->idx = LOOP_TIMER_IDLE;
+    if (last != t) {
+        loop_heap_place(c, last, idx);
+        loop_heap_sift_up(c, idx);
+        loop_heap_sift_down(c, last->idx);
+    }
+}
+
+// A pending timeout is updated in place. If it has completed in the meantime, the update
+// fails and the completion clears armed, so the clock is armed again.
+static void loop_arm_timeout(struct loop_clock *c, u64 expires)
+{
+    c->ts = (struct __kernel_timespec) {
+        .tv_sec = (i64)(expires / LOOP_NS_PER_SEC),
+        .tv_nsec = (long long)(expires % LOOP_NS_PER_SEC),
+    };
+    auto sqe = uring_get_sqe(c->loop->uring);
+    if (c->pending) {
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = loop_user_data(c, LOOP_TAG_CLOCK);
+        sqe->addr2 = (uintptr_t)&c->ts;
+        sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&c->ts;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS | c->timeout_flags;
+    sqe->user_data = loop_user_data(c, LOOP_TAG_CLOCK);
+    c->pending = true;
+}
+
+// Called before the loop waits, so a timer that is set several times per iteration
+// costs at most one system call, or one SQE with io_uring.
+static void loop_arm_clock(struct loop_clock *c)
+{
+    if (c->heap.len == 0) {
+        return;
+    }
+    auto next = c->heap.ptr[0]->expires;
+    if (c->armed && c->armed <= next) {
+        return;
+    }
+    if (c->timeout) {
+        loop_arm_timeout(c, next);
+    } else {
+        struct itimerspec ts = {
+            .it_value = {
+                .tv_sec = (time_t)(next / LOOP_NS_PER_SEC),
+                .tv_nsec = (long)(next % LOOP_NS_PER_SEC),
+            },
+        };
+        BUG_ON(timerfd_settime(c->watch.fd, TFD_TIMER_ABSTIME, &ts, NULL));
+    }
+    c->armed = next;
+}
+
+// The expired timers are taken out of the heap before any callback runs. Callbacks can
+// change any timer and a timer that is set to a time that has already passed fires in
+// the next iteration.
+static void loop_clock_expire(struct loop_clock *c)
+{
+    c->armed = 0;
+
+    auto now = loop_clock_now(c);
+    c->expired.len = 0;
+    while (c->heap.len > 0 && c->heap.ptr[0]->expires <= now) {
+        auto t = c->heap.ptr[0];
+        t->pending = 1;
+        if (t->interval) {
+            t->pending += (now - t->expires) / t->interval;
+            t->expires += t->pending * t->interval;
+            loop_heap_sift_down(c, 0);
+        } else {
+            loop_heap_remove(c, t);
+        }
+        loop_timer_vector_push(&c->expired, t);
+    }
+
+    for (size_t i = 0; i < c->expired.len; i++) {
+        auto t = c->expired.ptr[i];
+        while (t->pending > 0) {
+            t->pending--;
+            auto cb = t->cb;
+            auto start = loop_stats_start(c->loop);
+            trace_begin(TRACE_TIMER, (uintptr_t)cb, 0);
+            cb(t, t->opaque);
+            trace_end(TRACE_TIMER, 0, 0);
+            loop_stats_record(c->loop, LOOP_KIND_TIMER, (uintptr_t)cb, start);
+        }
+    }
+}
+
+static void loop_clock_handle(struct loop_watch *w, void *opaque, int fd, u32 event)
+{
+    (void)w;
+    (void)event;
 
     u64 exp;
     if (read(fd, &exp, sizeof(exp)) == -1) {
         BUG_ON(errno != EAGAIN);
         return;
     }
+    loop_clock_expire(opaque);
+}
 
-    for (u64 i = 0; i < exp; i++) {
-        timer->cb(timer, opaque);
+static void loop_timeout_handle(struct loop_clock *c, const struct io_uring_cqe *cqe)
+{
+    BUG_ON(cqe->res != -ETIME);
+    c->pending = false;
+    loop_clock_expire(c);
+}
+
+// The clocks io_uring timeouts support.
+static bool loop_timeout_clock(int id, u32 *flags)
+{
+    switch (id) {
+    case CLOCK_MONOTONIC:
+        *flags = 0;
+        return true;
+    case CLOCK_REALTIME:
+        *flags = IORING_TIMEOUT_REALTIME;
+        return true;
+    case CLOCK_BOOTTIME:
+        *flags = IORING_TIMEOUT_BOOTTIME;
+        return true;
+    default:
+        return false;
     }
 }
 
+static struct loop_clock *loop_get_clock(struct loop *loop, int id)
+{
+    for (size_t i = 0; i < loop->clocks.len; i++) {
+        if (loop->clocks.ptr[i]->id == id) {
+            return loop->clocks.ptr[i];
+        }
+    }
+
+    auto c = xnew0(struct loop_clock);
+    c->loop = loop;
+    c->id = id;
+    loop_watch_init(&c->watch, loop, loop_clock_handle, c);
+    c->watch.kind = LOOP_KIND_TIMER;
+    c->timeout = loop->uring && loop_timeout_clock(id, &c->timeout_flags);
+    if (!c->timeout) {
+        int fd = timerfd_create(id, TFD_NONBLOCK | TFD_CLOEXEC);
+        BUG_ON(fd == -1);
+        loop_watch_set(&c->watch, fd, EPOLLIN);
+    }
+    loop_clock_vector_push(&loop->clocks, c);
+    return c;
+}
+
 struct loop_timer *loop_timer_new(struct loop *loop, loop_timer_cb cb, int clock,
         void *opaque)
 {
-    int fd = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
-    BUG_ON(fd == -1);
-
     auto t = xnew0(struct loop_timer);
-
-    loop_watch_init(&t->watch, loop, loop_timer_handle, opaque);
+    t->clock = loop_get_clock(loop, clock);
     t->cb = cb;
-
-    loop_watch_set(&t->watch, fd, EPOLLIN);
+    t->opaque = opaque;
+    t->idx = LOOP_TIMER_IDLE;
 
     loop->objs++;
     return t;
 }
 
+// Has the semantics of timerfd_settime. A zero it_value disarms the timer.
 void loop_timer_set(struct loop_timer *timer, const struct itimerspec *ts, bool abs)
 {
-    BUG_ON(timerfd_settime(timer->watch.fd, abs ? TFD_TIMER_ABSTIME : 0, ts, NULL));
+    auto c = timer->clock;
+    auto value = loop_ts_to_ns(&ts->it_value);
+    timer->pending = 0;
+    if (value == 0) {
+        loop_heap_remove(c, timer);
+        return;
+    }
+    timer->expires = abs ? value : loop_clock_now(c) + value;
+    timer->interval = loop_ts_to_ns(&ts->it_interval);
+    loop_heap_update(c, timer);
 }
 
 void loop_timer_disable(struct loop_timer *timer)
@@ -308,10 +1146,10 @@ void loop_timer_disable(struct loop_timer *timer)
 
 void loop_timer_free(struct loop_timer *timer)
 {
-    close(timer->watch.fd);
-    timer->watch.fd = -1;
-    timer->watch.next = timer->watch.loop->freed_timers;
-    timer->watch.loop->freed_timers = &timer->watch;
+    loop_timer_disable(timer);
+    auto loop = timer->clock->loop;
+    timer->next = loop->freed_timers;
+    loop->freed_timers = timer;
 }
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,82 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "utils/utils.h"
+#include "utils/metadata.h"
+#include "utils/xmalloc.h"
+
+const char *metadata_get(const struct metadata *md, enum metadata_key key)
+{
+    for (auto p = md->pairs; p->key != METADATA_INVALID; p++) {
+        if (p->key == key)
+            return p->val;
+    }
+    return NULL;
+}
+
+static char *metadata_find(struct metadata *md, enum metadata_key key)
+{
+    return discard_const(metadata_get(md, key), char);
+}
+
+static i32 metadata_year(const char *date)
+{
+    i32 year = 0;
+    for (size_t i = 0; date && i < 4; i++) {
+        if (date[i] < '0' || date[i] > '9')
+            return 0;
+        year = 10 * year + date[i] - '0';
+    }
+    return year;
+}
+
+// The pairs and the strings live in the same allocation as the object.
+struct metadata *metadata_new(char *const tags[static METADATA_NUM_TAGS])
+{
+    size_t num = 0, bytes = 0;
+    for (size_t i = 0; i < METADATA_NUM_TAGS; i++) {
+        if (tags[i]) {
+            num++;
+            bytes += strlen(tags[i]) + 1;
+        }
+    }
+
+    auto size = sizeof(struct metadata) + (num + 1) * sizeof(struct metadata_pair) +
+        bytes;
+    struct metadata *md = (void *)xnew_array(u8, size);
+    md->refcount = 1;
+
+    auto str = (char *)&md->pairs[num + 1];
+    size_t n = 0;
+    for (size_t i = 0; i < METADATA_NUM_TAGS; i++) {
+        if (!tags[i])
+            continue;
+        auto len = strlen(tags[i]) + 1;
+        memcpy(str, tags[i], len);
+        md->pairs[n++] = (struct metadata_pair) { (enum metadata_key)i, str };
+        str += len;
+    }
+    md->pairs[n] = (struct metadata_pair) { METADATA_INVALID, NULL };
+
+    md->artist = metadata_find(md, METADATA_ARTIST);
+    md->albumartist = metadata_find(md, METADATA_ALBUMARTIST);
+    md->title = metadata_find(md, METADATA_TITLE);
+    md->album = metadata_find(md, METADATA_ALBUM);
+    md->genre = metadata_find(md, METADATA_GENRE);
+    md->year = metadata_year(metadata_find(md, METADATA_DATE));
+    return md;
+}
+
+struct metadata *metadata_ref(struct metadata *md)
+{
+    md->refcount++;
+    return md;
+}
+
+void metadata_unref(struct metadata *md)
+{
+    if (--md->refcount == 0)
+        free(md);
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
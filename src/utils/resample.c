@@ -0,0 +1,367 @@
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define RESAMPLE_X86 1
+#endif
+
+#include "utils/utils.h"
+#include "utils/resample.h"
+#include "utils/thread.h"
+#include "utils/xmalloc.h"
+
+// Filter rows are padded with zeros to a multiple of this many taps so that the dot
+// product kernels never need a scalar tail.
+#define RESAMPLE_TAP_ALIGN 8
+#define RESAMPLE_MIN_CAP 4096
+// Ratios of unusual rates such as 44056 to 48000 have tens of thousands of phases. Their
+// rows are interpolated from a table of at most this many instead.
+#define RESAMPLE_MAX_ROWS 512
+
+struct resample_tier {
+    u32 taps;
+    double rolloff;
+    double beta;
+};
+
+static const struct resample_tier resample_tiers[] = {
+    [RESAMPLE_FAST] = { 2, 1.0, 0.0 },
+    [RESAMPLE_MEDIUM] = { 16, 0.85, 6.0 },
+    [RESAMPLE_HIGH] = { 64, 0.94, 9.0 },
+};
+
+// Output frame k is computed at input position k * step / phases. If rows equals phases,
+// the filter row for the fractional part of that position is stored at
+// coefs + phase * stride. Otherwise coefs holds rows + 1 rows for the fractions i / rows
+// and the row of a phase is interpolated between the two nearest ones into row.
+struct resampler {
+    u32 in_rate;
+    u32 channels;
+    u32 phases;
+    u32 step;
+    u32 taps;
+    u32 stride;
+    u32 half;
+    u32 rows;
+    float *coefs;
+    float *row;
+
+    // Deinterleaved input. Channel c starts at hist + c * (cap + stride).
+    float *hist;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    u32 phase;
+
+    // Output frames left to drain, they are centered on the input that was pushed.
+    bool draining;
+    u64 drain_left;
+};
+
+typedef float (*resample_dot_fn)(const float *a, const float *b, size_t n);
+
+static pthread_once_t resample_once = PTHREAD_ONCE_INIT;
+static resample_dot_fn resample_dot;
+
+static float resample_dot_scalar(const float *a, const float *b, size_t n)
+{
+    float sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+#ifdef RESAMPLE_X86
+
+__attribute__((target("sse")))
+static float resample_dot_sse(const float *a, const float *b, size_t n)
+{
+    auto s0 = _mm_setzero_ps();
+    auto s1 = _mm_setzero_ps();
+    for (size_t i = 0; i < n; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    s0 = _mm_add_ps(s0, s1);
+    s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+    s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+    return _mm_cvtss_f32(s0);
+}
+
+__attribute__((target("avx")))
+static float resample_dot_avx(const float *a, const float *b, size_t n)
+{
+    auto s = _mm256_setzero_ps();
+    for (size_t i = 0; i < n; i += 8) {
+        auto p = _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        s = _mm256_add_ps(s, p);
+    }
+    auto r = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    r = _mm_add_ps(r, _mm_movehl_ps(r, r));
+    r = _mm_add_ss(r, _mm_shuffle_ps(r, r, 1));
+    return _mm_cvtss_f32(r);
+}
+
+#endif
+
+static void resample_init(void)
+{
+    resample_dot = resample_dot_scalar;
+#ifdef RESAMPLE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx"))
+        resample_dot = resample_dot_avx;
+    else if (__builtin_cpu_supports("sse"))
+        resample_dot = resample_dot_sse;
+#endif
+}
+
+static u32 resample_gcd(u32 a, u32 b)
+{
+    while (b) {
+        auto t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static double resample_bessel_i0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static double resample_kernel(const struct resample_tier *tier, double fc, double t)
+{
+    if (tier->taps == 2)
+        return fabs(t) < 1 ? 1 - fabs(t) : 0;
+
+    auto x = t / (tier->taps / 2);
+    if (fabs(x) > 1)
+        return 0;
+    auto window = resample_bessel_i0(tier->beta * sqrt(1 - x * x)) /
+        resample_bessel_i0(tier->beta);
+    auto arg = 2 * fc * t;
+    auto sinc = fabs(arg) < 1e-9 ? 1 : sin(M_PI * arg) / (M_PI * arg);
+    return sinc * window;
+}
+
+static void resample_compute_coefs(struct resampler *r, const struct resample_tier *tier)
+{
+    // Cutoff in cycles per input sample. When downsampling it has to be below the
+    // nyquist frequency of the output.
+    auto fc = 0.5 * tier->rolloff * min(1.0, (double)r->phases / r->step);
+
+    auto rows = r->rows == r->phases ? r->rows : r->rows + 1;
+    r->coefs = xnew_array(float, (size_t)rows * r->stride);
+    for (u32 p = 0; p < rows; p++) {
+        auto row = r->coefs + (size_t)p * r->stride;
+        auto frac = (double)p / r->rows;
+        double sum = 0;
+        for (u32 j = 0; j < r->taps; j++) {
+            auto v = resample_kernel(tier, fc, (double)j - r->half - frac);
+            row[j] = (float)v;
+            sum += v;
+        }
+        for (u32 j = 0; j < r->taps; j++)
+            row[j] = (float)(row[j] / sum);
+        for (u32 j = r->taps; j < r->stride; j++)
+            row[j] = 0;
+    }
+}
+
+static size_t resample_channel_size(const struct resampler *r)
+{
+    return r->cap + r->stride;
+}
+
+static float *resample_channel(const struct resampler *r, u32 c)
+{
+    return r->hist + c * resample_channel_size(r);
+}
+
+struct resampler *resampler_new(u32 in_rate, u32 out_rate, u32 channels,
+        enum resample_quality q)
+{
+    BUG_ON(in_rate == 0 || out_rate == 0 || channels == 0);
+
+    thread_once(&resample_once, resample_init);
+
+    auto tier = &resample_tiers[q];
+    auto gcd = resample_gcd(in_rate, out_rate);
+
+    auto r = xnew0(struct resampler);
+    r->in_rate = in_rate;
+    r->channels = channels;
+    r->phases = out_rate / gcd;
+    r->step = in_rate / gcd;
+    r->taps = tier->taps;
+    r->stride = (tier->taps + RESAMPLE_TAP_ALIGN - 1) / RESAMPLE_TAP_ALIGN *
+        RESAMPLE_TAP_ALIGN;
+    r->half = tier->taps / 2 - 1;
+    r->rows = min(r->phases, (u32)RESAMPLE_MAX_ROWS);
+    if (r->rows < r->phases)
+        r->row = xnew_array(float, r->stride);
+    r->cap = RESAMPLE_MIN_CAP;
+    r->hist = xnew_array(float, channels * resample_channel_size(r));
+    memset(r->hist, 0, sizeof(float) * channels * resample_channel_size(r));
+
+    resample_compute_coefs(r, tier);
+    resampler_reset(r);
+
+    return r;
+}
+
+void resampler_free(struct resampler *r)
+{
+    free(r->coefs);
+    free(r->row);
+    free(r->hist);
+    free(r);
+}
+
+void resampler_reset(struct resampler *r)
+{
+    // The first output frame is centered on the first input frame.
+    for (u32 c = 0; c < r->channels; c++)
+        memset(resample_channel(r, c), 0, sizeof(float) * r->half);
+    r->len = r->half;
+    r->pos = 0;
+    r->phase = 0;
+    r->draining = false;
+    r->drain_left = 0;
+}
+
+u32 resampler_in_rate(const struct resampler *r)
+{
+    return r->in_rate;
+}
+
+u32 resampler_channels(const struct resampler *r)
+{
+    return r->channels;
+}
+
+size_t resampler_needed(const struct resampler *r, size_t frames)
+{
+    if (frames == 0)
+        return 0;
+    auto last = r->pos + (r->phase + (u64)(frames - 1) * r->step) / r->phases;
+    auto end = last + r->taps;
+    return end > r->len ? end - r->len : 0;
+}
+
+static void resample_make_room(struct resampler *r, size_t frames)
+{
+    auto keep = r->len - r->pos;
+    for (u32 c = 0; c < r->channels; c++) {
+        auto ch = resample_channel(r, c);
+        memmove(ch, ch + r->pos, sizeof(float) * keep);
+    }
+    r->len = keep;
+    r->pos = 0;
+
+    if (keep + frames <= r->cap)
+        return;
+
+    auto old = *r;
+    r->cap = max(2 * r->cap, keep + frames);
+    auto size = r->channels * resample_channel_size(r);
+    r->hist = xnew_array(float, size);
+    memset(r->hist, 0, sizeof(float) * size);
+    for (u32 c = 0; c < r->channels; c++)
+        memcpy(resample_channel(r, c), resample_channel(&old, c), sizeof(float) * keep);
+    free(old.hist);
+}
+
+void resampler_push(struct resampler *r, const float *in, size_t frames)
+{
+    BUG_ON(r->draining);
+
+    if (r->len + frames > r->cap)
+        resample_make_room(r, frames);
+
+    for (u32 c = 0; c < r->channels; c++) {
+        auto ch = resample_channel(r, c) + r->len;
+        for (size_t i = 0; i < frames; i++)
+            ch[i] = in[i * r->channels + c];
+    }
+    r->len += frames;
+}
+
+static const float *resample_row(struct resampler *r)
+{
+    if (r->rows == r->phases)
+        return r->coefs + (size_t)r->phase * r->stride;
+
+    auto x = (u64)r->phase * r->rows;
+    auto a = r->coefs + x / r->phases * r->stride;
+    auto b = a + r->stride;
+    auto w = (float)(x % r->phases) / (float)r->phases;
+    for (u32 j = 0; j < r->stride; j++)
+        r->row[j] = a[j] + w * (b[j] - a[j]);
+    return r->row;
+}
+
+size_t resampler_pull(struct resampler *r, float *out, size_t frames)
+{
+    size_t n = 0;
+    for (; n < frames && r->pos + r->taps <= r->len; n++) {
+        auto row = resample_row(r);
+        for (u32 c = 0; c < r->channels; c++) {
+            auto ch = resample_channel(r, c) + r->pos;
+            out[n * r->channels + c] = resample_dot(row, ch, r->stride);
+        }
+        r->phase += r->step;
+        r->pos += r->phase / r->phases;
+        r->phase %= r->phases;
+    }
+    return n;
+}
+
+static void resample_push_silence(struct resampler *r, size_t frames)
+{
+    if (r->len + frames > r->cap)
+        resample_make_room(r, frames);
+
+    for (u32 c = 0; c < r->channels; c++)
+        memset(resample_channel(r, c) + r->len, 0, sizeof(float) * frames);
+    r->len += frames;
+}
+
+size_t resampler_drain(struct resampler *r, float *out, size_t frames)
+{
+    if (!r->draining) {
+        // Output frame k is centered on input position pos + half + phase / phases.
+        // Every frame centered before the end of the input is still owed, and each
+        // of them needs taps - 1 - half frames after its center.
+        auto end = (u64)r->len * r->phases;
+        auto first = (u64)(r->pos + r->half) * r->phases + r->phase;
+        r->drain_left = end > first ? (end - first + r->step - 1) / r->step : 0;
+        r->draining = true;
+        resample_push_silence(r, r->taps - 1 - r->half);
+    }
+
+    auto n = resampler_pull(r, out, min((u64)frames, r->drain_left));
+    r->drain_left -= n;
+    return n;
+}
+
+bool resampler_draining(const struct resampler *r)
+{
+    return r->draining;
+}
+
+bool resampler_drained(const struct resampler *r)
+{
+    return r->draining && r->drain_left == 0;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,101 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "utils/utils.h"
+#include "utils/ring.h"
+#include "utils/xmalloc.h"
+
+#define RING_CACHE_LINE 64
+
+// head and tail only ever grow. Their difference is the number of readable bytes.
+struct ring {
+    _Atomic u64 head;
+    u8 pad1[RING_CACHE_LINE - sizeof(u64)];
+    _Atomic u64 tail;
+    u8 pad2[RING_CACHE_LINE - sizeof(u64)];
+    size_t size;
+    u8 *buf;
+};
+
+struct ring *ring_new(size_t size)
+{
+    BUG_ON(size == 0);
+
+    auto r = xnew0(struct ring);
+    r->size = size;
+    r->buf = xnew_array(u8, size);
+    return r;
+}
+
+void ring_free(struct ring *r)
+{
+    free(r->buf);
+    free(r);
+}
+
+void ring_reset(struct ring *r)
+{
+    atomic_store(&r->head, 0);
+    atomic_store(&r->tail, 0);
+}
+
+size_t ring_size(const struct ring *r)
+{
+    return r->size;
+}
+
+size_t ring_fill(const struct ring *r)
+{
+    auto tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    auto head = atomic_load_explicit(&r->head, memory_order_acquire);
+    return (size_t)(tail - head);
+}
+
+u8 *ring_write_buf(struct ring *r, size_t *len)
+{
+    auto tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    auto head = atomic_load_explicit(&r->head, memory_order_acquire);
+    auto off = (size_t)(tail % r->size);
+    auto space = r->size - (size_t)(tail - head);
+    *len = min(space, r->size - off);
+    return r->buf + off;
+}
+
+void ring_write_commit(struct ring *r, size_t len)
+{
+    auto tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+}
+
+u8 *ring_read_buf(struct ring *r, size_t *len)
+{
+    auto head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    auto tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    auto off = (size_t)(head % r->size);
+    *len = min((size_t)(tail - head), r->size - off);
+    return r->buf + off;
+}
+
+void ring_read_commit(struct ring *r, size_t len)
+{
+    auto head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+}
+
+size_t ring_read(struct ring *r, u8 *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        size_t avail;
+        auto src = ring_read_buf(r, &avail);
+        if (avail == 0)
+            break;
+        avail = min(avail, len - done);
+        memcpy(buf + done, src, avail);
+        ring_read_commit(r, avail);
+        done += avail;
+    }
+    return done;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -0,0 +1,33 @@
+#include <stdatomic.h>
+
+#include "utils/utils.h"
+#include "utils/seqlock.h"
+
+void seqlock_write_begin(struct seqlock *l)
+{
+    auto seq = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    atomic_store_explicit(&l->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void seqlock_write_end(struct seqlock *l)
+{
+    auto seq = atomic_load_explicit(&l->seq, memory_order_relaxed);
+    atomic_store_explicit(&l->seq, seq + 1, memory_order_release);
+}
+
+u32 seqlock_read_begin(struct seqlock *l)
+{
+    u32 seq;
+    while ((seq = atomic_load_explicit(&l->seq, memory_order_acquire)) & 1)
+        ;
+    return seq;
+}
+
+bool seqlock_read_retry(struct seqlock *l, u32 seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&l->seq, memory_order_relaxed) != seq;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -44,6 +44,11 @@ void thread_cond_signal(pthread_cond_t *cond)
     thread_test(pthread_cond_signal(cond));
 }
 
+void thread_cond_broadcast(pthread_cond_t *cond)
+{
+    thread_test(pthread_cond_broadcast(cond));
+}
+
 void thread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
     thread_test(pthread_cond_wait(cond, mutex));
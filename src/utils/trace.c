@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "utils/trace.h"
+#include "utils/utils.h"
+#include "utils/thread.h"
+#include "utils/xmalloc.h"
+#include "utils/debug.h"
+
+// 2 MiB per thread. The pages are only touched as the events are recorded.
+#define TRACE_RING_EVENTS (1 << 16)
+// Once this many rings exist, new threads take over the ring of an exited thread.
+#define TRACE_MAX_RINGS 64
+
+// info holds the id and the phase. The fields are only accessed with relaxed atomic
+// operations, the head of the ring tells readers which events are valid.
+struct trace_event {
+    _Atomic u64 ts_ns;
+    _Atomic u64 info;
+    _Atomic u64 args[2];
+};
+
+struct trace_snapshot_event {
+    u64 ts_ns;
+    u64 info;
+    u64 args[2];
+};
+
+// Only the owner writes head and the events. The other fields are protected by
+// trace_mutex. Events before start were recorded by the previous owner.
+struct trace_ring {
+    _Atomic u64 head;
+    u64 start;
+    u64 exited; // 0 while the owner runs, otherwise the order in which it exited
+    int tid;
+    char name[32];
+    struct trace_event events[TRACE_RING_EVENTS];
+};
+
+struct trace_snapshot {
+    int tid;
+    char name[32];
+    struct trace_snapshot_event *events;
+    size_t num;
+};
+
+struct trace_desc {
+    const char *name;
+    const char *cat;
+    // The names of the arguments of the begin or instant event and of the end event.
+    const char *args[2][2];
+    // The first argument of the begin event is a function.
+    bool fn;
+};
+
+static const struct trace_desc trace_descs[TRACE_NUM_IDS] = {
+    [TRACE_DECODE] = { "decode", "audio", { { "max_bytes" }, { "bytes", "pos" } } },
+    [TRACE_PROVIDE_BUF] = { "provide_buf", "audio", { { NULL }, { "bytes" } } },
+    [TRACE_COMMIT_BUF] = { "commit_buf", "audio", { { "bytes" } } },
+    [TRACE_SINK_REQUEST] = { "sink_request", "audio", { { "bytes" } } },
+    [TRACE_WATCH] = { "watch", "loop", { { NULL } }, true },
+    [TRACE_TIMER] = { "timer", "loop", { { NULL } }, true },
+    [TRACE_DEFER] = { "defer", "loop", { { NULL } }, true },
+    [TRACE_DELEGATE] = { "delegate", "loop", { { NULL } }, true },
+    [TRACE_JOB] = { "job", "worker", { { NULL } }, true },
+};
+
+atomic_bool trace_enabled__;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings[TRACE_MAX_RINGS];
+static size_t trace_num_rings;
+static u64 trace_exits;
+static pthread_key_t trace_key;
+
+static _Thread_local struct trace_ring *trace_ring;
+// Set if all rings were taken when the thread recorded its first event.
+static _Thread_local bool trace_ringless;
+
+static void trace_thread_exit(void *opaque)
+{
+    struct trace_ring *r = opaque;
+    auto_unlock lock = thread_mutex_lock(&trace_mutex);
+    r->exited = ++trace_exits;
+}
+
+void trace_enable(void)
+{
+    BUG_ON(pthread_key_create(&trace_key, trace_thread_exit));
+    atomic_store(&trace_enabled__, true);
+}
+
+// Takes over the ring of the thread that exited first if there are too many rings.
+static struct trace_ring *trace_ring_new(void)
+{
+    auto_unlock lock = thread_mutex_lock(&trace_mutex);
+    struct trace_ring *r = NULL;
+    if (trace_num_rings < TRACE_MAX_RINGS) {
+        r = xnew0(struct trace_ring);
+        trace_rings[trace_num_rings++] = r;
+    } else {
+        for (size_t i = 0; i < trace_num_rings; i++) {
+            auto o = trace_rings[i];
+            if (o->exited && (!r || o->exited < r->exited))
+                r = o;
+        }
+        if (!r)
+            return NULL;
+    }
+    r->start = atomic_load_explicit(&r->head, memory_order_relaxed);
+    r->exited = 0;
+    r->tid = (int)syscall(SYS_gettid);
+    snprintf(r->name, sizeof(r->name), "thread %d", r->tid);
+    BUG_ON(pthread_setspecific(trace_key, r));
+    return r;
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+    if (!trace_ring && !trace_ringless) {
+        trace_ring = trace_ring_new();
+        trace_ringless = !trace_ring;
+    }
+    return trace_ring;
+}
+
+void trace_emit__(enum trace_id id, enum trace_phase phase, u64 a0, u64 a1)
+{
+    auto r = trace_ring_get();
+    if (!r)
+        return;
+
+    auto head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    auto e = &r->events[head % TRACE_RING_EVENTS];
+    // A reader that sees any of the following stores also sees the current head and
+    // therefore knows that the event is being overwritten.
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&e->ts_ns, utils_get_mono_time_ns(), memory_order_relaxed);
+    atomic_store_explicit(&e->info, (u64)id | (u64)phase << 16, memory_order_relaxed);
+    atomic_store_explicit(&e->args[0], a0, memory_order_relaxed);
+    atomic_store_explicit(&e->args[1], a1, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_thread_name(const char *fmt, ...)
+{
+    if (!trace_enabled())
+        return;
+    auto r = trace_ring_get();
+    if (!r)
+        return;
+
+    auto_unlock lock = thread_mutex_lock(&trace_mutex);
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r->name, sizeof(r->name), fmt, ap);
+    va_end(ap);
+}
+
+// Has to be called with trace_mutex held. The owner keeps recording while the events
+// are copied, so the ones it might have overwritten in the meantime are dropped.
+static void trace_ring_snapshot(struct trace_ring *r, struct trace_snapshot *s)
+{
+    s->tid = r->tid;
+    snprintf(s->name, sizeof(s->name), "%s", r->name);
+
+    auto head = atomic_load_explicit(&r->head, memory_order_acquire);
+    auto first = max(r->start, head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0);
+    s->events = xnew_array(struct trace_snapshot_event, head - first);
+    for (auto i = first; i < head; i++) {
+        auto e = &r->events[i % TRACE_RING_EVENTS];
+        auto c = &s->events[i - first];
+        c->ts_ns = atomic_load_explicit(&e->ts_ns, memory_order_relaxed);
+        c->info = atomic_load_explicit(&e->info, memory_order_relaxed);
+        c->args[0] = atomic_load_explicit(&e->args[0], memory_order_relaxed);
+        c->args[1] = atomic_load_explicit(&e->args[1], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    // The owner might be overwriting the event before the current head.
+    auto now = atomic_load_explicit(&r->head, memory_order_relaxed);
+    auto valid = now >= TRACE_RING_EVENTS ? now - TRACE_RING_EVENTS + 1 : 0;
+    auto skip = min(valid > first ? valid - first : 0, head - first);
+    s->num = head - first - skip;
+    memmove(s->events, s->events + skip, s->num * sizeof(*s->events));
+}
+
+static void trace_export_args(FILE *file, const char *const *names, const u64 *args)
+{
+    if (!names[0])
+        return;
+    fprintf(file, ",\"args\":{\"%s\":%"PRIu64, names[0], args[0]);
+    if (names[1])
+        fprintf(file, ",\"%s\":%"PRIu64, names[1], args[1]);
+    fprintf(file, "}");
+}
+
+static void trace_export_event(FILE *file, int pid, int tid,
+        const struct trace_snapshot_event *e)
+{
+    static const char phases[] = { 'B', 'E', 'i' };
+
+    auto id = (enum trace_id)(e->info & 0xffff);
+    auto phase = (enum trace_phase)(e->info >> 16);
+    auto desc = &trace_descs[id];
+    fprintf(file, ",\n{\"ph\":\"%c\",\"ts\":%"PRIu64".%03"PRIu64",\"pid\":%d,\"tid\":%d",
+            phases[phase], e->ts_ns / 1000, e->ts_ns % 1000, pid, tid);
+    if (phase == TRACE_PHASE_END) {
+        trace_export_args(file, desc->args[1], e->args);
+        fprintf(file, "}");
+        return;
+    }
+
+    // Callbacks are named after their function so that they can be told apart.
+    char fn[128] = "";
+    if (desc->fn)
+        debug_addr_name((uintptr_t)e->args[0], fn, sizeof(fn));
+    fprintf(file, ",\"name\":\"%s%s%s\",\"cat\":\"%s\"", desc->name, *fn ? " " : "", fn,
+            desc->cat);
+    if (phase == TRACE_PHASE_INSTANT)
+        fprintf(file, ",\"s\":\"t\"");
+    trace_export_args(file, desc->args[0], e->args);
+    fprintf(file, "}");
+}
+
+void trace_export(FILE *file)
+{
+    // The rings are copied first so that threads that start in the meantime do not wait
+    // for the file.
+    size_t num = 0;
+    struct trace_snapshot snapshots[TRACE_MAX_RINGS];
+    {
+        auto_unlock lock = thread_mutex_lock(&trace_mutex);
+        for (; num < trace_num_rings; num++)
+            trace_ring_snapshot(trace_rings[num], &snapshots[num]);
+    }
+
+    auto pid = (int)getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"oka\"}}", pid, pid);
+    for (size_t i = 0; i < num; i++) {
+        auto s = &snapshots[i];
+        fprintf(file, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", pid, s->tid, s->name);
+        for (size_t j = 0; j < s->num; j++)
+            trace_export_event(file, pid, s->tid, &s->events[j]);
+        free(s->events);
+    }
+    fprintf(file, "\n]}\n");
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
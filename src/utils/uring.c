@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils/uring.h"
+#include "utils/utils.h"
+#include "utils/xmalloc.h"
+#include "utils/debug.h"
+
+// Completions are never dropped and the rings share one mapping. Multishot polls,
+// timeout updates and timeouts on all clocks are older than IORING_FEAT_CQE_SKIP (5.17).
+#define URING_FEATURES \
+    (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_CQE_SKIP)
+
+// The kernel writes sq_head, cq_tail and sq_flags, we write sq_tail and cq_head.
+// sqe_tail is the tail including the SQEs that have not been published yet.
+struct uring {
+    int fd;
+
+    _Atomic u32 *sq_head;
+    _Atomic u32 *sq_tail;
+    _Atomic u32 *sq_flags;
+    u32 sq_mask;
+    u32 sq_entries;
+    u32 sqe_tail;
+    struct io_uring_sqe *sqes;
+
+    _Atomic u32 *cq_head;
+    _Atomic u32 *cq_tail;
+    u32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+static int uring_setup(u32 entries, u32 flags, struct io_uring_params *p)
+{
+    *p = (struct io_uring_params) { .flags = flags };
+    return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+struct uring *uring_new(u32 entries)
+{
+    // Completions are handled when the loop enters the kernel anyway, so there is no
+    // need to interrupt it. Older kernels do not know the flags.
+    struct io_uring_params p;
+    int fd = uring_setup(entries, IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG,
+            &p);
+    if (fd == -1 && errno == EINVAL)
+        fd = uring_setup(entries, 0, &p);
+    if (fd == -1)
+        return NULL;
+    if ((p.features & URING_FEATURES) != URING_FEATURES) {
+        close(fd);
+        return NULL;
+    }
+
+    auto r = xnew0(struct uring);
+    r->fd = fd;
+    r->ring_size = max(p.sq_off.array + p.sq_entries * sizeof(u32),
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+    r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+    BUG_ON(r->ring == MAP_FAILED);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQES);
+    BUG_ON(r->sqes == MAP_FAILED);
+
+    u8 *ring = r->ring;
+    r->sq_head = (void *)(ring + p.sq_off.head);
+    r->sq_tail = (void *)(ring + p.sq_off.tail);
+    r->sq_flags = (void *)(ring + p.sq_off.flags);
+    r->sq_mask = *(u32 *)(ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (void *)(ring + p.cq_off.head);
+    r->cq_tail = (void *)(ring + p.cq_off.tail);
+    r->cq_mask = *(u32 *)(ring + p.cq_off.ring_mask);
+    r->cqes = (void *)(ring + p.cq_off.cqes);
+
+    // SQE i is always in slot i.
+    u32 *array = (void *)(ring + p.sq_off.array);
+    for (u32 i = 0; i < p.sq_entries; i++)
+        array[i] = i;
+
+    return r;
+}
+
+void uring_free(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring, r->ring_size);
+    close(r->fd);
+    free(r);
+}
+
+static bool uring_cq_empty(struct uring *r)
+{
+    return atomic_load_explicit(r->cq_head, memory_order_relaxed) ==
+            atomic_load_explicit(r->cq_tail, memory_order_acquire);
+}
+
+void uring_enter(struct uring *r, bool wait)
+{
+    atomic_store_explicit(r->sq_tail, r->sqe_tail, memory_order_release);
+    auto submit = r->sqe_tail - atomic_load_explicit(r->sq_head, memory_order_acquire);
+    wait = wait && uring_cq_empty(r);
+
+    u32 flags = 0;
+    auto sq_flags = atomic_load_explicit(r->sq_flags, memory_order_relaxed);
+    if (wait || sq_flags & (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN))
+        flags |= IORING_ENTER_GETEVENTS;
+    if (submit == 0 && flags == 0)
+        return;
+
+    // The SQEs that could not be submitted stay in the queue.
+    if (syscall(SYS_io_uring_enter, r->fd, submit, wait ? 1 : 0, flags, NULL, 0) == -1)
+        BUG_ON(errno != EINTR && errno != EAGAIN && errno != EBUSY);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    while (r->sqe_tail - atomic_load_explicit(r->sq_head, memory_order_acquire) ==
+            r->sq_entries)
+        uring_enter(r, false);
+    auto sqe = &r->sqes[r->sqe_tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+size_t uring_pop_cqes(struct uring *r, struct io_uring_cqe *cqes, size_t num)
+{
+    auto head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    auto tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+    size_t n = 0;
+    for (; n < num && head != tail; n++)
+        cqes[n] = r->cqes[head++ & r->cq_mask];
+    atomic_store_explicit(r->cq_head, head, memory_order_release);
+    return n;
+}
+
+// vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1
@@ -26,6 +26,13 @@ u64 utils_get_mono_time_ms(void)
     return 1000 * (u64)tp.tv_sec + (u64)tp.tv_nsec / (1000 * 1000);
 }
 
+u64 utils_get_mono_time_ns(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return 1000 * 1000 * 1000 * (u64)tp.tv_sec + (u64)tp.tv_nsec;
+}
+
 
 
 int utils_eventfd(void)
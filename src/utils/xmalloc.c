@@ -27,6 +27,15 @@ char *xstrdup(const char *s)
     return res;
 }
 
+// Copies len bytes of s. s does not have to be NUL-terminated.
+char *xstrndup(const char *s, size_t len)
+{
+    auto res = xnew_array(char, len + 1);
+    memcpy(res, s, len);
+    res[len] = 0;
+    return res;
+}
+
 char *xstrjoin__(struct slice slice)
 {
     const char **str = slice.ptr;
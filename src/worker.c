@@ -1,37 +1,76 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "utils/utils.h"
 #include "utils/channel.h"
 #include "utils/xmalloc.h"
 #include "utils/thread.h"
 #include "utils/signals.h"
+#include "utils/trace.h"
 
 #include "worker.h"
 
+#define WORKER_TYPES 32
+#define WORKER_DEQUE_INIT 16
+
 struct worker_job {
     u32 type;
     worker_job_cb job_cb;
     worker_free_cb free_cb;
     void *data;
+    u64 queued_ns;
 };
 
-struct worker {
+// A ring buffer of jobs. The owner takes jobs from the front so that jobs added by
+// the same thread run in order. Other threads steal from the back.
+struct worker_deque {
+    pthread_mutex_t mutex;
+    struct worker_job **jobs;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+struct worker_thread {
+    struct worker *worker;
     pthread_t thread;
-    struct channel *jobs;
-    struct channel *results;
+    size_t idx;
+    struct worker_deque deques[WORKER_NUM_PRIORITIES];
     struct worker_job *current;
     atomic_bool cancel_current;
-    pthread_mutex_t mutex;
 };
 
-struct worker_cancel_data {
-    struct worker *worker;
-    worker_cancel_job_cb cb;
-    void *opaque;
+struct worker_type {
+    _Atomic u64 jobs;
+    _Atomic u64 wait_ns;
+    _Atomic u64 run_ns;
+    _Atomic u64 max_ns;
 };
 
+// queued counts the jobs of a priority in all deques. It is incremented before a job is
+// pushed so that a sleeping thread that sees it at 0 cannot miss a job. running counts
+// the jobs of a priority that are running and is capped by limit.
+struct worker {
+    struct worker_thread *threads;
+    size_t num_threads;
+    _Atomic size_t next;
+    _Atomic size_t queued[WORKER_NUM_PRIORITIES];
+    _Atomic size_t running[WORKER_NUM_PRIORITIES];
+    _Atomic size_t limit[WORKER_NUM_PRIORITIES];
+    _Atomic size_t sleepers;
+    _Atomic u64 steals;
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct channel *results;
+    struct worker_type types[WORKER_TYPES];
+};
+
+static _Thread_local struct worker_thread *worker_self;
+
 static void worker_unlock(struct worker *w, pthread_mutex_t **mutex)
 {
     thread_mutex_unlock(&w->mutex);
@@ -43,65 +82,274 @@ static pthread_mutex_t *worker_lock(struct worker *w)
     return thread_mutex_lock(&w->mutex);
 }
 
-static void *worker_loop(void *arg)
+static void worker_deque_init(struct worker_deque *d)
 {
-    struct worker *w = arg;
-    while (1) {
-        auto_free auto job = channel_pop_wait(w->jobs, struct worker_job);
-        if (!job)
-            break;
+    d->mutex = THREAD_MUTEX_INIT;
+    d->jobs = xnew_array(struct worker_job *, WORKER_DEQUE_INIT);
+    d->head = 0;
+    d->len = 0;
+    d->cap = WORKER_DEQUE_INIT;
+}
 
+static struct worker_job *worker_deque_get(struct worker_deque *d, size_t i)
+{
+    return d->jobs[(d->head + i) & (d->cap - 1)];
+}
+
+static void worker_deque_grow(struct worker_deque *d)
+{
+    if (d->len < d->cap)
+        return;
+    auto jobs = xnew_array(struct worker_job *, 2 * d->cap);
+    for (size_t i = 0; i < d->len; i++)
+        jobs[i] = worker_deque_get(d, i);
+    free(d->jobs);
+    d->jobs = jobs;
+    d->head = 0;
+    d->cap *= 2;
+}
+
+static void worker_deque_push(struct worker_deque *d, struct worker_job *job)
+{
+    auto_unlock lock = thread_mutex_lock(&d->mutex);
+    worker_deque_grow(d);
+    d->jobs[(d->head + d->len++) & (d->cap - 1)] = job;
+}
+
+static void worker_deque_push_front(struct worker_deque *d, struct worker_job *job)
+{
+    auto_unlock lock = thread_mutex_lock(&d->mutex);
+    worker_deque_grow(d);
+    d->head = (d->head - 1) & (d->cap - 1);
+    d->jobs[d->head] = job;
+    d->len++;
+}
+
+static struct worker_job *worker_deque_pop_front(struct worker_deque *d)
+{
+    auto_unlock lock = thread_mutex_lock(&d->mutex);
+    if (d->len == 0)
+        return NULL;
+    auto job = worker_deque_get(d, 0);
+    d->head = (d->head + 1) & (d->cap - 1);
+    d->len--;
+    return job;
+}
+
+static struct worker_job *worker_deque_pop_back(struct worker_deque *d)
+{
+    auto_unlock lock = thread_mutex_lock(&d->mutex);
+    if (d->len == 0)
+        return NULL;
+    return worker_deque_get(d, --d->len);
+}
+
+// Removes the jobs the callback selects, in order, into out and returns how many were
+// removed.
+static size_t worker_deque_remove(struct worker_deque *d, worker_match_job_cb cb,
+        void *opaque, struct worker_job ***out)
+{
+    auto_unlock lock = thread_mutex_lock(&d->mutex);
+    size_t kept = 0, removed = 0;
+    *out = NULL;
+    for (size_t i = 0; i < d->len; i++) {
+        auto job = worker_deque_get(d, i);
+        if (cb(job->type, job->data, opaque)) {
+            if (!*out)
+                *out = xnew_array(struct worker_job *, d->len - i);
+            (*out)[removed++] = job;
+        } else {
+            d->jobs[(d->head + kept++) & (d->cap - 1)] = job;
+        }
+    }
+    d->len = kept;
+    return removed;
+}
+
+static size_t worker_queued(struct worker *w)
+{
+    size_t queued = 0;
+    for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++)
+        queued += w->queued[p];
+    return queued;
+}
+
+static bool worker_runnable(struct worker *w)
+{
+    for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++) {
+        if (w->queued[p] > 0 && w->running[p] < w->limit[p])
+            return true;
+    }
+    return false;
+}
+
+static void worker_wake(struct worker *w)
+{
+    if (w->sleepers > 0) {
         auto_unlock lock = worker_lock(w);
-        w->cancel_current = false;
-        w->current = job;
-        worker_unlock(w, &lock);
+        thread_cond_signal(&w->cond);
+    }
+}
 
-        job->job_cb(w, job->data);
+static bool worker_reserve(struct worker *w, size_t prio)
+{
+    auto running = w->running[prio];
+    do {
+        if (running >= w->limit[prio])
+            return false;
+    } while (!atomic_compare_exchange_weak(&w->running[prio], &running, running + 1));
+    return true;
+}
 
-        lock = worker_lock(w);
-        job->free_cb(w, job->data);
-        w->current = NULL;
+// A job of the priority may have been held back by the limit.
+static void worker_release(struct worker *w, size_t prio)
+{
+    w->running[prio]--;
+    if (w->queued[prio] > 0)
+        worker_wake(w);
+}
 
-        (void)lock;
+// Takes the most urgent job whose priority is below its limit, from the own deque if
+// possible, otherwise by stealing from another thread.
+static struct worker_job *worker_take(struct worker_thread *t, size_t *prio)
+{
+    auto w = t->worker;
+    for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++) {
+        if (w->queued[p] == 0 || !worker_reserve(w, p))
+            continue;
+        auto job = worker_deque_pop_front(&t->deques[p]);
+        for (size_t i = 1; !job && i < w->num_threads; i++) {
+            auto victim = &w->threads[(t->idx + i) % w->num_threads];
+            job = worker_deque_pop_back(&victim->deques[p]);
+            if (job)
+                w->steals++;
+        }
+        if (job) {
+            w->queued[p]--;
+            *prio = p;
+            return job;
+        }
+        worker_release(w, p);
     }
     return NULL;
 }
 
-struct worker *worker_new(void)
+static void worker_update_max(_Atomic u64 *max, u64 val)
 {
-    auto_restore sigs = signals_block_all();
+    auto cur = atomic_load_explicit(max, memory_order_relaxed);
+    while (cur < val && !atomic_compare_exchange_weak(max, &cur, val))
+        ;
+}
 
-    auto worker = xnew_uninit(struct worker);
-    worker->jobs = channel_new(false);
-    worker->results = channel_new(true);
-    worker->current = NULL;
-    worker->cancel_current = false;
-    worker->mutex = THREAD_MUTEX_INIT;
-    thread_create(&worker->thread, NULL, worker_loop, worker);
-    return worker;
+// Jobs are accounted to the lowest bit of their type.
+static void worker_account(struct worker *w, struct worker_job *job, u64 start, u64 end)
+{
+    auto t = &w->types[job->type ? __builtin_ctz(job->type) : 0];
+    t->jobs++;
+    t->wait_ns += start - job->queued_ns;
+    t->run_ns += end - start;
+    worker_update_max(&t->max_ns, end - job->queued_ns);
 }
 
-static bool worker_cancel_job_channel_cb(void *data, void *opaque)
+static void worker_run_job(struct worker_thread *t, struct worker_job *job)
 {
-    struct worker_cancel_data *cd = opaque;
-    struct worker_job *job = data;
-    auto ret = cd->cb(job->type, job->data, cd->opaque);
-    if (ret) {
-        job->free_cb(cd->worker, job->data);
-        free(job);
+    auto w = t->worker;
+    auto start = utils_get_mono_time_ns();
+
+    auto_unlock lock = worker_lock(w);
+    t->cancel_current = false;
+    t->current = job;
+    worker_unlock(w, &lock);
+
+    trace_begin(TRACE_JOB, (uintptr_t)job->job_cb, 0);
+    job->job_cb(w, job->data);
+    trace_end(TRACE_JOB, 0, 0);
+
+    lock = worker_lock(w);
+    job->free_cb(w, job->data);
+    t->current = NULL;
+    worker_unlock(w, &lock);
+
+    worker_account(w, job, start, utils_get_mono_time_ns());
+    free(job);
+}
+
+// Returns false once the worker is being freed and no jobs are left.
+static bool worker_wait(struct worker *w)
+{
+    auto_unlock lock = worker_lock(w);
+    w->sleepers++;
+    while (!worker_runnable(w) && !(w->stop && worker_queued(w) == 0))
+        thread_cond_wait(&w->cond, &w->mutex);
+    w->sleepers--;
+    return !w->stop || worker_queued(w) > 0;
+}
+
+static void *worker_loop(void *arg)
+{
+    struct worker_thread *t = arg;
+    auto w = t->worker;
+    worker_self = t;
+    trace_thread_name("worker %zu", t->idx);
+
+    while (1) {
+        size_t prio;
+        auto job = worker_take(t, &prio);
+        if (job) {
+            worker_run_job(t, job);
+            worker_release(w, prio);
+        } else if (!worker_wait(w)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static size_t worker_default_threads(void)
+{
+    auto cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+struct worker *worker_new(size_t threads)
+{
+    auto_restore sigs = signals_block_all();
+
+    auto worker = xnew0(struct worker);
+    worker->num_threads = threads ? threads : worker_default_threads();
+    worker->threads = xnew_array(struct worker_thread, worker->num_threads);
+    worker->results = channel_new(true);
+    worker->mutex = THREAD_MUTEX_INIT;
+    worker->cond = THREAD_COND_INIT;
+    for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++)
+        worker->limit[p] = SIZE_MAX;
+    // Keep a thread free for latency-critical jobs.
+    worker->limit[WORKER_PRIORITY_LOW] = max(worker->num_threads - 1, (size_t)1);
+    for (size_t i = 0; i < worker->num_threads; i++) {
+        auto t = &worker->threads[i];
+        t->worker = worker;
+        t->idx = i;
+        t->current = NULL;
+        t->cancel_current = false;
+        for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++)
+            worker_deque_init(&t->deques[p]);
     }
-    return ret;
+    for (size_t i = 0; i < worker->num_threads; i++)
+        thread_create(&worker->threads[i].thread, NULL, worker_loop, &worker->threads[i]);
+    return worker;
 }
 
-void worker_push_result(struct worker *w, void *data)
+void worker_push_result(struct worker *w, struct channel_node *node)
 {
-    if (data)
-        channel_push(w->results, data);
+    if (node)
+        channel_push(w->results, node);
 }
 
+// Refers to the job of the calling thread.
 bool worker_cancel_current(const struct worker *w)
 {
-    return w->cancel_current;
+    BUG_ON(!worker_self || worker_self->worker != w);
+    return worker_self->cancel_current;
 }
 
 static bool worker_cancel_job_by_type_cb(u32 type, void *data, void *opaque)
@@ -116,39 +364,96 @@ void worker_cancel_job_by_type(struct worker *w, u32 type)
     worker_cancel_job(w, worker_cancel_job_by_type_cb, &type);
 }
 
-void worker_cancel_job(struct worker *w, worker_cancel_job_cb cb, void *opaque)
+void worker_cancel_job(struct worker *w, worker_match_job_cb cb, void *opaque)
 {
-    struct worker_cancel_data data = {
-        .worker = w,
-        .cb = cb,
-        .opaque = opaque,
-    };
-    channel_remove(w->jobs, worker_cancel_job_channel_cb, &data);
+    for (size_t i = 0; i < w->num_threads; i++) {
+        for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++) {
+            struct worker_job **jobs;
+            auto num = worker_deque_remove(&w->threads[i].deques[p], cb, opaque, &jobs);
+            w->queued[p] -= num;
+            for (size_t j = 0; j < num; j++) {
+                jobs[j]->free_cb(w, jobs[j]->data);
+                free(jobs[j]);
+            }
+            free(jobs);
+        }
+    }
 
     auto_unlock lock = worker_lock(w);
-    auto cur = w->current;
-    if (cur && cb(cur->type, cur->data, opaque))
-        w->cancel_current = true;
+    for (size_t i = 0; i < w->num_threads; i++) {
+        auto t = &w->threads[i];
+        auto cur = t->current;
+        if (cur && cb(cur->type, cur->data, opaque))
+            t->cancel_current = true;
+    }
 }
 
-void worker_add_job(struct worker *w, u32 type, worker_job_cb job_cb,
-        worker_free_cb free_cb, void *data)
+// Jobs added by a worker thread go to its own deque, others are distributed round-robin.
+void worker_add_job(struct worker *w, u32 type, enum worker_priority prio,
+        worker_job_cb job_cb, worker_free_cb free_cb, void *data)
 {
     auto job = xnew_uninit(struct worker_job);
     job->type = type;
     job->job_cb = job_cb;
     job->free_cb = free_cb;
     job->data = data;
-    channel_push(w->jobs, job);
+    job->queued_ns = utils_get_mono_time_ns();
+
+    auto t = worker_self;
+    if (!t || t->worker != w)
+        t = &w->threads[w->next++ % w->num_threads];
+
+    w->queued[prio]++;
+    worker_deque_push(&t->deques[prio], job);
+    worker_wake(w);
+}
+
+size_t worker_bump_job(struct worker *w, enum worker_priority prio,
+        worker_match_job_cb cb, void *opaque)
+{
+    size_t bumped = 0;
+    for (size_t i = 0; i < w->num_threads; i++) {
+        auto t = &w->threads[i];
+        for (size_t p = prio + 1; p < WORKER_NUM_PRIORITIES; p++) {
+            struct worker_job **jobs;
+            auto num = worker_deque_remove(&t->deques[p], cb, opaque, &jobs);
+            w->queued[prio] += num;
+            for (size_t j = num; j > 0; j--)
+                worker_deque_push_front(&t->deques[prio], jobs[j - 1]);
+            w->queued[p] -= num;
+            free(jobs);
+            bumped += num;
+        }
+    }
+    if (bumped)
+        worker_wake(w);
+    return bumped;
+}
+
+void worker_set_limit(struct worker *w, enum worker_priority prio, size_t limit)
+{
+    auto_unlock lock = worker_lock(w);
+    w->limit[prio] = max(limit, (size_t)1);
+    thread_cond_broadcast(&w->cond);
 }
 
 void worker_free(struct worker *w)
 {
     worker_cancel_job_by_type(w, (u32)-1);
-    channel_push(w->jobs, NULL);
-    thread_join(w->thread, NULL);
-    channel_free(w->jobs);
+
+    auto_unlock lock = worker_lock(w);
+    w->stop = true;
+    thread_cond_broadcast(&w->cond);
+    worker_unlock(w, &lock);
+
+    for (size_t i = 0; i < w->num_threads; i++) {
+        thread_join(w->threads[i].thread, NULL);
+        for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++)
+            free(w->threads[i].deques[p].jobs);
+    }
+    free(w->threads);
     channel_free(w->results);
+    free(w);
 }
 
 int worker_fd(const struct worker *w)
@@ -156,9 +461,32 @@ int worker_fd(const struct worker *w)
     return channel_fd(w->results);
 }
 
-void *worker_pop_result(struct worker *w)
+struct channel_node *worker_pop_result(struct worker *w)
+{
+    return channel_pop(w->results);
+}
+
+void worker_get_stats(const struct worker *w, struct worker_stats *s)
 {
-    return channel_pop(w->results, void);
+    *s = (struct worker_stats) {
+        .threads = w->num_threads,
+        .steals = w->steals,
+    };
+    for (size_t p = 0; p < WORKER_NUM_PRIORITIES; p++) {
+        s->queued[p] = w->queued[p];
+        s->running[p] = w->running[p];
+    }
+}
+
+void worker_get_type_stats(const struct worker *w, u32 type, struct worker_type_stats *s)
+{
+    auto t = &w->types[type ? __builtin_ctz(type) : 0];
+    *s = (struct worker_type_stats) {
+        .jobs = t->jobs,
+        .wait_ns = t->wait_ns,
+        .run_ns = t->run_ns,
+        .max_ns = t->max_ns,
+    };
 }
 
 // vim: et:sw=4:tw=90:ts=4:sts=4:cc=+1